@@ -0,0 +1,18 @@
+#ifndef __LIB_LZ_H
+#define __LIB_LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bytes of scratch memory that lz_compress() needs. */
+#define LZ_WORK_SIZE 8192
+
+/* Largest input that lz_compress() accepts. */
+#define LZ_MAX_INPUT 65535
+
+size_t lz_compress (const void *src, size_t src_len,
+		void *dst, size_t dst_cap, void *work);
+bool lz_decompress (const void *src, size_t src_len,
+		void *dst, size_t dst_len);
+
+#endif /* lib/lz.h */
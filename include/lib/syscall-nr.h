@@ -36,6 +36,14 @@ enum {
 
 	SYS_MOUNT,
 	SYS_UMOUNT,
+
+	/* Extra for Project 3 */
+	SYS_MADVISE,                /* Advise on the use of memory. */
+	SYS_VMSTAT,                 /* Report virtual memory statistics. */
+	SYS_MLOCK,                  /* Lock pages in memory. */
+	SYS_MUNLOCK,                /* Unlock pages. */
+	SYS_MLOCKALL,               /* Lock the whole address space. */
+	SYS_MUNLOCKALL,             /* Unlock the whole address space. */
 };
 
 #endif /* lib/syscall-nr.h */
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <debug.h>
 #include <stddef.h>
+#include <vmstat.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -13,6 +14,17 @@ typedef int pid_t;
 typedef int off_t;
 #define MAP_FAILED ((void *) NULL)
 
+/* Advice for madvise(). */
+#define MADV_NORMAL 0           /* No particular access pattern. */
+#define MADV_RANDOM 1           /* Expect random access. */
+#define MADV_SEQUENTIAL 2       /* Expect sequential access. */
+#define MADV_WILLNEED 3         /* Will be needed soon. */
+#define MADV_DONTNEED 4         /* Not needed any more. */
+
+/* Flags for mlockall(). */
+#define MCL_CURRENT 1           /* Lock the pages mapped now. */
+#define MCL_FUTURE 2            /* Lock pages mapped from now on. */
+
 /* Maximum characters in a filename written by readdir(). */
 #define READDIR_MAX_LEN 14
 
@@ -41,6 +53,12 @@ int dup2(int oldfd, int newfd);
 /* Project 3 and optionally project 4. */
 void *mmap (void *addr, size_t length, int writable, int fd, off_t offset);
 void munmap (void *addr);
+int madvise (void *addr, size_t length, int advice);
+int vmstat (int which, struct vmstat *stats);
+int mlock (void *addr, size_t length);
+int munlock (void *addr, size_t length);
+int mlockall (int flags);
+int munlockall (void);
 
 /* Project 4 only. */
 bool chdir (const char *dir);
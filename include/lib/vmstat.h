@@ -0,0 +1,30 @@
+#ifndef __LIB_VMSTAT_H
+#define __LIB_VMSTAT_H
+
+/* Virtual memory statistics, as returned by the vmstat() system
+ * call.  The kernel keeps one set for each process and one for the
+ * whole system. */
+
+/* Arguments to vmstat(). */
+#define VMSTAT_SELF 0           /* The calling process. */
+#define VMSTAT_ALL 1            /* The whole system since boot. */
+
+/* Number of fault latency buckets.  Bucket I counts the faults that
+ * took at least 2**I and less than 2**(I+1) cycles to handle; the last
+ * one also counts any slower faults. */
+#define VMSTAT_BUCKETS 32
+
+struct vmstat {
+	long long minor_fault_cnt;  /* Faults handled without disk reads. */
+	long long major_fault_cnt;  /* Faults that read from disk. */
+	long long stack_fault_cnt;  /* ...of the minor ones, stack growth. */
+	long long wp_fault_cnt;     /* Write faults on read-only mappings. */
+	long long evict_cnt[4];     /* Pages evicted, by VM_* page type. */
+	long long swap_read_cnt;    /* Pages read from the swap disk. */
+	long long swap_write_cnt;   /* Pages written to the swap disk. */
+	long long file_read_cnt;    /* Pages read from files. */
+	long long locked_cnt;       /* Pages locked in memory now. */
+	long long fault_cycles[VMSTAT_BUCKETS];  /* Fault latency. */
+};
+
+#endif /* lib/vmstat.h */
@@ -0,0 +1,35 @@
+#ifndef THREADS_MEMTRACK_H
+#define THREADS_MEMTRACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Allocators that report to the tracker. */
+enum memtrack_kind {
+	MT_MALLOC,                  /* malloc(), calloc(), realloc(). */
+	MT_PALLOC                   /* palloc_get_page(), palloc_get_multiple(). */
+};
+
+/* Per-allocation bookkeeping.  malloc() prepends one of these to
+   every block it hands out; palloc keeps one per pool page, used
+   only at the first page of each allocation. */
+struct memtrack_tag {
+	uint16_t site;              /* Index of the allocating call site. */
+	uint8_t epoch;              /* Leak-check epoch at allocation time. */
+	uint8_t live;               /* Nonzero until the block is freed. */
+	uint32_t size;              /* Bytes requested. */
+	uint64_t birth;             /* Time-stamp counter at allocation. */
+};
+
+/* -mtrack: Record per-call-site allocation statistics? */
+extern bool memtrack_enabled;
+
+void memtrack_alloc (struct memtrack_tag *, enum memtrack_kind,
+		const void *caller, size_t size);
+void memtrack_free (struct memtrack_tag *);
+void memtrack_mark (void);
+void memtrack_report_leaks (void);
+void memtrack_print_stats (void);
+
+#endif /* threads/memtrack.h */
@@ -2,27 +2,47 @@
 #define THREAD_MMU_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "threads/pte.h"
 
 typedef bool pte_for_each_func (uint64_t *pte, void *va, void *aux);
 
 uint64_t *pml4e_walk (uint64_t *pml4, const uint64_t va, int create);
+uint64_t *pml4e_walk_pde (uint64_t *pml4, const uint64_t va, int create);
+void pml4_template_init (void);
 uint64_t *pml4_create (void);
 bool pml4_for_each (uint64_t *, pte_for_each_func *, void *);
 void pml4_destroy (uint64_t *pml4);
 void pml4_activate (uint64_t *pml4);
+void pml4_switch (uint64_t *pml4);
 void *pml4_get_page (uint64_t *pml4, const void *upage);
 bool pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw);
-void pml4_clear_page (uint64_t *pml4, void *upage);
+bool pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw);
+bool pml4_clear_page (uint64_t *pml4, void *upage);
+bool pml4_split_page (uint64_t *pml4, const void *upage);
+bool pml4_move_page (uint64_t *pml4, void *upage, void *kpage);
 bool pml4_is_dirty (uint64_t *pml4, const void *upage);
-void pml4_set_dirty (uint64_t *pml4, const void *upage, bool dirty);
+bool pml4_set_dirty (uint64_t *pml4, const void *upage, bool dirty);
 bool pml4_is_accessed (uint64_t *pml4, const void *upage);
 void pml4_set_accessed (uint64_t *pml4, const void *upage, bool accessed);
+bool pml4_set_writable (uint64_t *pml4, const void *upage, bool writable);
+bool pml4_set_range (uint64_t *pml4, void *upage, void *const kpages[],
+		size_t cnt, bool rw);
+bool pml4_clear_range (uint64_t *pml4, void *start, void *end);
+bool pml4_protect_range (uint64_t *pml4, void *start, void *end,
+		bool writable);
+
+void pcid_init (void);
+bool pcid_is_enabled (void);
+void tlb_print_stats (void);
+void tlb_invalidate (uint64_t *pml4, const void *va);
+void tlb_invalidate_kernel (const void *va);
 
 #define is_writable(pte) (*(pte) & PTE_W)
 #define is_user_pte(pte) (*(pte) & PTE_U)
 #define is_kern_pte(pte) (!is_user_pte (pte))
+#define is_huge_pte(pte) (*(pte) & PTE_PS)
 
 #define pte_get_paddr(pte) (pg_round_down(*(pte)))
 
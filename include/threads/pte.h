@@ -41,5 +41,16 @@
 #define PTE_U 0x4                        /* 1=user/kernel, 0=kernel only. */
 #define PTE_A 0x20                       /* 1=accessed, 0=not acccessed. */
 #define PTE_D 0x40                       /* 1=dirty, 0=not dirty (PTEs only). */
+#define PTE_PS 0x80                      /* 1=PDE maps a 2 MB page directly. */
+
+/* A page directory entry with PTE_PS set maps a whole 2 MB
+   "huge page" instead of pointing to a page table.  Such an
+   entry has the same flag layout as a PTE, except that the
+   address of the page is 2 MB aligned. */
+#define HPGSHIFT PDXSHIFT
+#define HPGSIZE  (1UL << HPGSHIFT)       /* Bytes in a huge page. */
+#define HPGMASK  (HPGSIZE - 1)
+#define HPG_PAGES (HPGSIZE / PGSIZE)     /* 4 kB pages per huge page. */
+#define HPTE_ADDR(pde) (PTE_ADDR (pde) & ~HPGMASK)
 
 #endif /* threads/pte.h */
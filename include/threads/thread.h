@@ -98,6 +98,7 @@ struct thread {
 #ifdef USERPROG
 	/* Owned by userprog/process.c. */
 	uint64_t *pml4;                     /* Page map level 4 */
+	bool user;                          /* Counted as a user process? */
 #endif
 #ifdef VM
 	/* Table for whole virtual memory owned by thread. */
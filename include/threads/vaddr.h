@@ -34,6 +34,16 @@
 /* Kernel virtual address start */
 #define KERN_BASE LOADER_KERN_BASE
 
+/* Kernel virtual range for vmalloc().  It lies in the same
+   page-map-level-4 slot as the physical memory map, whose page
+   tables every process shares, far above any physical memory. */
+#define VMALLOC_START 0xc000000000
+#define VMALLOC_END   (VMALLOC_START + 0x4000000)
+
+/* Returns true if VADDR lies in the vmalloc() range. */
+#define is_vmalloc_vaddr(vaddr) \
+	((uint64_t) (vaddr) >= VMALLOC_START && (uint64_t) (vaddr) < VMALLOC_END)
+
 /* User stack start */
 #define USER_STACK 0x47480000
 
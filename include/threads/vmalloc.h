@@ -0,0 +1,17 @@
+#ifndef THREADS_VMALLOC_H
+#define THREADS_VMALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct bitmap;
+
+void vmalloc_init (void);
+void *vmalloc (size_t size);
+void vfree (void *);
+
+void vmalloc_compact_begin (struct bitmap *movable, const void *base);
+bool vmalloc_move_page (void *from, void *to);
+void vmalloc_compact_end (void);
+
+#endif /* threads/vmalloc.h */
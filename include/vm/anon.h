@@ -1,13 +1,30 @@
 #ifndef VM_ANON_H
 #define VM_ANON_H
+#include <list.h>
+#include <stdint.h>
 #include "vm/vm.h"
 struct page;
 enum vm_type;
 
+/* Marks an anonymous page with no copy in swap. */
+#define SLOT_NONE SIZE_MAX
+
+/* Marks an anonymous page with no copy in the compressed pool. */
+#define ZCHUNK_NONE UINT32_MAX
+
 struct anon_page {
+	size_t slot;                /* Swap slot with a copy, or SLOT_NONE. */
+	uint32_t zchunk;            /* First chunk in zswap pool, or ZCHUNK_NONE. */
+	uint16_t zsize;             /* Compressed size in bytes. */
+	struct list_elem zelem;     /* Element in zswap age list. */
 };
 
+/* -zswap: Pages of memory for compressed swap. */
+extern size_t zswap_pages;
+
 void vm_anon_init (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
+bool anon_has_swap_copy (const struct page *page);
+void anon_print_stats (void);
 
 #endif
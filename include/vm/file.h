@@ -3,10 +3,32 @@
 #include "filesys/file.h"
 #include "vm/vm.h"
 
+struct frame;
 struct page;
+struct supplemental_page_table;
 enum vm_type;
 
+/* A run of pages whose contents come from a file: a segment of an
+ * executable or a memory-mapped file.  The pages of a region share it,
+ * each holding a reference, as do pending pages through their AUX. */
+struct file_region {
+	struct file *file;          /* Reopened for the region. */
+	off_t ofs;                  /* File offset of START. */
+	uint8_t *start;             /* First page. */
+	size_t page_cnt;            /* Number of pages. */
+	size_t read_bytes;          /* Bytes from the file; the rest is zero. */
+	int refcnt;                 /* References held. */
+
+	/* Fault-around state, see vm_fault_around(). */
+	uint8_t *next_fault;        /* Next fault if access is sequential. */
+	uint8_t *ahead_start;       /* First page last mapped ahead. */
+	size_t ahead_cnt;           /* Number of pages last mapped ahead. */
+	size_t window;              /* Pages to map ahead of a fault. */
+	enum vm_advice advice;      /* VM_ADV_NORMAL, _RANDOM or _SEQUENTIAL. */
+};
+
 struct file_page {
+	struct file_region *region; /* Where the contents come from. */
 };
 
 void vm_file_init (void);
@@ -14,4 +36,18 @@ bool file_backed_initializer (struct page *page, enum vm_type type, void *kva);
 void *do_mmap(void *addr, size_t length, int writable,
 		struct file *file, off_t offset);
 void do_munmap (void *va);
+void file_write_back (struct supplemental_page_table *spt, void *start,
+		void *end);
+void file_print_stats (void);
+void file_cache_frame (struct page *page, struct frame *frame);
+bool file_share_frame (struct page *page);
+
+struct file_region *file_region_create (struct file *file, off_t ofs,
+		void *start, size_t read_bytes, size_t zero_bytes);
+struct file_region *file_region_get (struct file_region *region);
+void file_region_put (struct file_region *region);
+bool file_region_read (struct file_region *region, struct page *page,
+		void *kva);
+bool file_region_is_zero (struct file_region *region, void *va);
+struct file_region *page_file_region (struct page *page);
 #endif
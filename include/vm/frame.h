@@ -0,0 +1,48 @@
+#ifndef VM_FRAME_H
+#define VM_FRAME_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "threads/synch.h"
+
+struct frame;
+struct page;
+
+/* Index that marks the end of a frame table link. */
+#define FRAME_NONE UINT32_MAX
+
+/* Frame descriptors for the user pool, one per page, indexed by page
+ * frame number relative to the start of the pool.  The array is carved
+ * out by palloc_init(). */
+extern struct frame *memmap;
+extern size_t memmap_cnt;
+extern uint8_t *memmap_kva;     /* Kernel address of memmap[0]'s page. */
+
+/* Protects the frame table, frame flags and sharer chains. */
+extern struct lock frame_lock;
+
+void frame_init (void);
+struct frame *pfn_to_frame (uint64_t pfn);
+uint64_t frame_to_pfn (const struct frame *frame);
+struct frame *kva_to_frame (const void *kva);
+void *frame_kva (const struct frame *frame);
+
+void frame_table_insert (struct frame *frame);
+void frame_table_remove (struct frame *frame);
+struct frame *frame_table_next (struct frame *frame);
+size_t frame_table_size (void);
+void frame_free (struct frame *frame);
+
+bool frame_is_accessed (const struct frame *frame);
+void frame_clear_accessed (struct frame *frame);
+bool frame_is_dirty (const struct frame *frame);
+
+bool frame_movable (const struct frame *frame);
+bool frame_migrate (struct frame *from, struct frame *to);
+
+void frame_add_page (struct frame *frame, struct page *page);
+void frame_remove_page (struct frame *frame, struct page *page);
+void frame_update_pinned (struct frame *frame);
+void frame_wait_evict (struct page *page);
+void frame_evict_done (struct frame *frame);
+#endif
@@ -0,0 +1,14 @@
+#ifndef VM_MERGE_H
+#define VM_MERGE_H
+#include <stdbool.h>
+
+struct frame;
+
+/* -merge: Milliseconds between same-page merging batches, or 0 to
+ * leave same-page merging off. */
+extern unsigned merge_interval;
+
+void merge_init (void);
+bool merge_candidate (struct frame *frame);
+void merge_print_stats (void);
+#endif
@@ -13,6 +13,7 @@ struct uninit_page {
 	/* Initiate the contets of the page */
 	vm_initializer *init;
 	enum vm_type type;
+	/* A struct file_region holding a reference for this page, or NULL. */
 	void *aux;
 	/* Initiate the struct page and maps the pa to the va */
 	bool (*page_initializer) (struct page *, enum vm_type, void *kva);
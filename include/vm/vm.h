@@ -1,6 +1,8 @@
 #ifndef VM_VM_H
 #define VM_VM_H
 #include <stdbool.h>
+#include <stdint.h>
+#include <vmstat.h>
 #include "threads/palloc.h"
 
 enum vm_type {
@@ -24,9 +26,28 @@ enum vm_type {
 	VM_MARKER_END = (1 << 31),
 };
 
+/* Marks the pages of the user stack. */
+#define VM_STACK VM_MARKER_0
+
+/* Advice given by vm_madvise().  Must agree with the MADV_* values in
+ * lib/user/syscall.h. */
+enum vm_advice {
+	VM_ADV_NORMAL = 0,          /* No particular access pattern. */
+	VM_ADV_RANDOM = 1,          /* Random access: map nothing ahead. */
+	VM_ADV_SEQUENTIAL = 2,      /* Sequential access. */
+	VM_ADV_WILLNEED = 3,        /* Needed soon: read it in now. */
+	VM_ADV_DONTNEED = 4,        /* Not needed: drop it now. */
+};
+
+/* Flags for vm_mlockall().  Must agree with the MCL_* values in
+ * lib/user/syscall.h. */
+#define VM_MCL_CURRENT 1        /* Lock the pages mapped now. */
+#define VM_MCL_FUTURE 2         /* Lock pages mapped from now on. */
+
 #include "vm/uninit.h"
 #include "vm/anon.h"
 #include "vm/file.h"
+#include "vm/frame.h"
 #ifdef EFILESYS
 #include "filesys/page_cache.h"
 #endif
@@ -46,6 +67,11 @@ struct page {
 	struct frame *frame;   /* Back reference for frame */
 
 	/* Your implementation */
+	struct supplemental_page_table *spt;   /* Owning address space. */
+	uint64_t *pml4;            /* Page map that maps VA. */
+	struct page *frame_next;   /* Next page sharing FRAME. */
+	bool writable;             /* May the process write to VA? */
+	bool locked;               /* Locked in memory by mlock()? */
 
 	/* Per-type data are binded into the union.
 	 * Each function automatically detects the current union */
@@ -59,12 +85,26 @@ struct page {
 	};
 };
 
-/* The representation of "frame" */
+/* The representation of "frame".
+ * There is one descriptor for every page of the user pool, kept in the
+ * memmap array indexed by page frame number (see vm/frame.c).  Keep it
+ * small: it costs this many bytes for every user page in the machine. */
 struct frame {
-	void *kva;
-	struct page *page;
+	struct page *page;          /* First of the pages mapping this frame. */
+	uint32_t lru_prev;          /* Frame table neighbours, as memmap */
+	uint32_t lru_next;          /*   indexes; FRAME_NONE if off the table. */
+	uint16_t flags;             /* FRAME_* bits. */
+	uint16_t refcnt;            /* Number of pages mapping this frame. */
 };
 
+/* Frame flags. */
+#define FRAME_LRU 0x1           /* On the frame table. */
+#define FRAME_PINNED 0x2        /* Must not be evicted. */
+#define FRAME_MERGED 0x4        /* Shared by same-page merging while on
+                                   the frame table. */
+#define FRAME_EVICTING 0x8      /* Off the frame table and unmapped
+                                   while its pages are written out. */
+
 /* The function table for page operations.
  * This is one way of implementing "interface" in C.
  * Put the table of "method" into the struct's member, and
@@ -82,22 +122,68 @@ struct page_operations {
 	if ((page)->operations->destroy) (page)->operations->destroy (page)
 
 /* Representation of current process's memory space.
- * We don't want to force you to obey any specific design for this struct.
- * All designs up to you for this. */
+ * A radix tree keyed by virtual page number with the same shape as the
+ * x86-64 page tables: four levels of 512-entry nodes, each node one
+ * page, indexed by the PML4, PDPE, PDX and PTX fields of the address.
+ * The leaves hold struct page pointers.  A lookup is four loads, and
+ * nodes exist only for the parts of the address space in use. */
 struct supplemental_page_table {
+	void **root;                /* Top-level node, or NULL if empty. */
+	size_t page_cnt;            /* Number of pages in the table. */
+	size_t node_cnt;            /* Number of nodes, including ROOT. */
+	bool lock_future;           /* Lock pages as they are added? */
+
+	struct vmstat stats;        /* Statistics for this process. */
 };
 
+/* Statistics for the whole system. */
+extern struct vmstat vm_stats;
+
+/* Adds one to FIELD of the statistics of SPT's process and of the
+ * system's. */
+#define vm_stat_inc(SPT, FIELD) ((SPT)->stats.FIELD++, vm_stats.FIELD++)
+
+/* Subtracts one from FIELD likewise, for the counts that go down. */
+#define vm_stat_dec(SPT, FIELD) ((SPT)->stats.FIELD--, vm_stats.FIELD--)
+
+/* Called by spt_for_each() for each page in a range. */
+typedef void spt_action_func (struct page *page, void *aux);
+
 #include "threads/thread.h"
 void supplemental_page_table_init (struct supplemental_page_table *spt);
 bool supplemental_page_table_copy (struct supplemental_page_table *dst,
 		struct supplemental_page_table *src);
 void supplemental_page_table_kill (struct supplemental_page_table *spt);
+bool vm_reap_later (struct supplemental_page_table *spt, uint64_t *pml4);
+void vm_reap_leak_check (void);
 struct page *spt_find_page (struct supplemental_page_table *spt,
 		void *va);
 bool spt_insert_page (struct supplemental_page_table *spt, struct page *page);
 void spt_remove_page (struct supplemental_page_table *spt, struct page *page);
+void spt_remove_range (struct supplemental_page_table *spt,
+		void *start, void *end);
+void spt_for_each (struct supplemental_page_table *spt, void *start,
+		void *end, spt_action_func *action, void *aux);
+
+/* -wlow, -whigh: Free user frame watermarks for background reclaim. */
+extern size_t reclaim_low;
+extern size_t reclaim_high;
+
+/* -nothp: Back anonymous memory with 4 kB pages only? */
+extern bool thp_enabled;
+
+/* -mlock: Most pages that one process may lock in memory. */
+extern size_t mlock_limit;
 
 void vm_init (void);
+void vm_print_stats (void);
+bool vm_frames_low (void);
+int vm_madvise (void *addr, size_t length, int advice);
+int vm_get_stats (int which, struct vmstat *stats);
+int vm_mlock (void *addr, size_t length);
+int vm_munlock (void *addr, size_t length);
+int vm_mlockall (int flags);
+int vm_munlockall (void);
 bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 		bool write, bool not_present);
 
@@ -106,6 +192,9 @@ bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 bool vm_alloc_page_with_initializer (enum vm_type type, void *upage,
 		bool writable, vm_initializer *init, void *aux);
 void vm_dealloc_page (struct page *page);
+void vm_unmap_page (struct page *page);
+bool vm_install_page (struct page *page, struct frame *frame);
+struct frame *vm_get_victim (void);
 bool vm_claim_page (void *va);
 enum vm_type page_get_type (struct page *page);
 
@@ -0,0 +1,218 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+#include "debug.h"
+
+/* A small LZ77 compressor in the style of LZ4.
+
+   The compressed form is a series of sequences.  Each sequence
+   is a token byte, whose upper nibble is a count of literal
+   bytes and whose lower nibble is a match length less
+   MIN_MATCH, then the literal bytes, then a 2-byte little-endian
+   offset back into the output from which to copy the match.  A
+   nibble of 15 means that the count continues in the following
+   bytes, each of which adds its value, until one is less than
+   255.  The last sequence has literals only and ends the input.
+
+   Matches are found through a hash table of the most recent
+   position at which each 4-byte string occurred.  That finds
+   far fewer matches than a real search would, but it takes one
+   pass over the input, which is what matters for compressing
+   pages on their way to swap. */
+
+#define MIN_MATCH 4                     /* Shortest match encoded. */
+#define HASH_BITS 12                    /* log2 of hash table size. */
+#define NIBBLE_MAX 15                   /* Count that continues. */
+
+/* Returns the 4 bytes at P. */
+static inline uint32_t
+read32 (const uint8_t *p) {
+	uint32_t v;
+	memcpy (&v, p, sizeof v);
+	return v;
+}
+
+/* Returns the hash table index for the 4 bytes V. */
+static inline unsigned
+hash4 (uint32_t v) {
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Returns the number of extra bytes needed to encode count N. */
+static inline size_t
+length_bytes (size_t n) {
+	return n >= NIBBLE_MAX ? (n - NIBBLE_MAX) / 255 + 1 : 0;
+}
+
+/* Writes the extra bytes for count N, which must be at least
+   NIBBLE_MAX, at OP and returns the byte after them. */
+static uint8_t *
+put_length (uint8_t *op, size_t n) {
+	for (n -= NIBBLE_MAX; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+/* Appends a sequence to the output at *OPP, which ends at
+   OP_END: LIT_LEN literal bytes from LIT, then, if MATCH_LEN is
+   nonzero, a match of MATCH_LEN bytes at OFFSET.  Returns false
+   without writing anything if the output has no room. */
+static bool
+emit_sequence (uint8_t **opp, const uint8_t *op_end, const uint8_t *lit,
+		size_t lit_len, size_t offset, size_t match_len) {
+	size_t code = match_len > 0 ? match_len - MIN_MATCH : 0;
+	size_t need = 1 + length_bytes (lit_len) + lit_len;
+	uint8_t *op = *opp;
+	uint8_t *token;
+
+	if (match_len > 0)
+		need += 2 + length_bytes (code);
+	if (need > (size_t) (op_end - op))
+		return false;
+
+	token = op++;
+	*token = (lit_len < NIBBLE_MAX ? lit_len : NIBBLE_MAX) << 4;
+	if (lit_len >= NIBBLE_MAX)
+		op = put_length (op, lit_len);
+	memcpy (op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len > 0) {
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		*token |= code < NIBBLE_MAX ? code : NIBBLE_MAX;
+		if (code >= NIBBLE_MAX)
+			op = put_length (op, code);
+	}
+	*opp = op;
+	return true;
+}
+
+/* Compresses the SRC_LEN bytes at SRC, which may be at most
+   LZ_MAX_INPUT, into the DST_CAP bytes at DST.  WORK must point
+   to LZ_WORK_SIZE bytes of scratch memory.  Returns the
+   compressed size, or 0 if it would exceed DST_CAP. */
+size_t
+lz_compress (const void *src_, size_t src_len,
+		void *dst_, size_t dst_cap, void *work) {
+	const uint8_t *src = src_;
+	const uint8_t *end = src + src_len;
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	uint8_t *op = dst_;
+	const uint8_t *op_end = op + dst_cap;
+	uint16_t *table = work;
+
+	ASSERT (src != NULL || src_len == 0);
+	ASSERT (dst_ != NULL || dst_cap == 0);
+	ASSERT (src_len <= LZ_MAX_INPUT);
+
+	/* Stale entries are harmless, since every candidate match is
+	   checked, but starting clean keeps the output repeatable. */
+	memset (table, 0, LZ_WORK_SIZE);
+
+	while ((size_t) (end - ip) >= MIN_MATCH) {
+		uint32_t seq = read32 (ip);
+		unsigned h = hash4 (seq);
+		const uint8_t *ref = src + table[h];
+		const uint8_t *mp, *rp;
+
+		table[h] = ip - src;
+		if (ref >= ip || read32 (ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		/* Extend the match as far as it goes.  It may overlap the
+		   bytes it copies, which the decompressor allows for. */
+		mp = ip + MIN_MATCH;
+		rp = ref + MIN_MATCH;
+		while (mp < end && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+
+		if (!emit_sequence (&op, op_end, anchor, ip - anchor, ip - ref,
+					mp - ip))
+			return 0;
+		ip = anchor = mp;
+	}
+
+	if (!emit_sequence (&op, op_end, anchor, end - anchor, 0, 0))
+		return 0;
+	return op - (uint8_t *) dst_;
+}
+
+/* Reads the extra bytes of a count from *IPP, which ends at
+   IP_END, adding them to *LEN.  Returns false if the input ends
+   first. */
+static bool
+get_length (const uint8_t **ipp, const uint8_t *ip_end, size_t *len) {
+	const uint8_t *ip = *ipp;
+	uint8_t b;
+
+	do {
+		if (ip >= ip_end)
+			return false;
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+	*ipp = ip;
+	return true;
+}
+
+/* Decompresses the SRC_LEN bytes at SRC, produced by
+   lz_compress(), into exactly DST_LEN bytes at DST.  Returns
+   false if SRC is malformed or does not decompress to DST_LEN
+   bytes. */
+bool
+lz_decompress (const void *src_, size_t src_len,
+		void *dst_, size_t dst_len) {
+	const uint8_t *ip = src_;
+	const uint8_t *ip_end = ip + src_len;
+	uint8_t *dst = dst_;
+	uint8_t *op = dst;
+	uint8_t *op_end = dst + dst_len;
+
+	ASSERT (src_ != NULL || src_len == 0);
+	ASSERT (dst_ != NULL || dst_len == 0);
+
+	while (ip < ip_end) {
+		unsigned token = *ip++;
+		size_t lit_len = token >> 4;
+		size_t match_len = token & NIBBLE_MAX;
+		size_t offset;
+		const uint8_t *ref;
+
+		if (lit_len == NIBBLE_MAX && !get_length (&ip, ip_end, &lit_len))
+			return false;
+		if (lit_len > (size_t) (ip_end - ip)
+				|| lit_len > (size_t) (op_end - op))
+			return false;
+		memcpy (op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+
+		/* Only the last sequence lacks a match. */
+		if (ip == ip_end)
+			break;
+
+		if (ip_end - ip < 2)
+			return false;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (match_len == NIBBLE_MAX
+				&& !get_length (&ip, ip_end, &match_len))
+			return false;
+		match_len += MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (op - dst)
+				|| match_len > (size_t) (op_end - op))
+			return false;
+
+		/* Byte by byte, since the match may overlap itself. */
+		for (ref = op - offset; match_len > 0; match_len--)
+			*op++ = *ref++;
+	}
+	return op == op_end;
+}
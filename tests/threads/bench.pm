@@ -0,0 +1,25 @@
+# -*- perl -*-
+use strict;
+use warnings;
+
+# Benchmarks print cycle counts that vary from run to run, so their
+# output cannot be compared line by line.  Instead, check that each
+# of PATTERNS matches some line of the test's messages, ignoring the
+# "(test-name) " prefix.
+sub check_bench {
+    my (@patterns) = @_;
+    our ($test);
+
+    my (@output) = read_text_file ("$test.output");
+    common_checks ("run", @output);
+
+    my (@core) = get_core_output ("run", @output);
+    s/^\([\w\/-]+\) // foreach @core;
+    foreach my $pattern (@patterns) {
+	fail "No output line matches /$pattern/.\n"
+	  if !grep (/^$pattern$/, @core);
+    }
+    pass;
+}
+
+1;
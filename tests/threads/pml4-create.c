@@ -0,0 +1,104 @@
+/* Measures how long it takes to create a page table, first by
+   copying base_pml4 into a fresh page the way pml4_create() used
+   to, then with pml4_create() itself, which fills in only the
+   kernel's top-level entries of a page from the zeroed cache.
+   Also measures setting up and tearing down a small address
+   space, as a fork or an exec does.  Compare the cycle counts. */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include "intrinsic.h"
+
+#define BATCH_CNT 16
+#define ROUND_CNT 100
+#define PAGE_CNT 64
+#define USER_BASE ((uint8_t *) 0x10000000)
+
+/* Returns the average cycles taken to create a page table by
+   copying base_pml4. */
+static uint64_t
+time_copy (void)
+{
+  uint64_t *pml4[BATCH_CNT];
+  uint64_t cycles = 0;
+  int round, i;
+
+  for (round = 0; round < ROUND_CNT; round++)
+    {
+      uint64_t start = rdtsc ();
+      for (i = 0; i < BATCH_CNT; i++)
+        {
+          pml4[i] = palloc_get_page (PAL_ASSERT);
+          memcpy (pml4[i], base_pml4, PGSIZE);
+        }
+      cycles += rdtsc () - start;
+      for (i = 0; i < BATCH_CNT; i++)
+        palloc_free_page (pml4[i]);
+    }
+  return cycles / (ROUND_CNT * BATCH_CNT);
+}
+
+/* Returns the average cycles taken by pml4_create(). */
+static uint64_t
+time_template (void)
+{
+  uint64_t *pml4[BATCH_CNT];
+  uint64_t cycles = 0;
+  int round, i;
+
+  for (round = 0; round < ROUND_CNT; round++)
+    {
+      uint64_t start = rdtsc ();
+      for (i = 0; i < BATCH_CNT; i++)
+        if ((pml4[i] = pml4_create ()) == NULL)
+          fail ("out of memory for page table");
+      cycles += rdtsc () - start;
+      for (i = 0; i < BATCH_CNT; i++)
+        pml4_destroy (pml4[i]);
+    }
+  return cycles / (ROUND_CNT * BATCH_CNT);
+}
+
+/* Returns the average cycles taken to create a page table, map
+   PAGE_CNT pages in it and destroy it again. */
+static uint64_t
+time_address_space (void)
+{
+  void *kpages[PAGE_CNT];
+  uint64_t cycles = 0;
+  int round, i;
+
+  for (round = 0; round < ROUND_CNT; round++)
+    {
+      uint64_t start, *pml4;
+
+      for (i = 0; i < PAGE_CNT; i++)
+        kpages[i] = palloc_get_page (PAL_ASSERT);
+      start = rdtsc ();
+      pml4 = pml4_create ();
+      if (pml4 == NULL
+          || !pml4_set_range (pml4, USER_BASE, kpages, PAGE_CNT, true))
+        fail ("out of memory for page table");
+      pml4_clear_range (pml4, USER_BASE, USER_BASE + PAGE_CNT * PGSIZE);
+      pml4_destroy (pml4);
+      cycles += rdtsc () - start;
+      for (i = 0; i < PAGE_CNT; i++)
+        palloc_free_page (kpages[i]);
+    }
+  return cycles / ROUND_CNT;
+}
+
+void
+test_pml4_create (void)
+{
+  msg ("copy: %"PRIu64" cycles per page table", time_copy ());
+  msg ("template: %"PRIu64" cycles per page table", time_template ());
+  msg ("address space: %"PRIu64" cycles for %d pages",
+       time_address_space (), PAGE_CNT);
+}
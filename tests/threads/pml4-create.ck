@@ -0,0 +1,8 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::threads::bench;
+check_bench ('copy: \d+ cycles per page table',
+	     'template: \d+ cycles per page table',
+	     'address space: \d+ cycles for 64 pages');
@@ -29,6 +29,11 @@ static const struct test tests[] =
     {"priority-preempt", test_priority_preempt},
     {"priority-sema", test_priority_sema},
     {"priority-condvar", test_priority_condvar},
+    {"tlb-direct-map", test_tlb_direct_map},
+    {"tlb-direct-map-4k", test_tlb_direct_map},
+    {"tlb-pingpong", test_tlb_pingpong},
+    {"tlb-pingpong-nopcid", test_tlb_pingpong},
+    {"pml4-create", test_pml4_create},
     {"mlfqs-load-1", test_mlfqs_load_1},
     {"mlfqs-load-60", test_mlfqs_load_60},
     {"mlfqs-load-avg", test_mlfqs_load_avg},
@@ -38,6 +43,17 @@ static const struct test tests[] =
     {"mlfqs-nice-2", test_mlfqs_nice_2},
     {"mlfqs-nice-10", test_mlfqs_nice_10},
     {"mlfqs-block", test_mlfqs_block},
+#ifdef VM
+    {"spt-lookup", test_spt_lookup},
+    {"zswap-compress", test_zswap_compress},
+    {"thp-split", test_thp_split},
+    {"thp-scan", test_thp_scan},
+    {"thp-scan-nothp", test_thp_scan},
+    {"mlock-pinned", test_mlock_pinned},
+    {"cow-fork", test_cow_fork},
+    {"madvise-hints", test_madvise_hints},
+    {"fault-stats", test_fault_stats},
+#endif
   };
 
 static const char *test_name;
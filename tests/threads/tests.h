@@ -23,6 +23,9 @@ extern test_func test_priority_fifo;
 extern test_func test_priority_preempt;
 extern test_func test_priority_sema;
 extern test_func test_priority_condvar;
+extern test_func test_tlb_direct_map;
+extern test_func test_tlb_pingpong;
+extern test_func test_pml4_create;
 extern test_func test_mlfqs_load_1;
 extern test_func test_mlfqs_load_60;
 extern test_func test_mlfqs_load_avg;
@@ -32,6 +35,16 @@ extern test_func test_mlfqs_fair_20;
 extern test_func test_mlfqs_nice_2;
 extern test_func test_mlfqs_nice_10;
 extern test_func test_mlfqs_block;
+#ifdef VM
+extern test_func test_spt_lookup;
+extern test_func test_zswap_compress;
+extern test_func test_thp_split;
+extern test_func test_thp_scan;
+extern test_func test_mlock_pinned;
+extern test_func test_cow_fork;
+extern test_func test_madvise_hints;
+extern test_func test_fault_stats;
+#endif
 
 void msg (const char *, ...);
 void fail (const char *, ...);
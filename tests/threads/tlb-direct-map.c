@@ -0,0 +1,76 @@
+/* Measures the cost of reading words from pages scattered over
+   the kernel's direct map of physical memory, compared with
+   reading words from a single page.
+
+   By default the direct map uses 2 MB pages, so a few dozen TLB
+   entries cover all of RAM.  Run as tlb-direct-map-4k, the
+   kernel is booted with -nohuge and nearly every read from a
+   scattered page misses in the TLB.  Compare the cycle counts
+   printed by the two runs. */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/interrupt.h"
+#include "threads/mmu.h"
+#include "threads/vaddr.h"
+#include "intrinsic.h"
+
+#define ACCESS_CNT 1000000
+
+/* Keeps the reads from being optimized away. */
+static volatile uint64_t read_sink;
+
+static uint64_t time_reads (size_t first_page, size_t page_cnt, bool scatter);
+
+void
+test_tlb_direct_map (void) 
+{
+  /* Skip the first 2 MB, which holds the BIOS and video memory. */
+  size_t first_page = HPGSIZE / PGSIZE;
+  size_t page_cnt = ram_pages - first_page;
+  uint64_t *pte;
+  uint64_t scattered, single;
+
+  ASSERT (ram_pages > first_page);
+
+  pte = pml4e_walk (base_pml4, (uint64_t) ptov (ram_pages * PGSIZE / 2), 0);
+  ASSERT (pte != NULL);
+  msg ("direct map uses %s pages.", is_huge_pte (pte) ? "2 MB" : "4 kB");
+
+  scattered = time_reads (first_page, page_cnt, true);
+  single = time_reads (first_page, page_cnt, false);
+  msg ("scattered pages: %"PRIu64" cycles per read", scattered);
+  msg ("single page: %"PRIu64" cycles per read", single);
+}
+
+/* Reads ACCESS_CNT words through the direct map and returns the
+   average cycles taken per read.  If SCATTER is true, each word
+   is taken from a pseudo-random page among the PAGE_CNT pages
+   starting at physical page FIRST_PAGE; otherwise every word is
+   taken from the first of those pages. */
+static uint64_t
+time_reads (size_t first_page, size_t page_cnt, bool scatter) 
+{
+  uint8_t *base = ptov (first_page * PGSIZE);
+  uint64_t x = 1, sum = 0;
+  uint64_t start, end;
+  int i;
+
+  start = rdtsc ();
+  for (i = 0; i < ACCESS_CNT; i++) 
+    {
+      size_t page, word;
+
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      page = scatter ? (x >> 33) % page_cnt : 0;
+      word = (x >> 20) % (PGSIZE / sizeof (uint64_t));
+      sum += *(volatile uint64_t *) (base + page * PGSIZE
+                                     + word * sizeof (uint64_t));
+    }
+  end = rdtsc ();
+
+  read_sink = sum;
+  return (end - start) / ACCESS_CNT;
+}
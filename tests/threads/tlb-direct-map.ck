@@ -0,0 +1,8 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::threads::bench;
+check_bench ('direct map uses 2 MB pages\.',
+	     'scattered pages: \d+ cycles per read',
+	     'single page: \d+ cycles per read');
@@ -0,0 +1,7 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::threads::bench;
+check_bench ('PCIDs (on|off)\.',
+	     'round trip: \d+ cycles');
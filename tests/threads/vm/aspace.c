@@ -0,0 +1,60 @@
+/* Gives the running kernel thread a user address space of its
+   own, so that kernel tests can drive the VM directly.  Pages
+   allocated with vm_alloc_page() go into the thread's
+   supplemental page table, and the kernel can touch them at
+   their user addresses, faulting them in as a process would.
+
+   CR0.WP is off, so a kernel write to a read-only page does not
+   fault.  Tests simulate the write-protect faults of a process
+   with aspace_fault() instead. */
+
+#include "tests/threads/vm/aspace.h"
+#include <debug.h>
+#include "tests/threads/tests.h"
+#include "threads/mmu.h"
+#include "threads/pte.h"
+#include "threads/thread.h"
+#include "vm/vm.h"
+
+/* Gives the running thread an empty supplemental page table and
+   page table, and activates the latter. */
+void
+aspace_begin (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->pml4 == NULL);
+
+  supplemental_page_table_init (&t->spt);
+  t->pml4 = pml4_create ();
+  if (t->pml4 == NULL)
+    fail ("out of memory for page table");
+  pml4_activate (t->pml4);
+}
+
+/* Frees the address space set up by aspace_begin(), in the
+   order process_cleanup() does. */
+void
+aspace_end (void)
+{
+  struct thread *t = thread_current ();
+  uint64_t *pml4 = t->pml4;
+
+  t->pml4 = NULL;
+  pml4_activate (NULL);
+  supplemental_page_table_kill (&t->spt);
+  pml4_destroy (pml4);
+}
+
+/* Handles a fault that a process would take writing, if WRITE is
+   true, or reading the page at VA, as the page fault handler
+   would.  Returns true if the fault was resolved. */
+bool
+aspace_fault (void *va, bool write)
+{
+  uint64_t *pte = pml4e_walk (thread_current ()->pml4, (uint64_t) va,
+                              false);
+  bool not_present = pte == NULL || !(*pte & PTE_P);
+
+  return vm_try_handle_fault (NULL, va, false, write, not_present);
+}
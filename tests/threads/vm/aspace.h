@@ -0,0 +1,12 @@
+#ifndef TESTS_THREADS_VM_ASPACE_H
+#define TESTS_THREADS_VM_ASPACE_H
+
+#include <stdbool.h>
+
+/* A user address space for kernel tests of the VM, set up in the
+   running kernel thread as process_exec() would for a process. */
+void aspace_begin (void);
+void aspace_end (void);
+bool aspace_fault (void *va, bool write);
+
+#endif /* tests/threads/vm/aspace.h */
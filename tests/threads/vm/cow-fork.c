@@ -0,0 +1,254 @@
+/* Copies an address space as fork() does and checks the
+   copy-on-write sharing that results.  Right after the copy,
+   parent and child share every frame read-only.  A write from
+   either side must give the writer a private frame, unless the
+   other side has copied away already, in which case the writer
+   takes the frame over in place.  Each side must then read its
+   own writes and the other pages' original contents.
+
+   The first round uses a few pages and checks frames and
+   reference counts exactly.  The second uses more pages than
+   there are frames, so that pages of the parent are in swap when
+   it is copied, and checks that no page of the child shares a
+   swap copy with the parent's page and that the contents survive
+   the paging. */
+
+#include <debug.h>
+#include <stdint.h>
+#include "tests/threads/tests.h"
+#include "tests/threads/vm/aspace.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/pte.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/anon.h"
+#include "vm/frame.h"
+#include "vm/vm.h"
+
+#define BASE ((uint8_t *) 0x10000000)
+#define SMALL_CNT 16            /* Pages in the first round. */
+#define EXTRA_CNT 64            /* Pages beyond the free frames. */
+
+#define PARENT_VALUE(I) ((I) + 1000000)
+#define CHILD_VALUE(I) ((I) + 2000000)
+
+/* Pages written by each side.  Both write the pages with I % 3 ==
+   1, the child first. */
+#define PARENT_WRITES(I) ((I) % 3 != 2)
+#define CHILD_WRITES(I) ((I) % 3 == 1)
+
+/* One round of the test. */
+struct round
+  {
+    struct thread *parent;      /* Thread whose space is copied. */
+    struct thread *child;       /* Thread that copies it. */
+    size_t page_cnt;            /* Pages in the address space. */
+    bool exact;                 /* Check frames and reference counts? */
+    struct semaphore copied;    /* Upped once the child has written. */
+    struct semaphore parent_done;  /* Upped once the parent has. */
+    struct semaphore child_done;   /* Upped once the child is gone. */
+  };
+
+/* Returns the address of page I. */
+static uint8_t *
+page_va (size_t i)
+{
+  return BASE + i * PGSIZE;
+}
+
+/* Returns T's page I. */
+static struct page *
+page_of (struct thread *t, size_t i)
+{
+  struct page *page = spt_find_page (&t->spt, page_va (i));
+
+  ASSERT (page != NULL);
+  return page;
+}
+
+/* Returns true if T maps page I writable. */
+static bool
+page_writable (struct thread *t, size_t i)
+{
+  uint64_t *pte = pml4e_walk (t->pml4, (uint64_t) page_va (i), false);
+
+  return pte != NULL && (*pte & PTE_P) && (*pte & PTE_W);
+}
+
+/* Writes VALUE to the first and last words of page I of the
+   running thread, taking the write fault that a process would
+   first, since the kernel's own writes ignore write protection. */
+static void
+page_write (size_t i, uint64_t value)
+{
+  uint64_t *words = (uint64_t *) page_va (i);
+
+  if (!aspace_fault (words, true))
+    fail ("write fault on page %zu failed", i);
+  words[0] = value;
+  words[PGSIZE / sizeof *words - 1] = ~value;
+}
+
+/* Checks that page I of the running thread holds VALUE. */
+static void
+page_check (size_t i, uint64_t value)
+{
+  uint64_t *words = (uint64_t *) page_va (i);
+
+  if (words[0] != value || words[PGSIZE / sizeof *words - 1] != ~value)
+    fail ("page %zu of %s lost its contents", i, thread_name ());
+}
+
+/* Checks that no page of the running thread, just copied from R's
+   parent, shares a swap copy with the parent's page, and, if R is
+   exact, that every page shares the parent's frame read-only. */
+static void
+check_copy (struct round *r)
+{
+  struct thread *child = thread_current ();
+  size_t i;
+
+  lock_acquire (&frame_lock);
+  for (i = 0; i < r->page_cnt; i++)
+    {
+      struct page *p = page_of (r->parent, i);
+      struct page *c = page_of (child, i);
+
+      if (page_get_type (c) != VM_ANON)
+        fail ("page %zu copied with the wrong type", i);
+      if ((c->anon.slot != SLOT_NONE && c->anon.slot == p->anon.slot)
+          || (c->anon.zchunk != ZCHUNK_NONE
+              && c->anon.zchunk == p->anon.zchunk))
+        fail ("page %zu shares a swap copy with the parent", i);
+      if (r->exact
+          && (c->frame == NULL || c->frame != p->frame
+              || c->frame->refcnt != 2 || page_writable (child, i)
+              || page_writable (r->parent, i)))
+        fail ("page %zu not shared read-only", i);
+    }
+  lock_release (&frame_lock);
+}
+
+/* Writes page I from the child, checking, if R is exact, that the
+   child copies it away from the parent's frame. */
+static void
+child_write (struct round *r, size_t i)
+{
+  struct frame *shared = page_of (r->parent, i)->frame;
+
+  page_write (i, CHILD_VALUE (i));
+  if (r->exact)
+    {
+      struct frame *own = page_of (thread_current (), i)->frame;
+
+      if (own == shared || own->refcnt != 1 || shared->refcnt != 1
+          || page_of (r->parent, i)->frame != shared)
+        fail ("child's write to page %zu did not copy it", i);
+    }
+}
+
+/* Writes page I from the parent, checking, if R is exact, that it
+   copies a page still shared and takes over one the child has
+   copied away from. */
+static void
+parent_write (struct round *r, size_t i)
+{
+  struct frame *old = page_of (r->parent, i)->frame;
+
+  page_write (i, PARENT_VALUE (i));
+  if (r->exact)
+    {
+      struct frame *own = page_of (r->parent, i)->frame;
+
+      if (CHILD_WRITES (i) ? own != old : own == old)
+        fail ("parent's write to page %zu %s", i,
+              CHILD_WRITES (i) ? "copied it again" : "did not copy it");
+      if (own->refcnt != 1 || !page_writable (r->parent, i))
+        fail ("parent's page %zu not private after writing", i);
+      if (!CHILD_WRITES (i) && page_of (r->child, i)->frame != old)
+        fail ("parent's write to page %zu moved the child", i);
+    }
+}
+
+/* The child's thread function. */
+static void
+child (void *r_)
+{
+  struct round *r = r_;
+  size_t i;
+
+  r->child = thread_current ();
+  aspace_begin ();
+  if (!supplemental_page_table_copy (&thread_current ()->spt,
+                                     &r->parent->spt))
+    fail ("copying the address space failed");
+  check_copy (r);
+
+  for (i = 0; i < r->page_cnt; i++)
+    if (CHILD_WRITES (i))
+      child_write (r, i);
+  sema_up (&r->copied);
+
+  sema_down (&r->parent_done);
+  for (i = 0; i < r->page_cnt; i++)
+    page_check (i, CHILD_WRITES (i) ? CHILD_VALUE (i) : i);
+  aspace_end ();
+  sema_up (&r->child_done);
+}
+
+/* Runs a round with PAGE_CNT pages, checking frames and reference
+   counts if EXACT. */
+static void
+run_round (size_t page_cnt, bool exact)
+{
+  struct round r;
+  size_t swapped_cnt = 0;
+  size_t i;
+
+  r.parent = thread_current ();
+  r.page_cnt = page_cnt;
+  r.exact = exact;
+  sema_init (&r.copied, 0);
+  sema_init (&r.parent_done, 0);
+  sema_init (&r.child_done, 0);
+
+  aspace_begin ();
+  for (i = 0; i < page_cnt; i++)
+    {
+      if (!vm_alloc_page (VM_ANON, page_va (i), true))
+        fail ("out of memory for pages");
+      page_write (i, i);
+    }
+  for (i = 0; i < page_cnt; i++)
+    if (page_of (r.parent, i)->frame == NULL)
+      swapped_cnt++;
+  if (!exact && swapped_cnt == 0)
+    fail ("no page was swapped out before the copy");
+
+  if (thread_create ("child", PRI_DEFAULT, child, &r) == TID_ERROR)
+    fail ("cannot create child");
+  sema_down (&r.copied);
+
+  /* The child waits for us now, so only eviction moves its pages. */
+  for (i = 0; i < page_cnt; i++)
+    if (PARENT_WRITES (i))
+      parent_write (&r, i);
+  for (i = 0; i < page_cnt; i++)
+    page_check (i, PARENT_WRITES (i) ? PARENT_VALUE (i) : i);
+  sema_up (&r.parent_done);
+  sema_down (&r.child_done);
+  aspace_end ();
+}
+
+void
+test_cow_fork (void)
+{
+  run_round (SMALL_CNT, true);
+  msg ("%d pages: shared after the copy, private after writing",
+       SMALL_CNT);
+
+  run_round (palloc_free_cnt (PAL_USER) + EXTRA_CNT, false);
+  msg ("more pages than frames: contents intact through swap");
+}
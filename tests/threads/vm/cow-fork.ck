@@ -0,0 +1,11 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(cow-fork) begin
+(cow-fork) 16 pages: shared after the copy, private after writing
+(cow-fork) more pages than frames: contents intact through swap
+(cow-fork) end
+EOF
+pass;
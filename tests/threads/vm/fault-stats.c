@@ -0,0 +1,114 @@
+/* Takes faults of each kind and checks how vm_try_handle_fault()
+   counts them: a fault on fresh anonymous memory is minor, one
+   that reads a file is major, and a write to the zero page that a
+   read mapped is a write-protect fault.  Faults that cannot be
+   resolved are not counted.  The fault latency histogram must add
+   up to the faults counted, and the system's counts must cover
+   the thread's. */
+
+#include <debug.h>
+#include <stdint.h>
+#include <vmstat.h>
+#include "tests/threads/tests.h"
+#include "tests/threads/vm/aspace.h"
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/file.h"
+#include "vm/vm.h"
+
+#define ANON ((uint8_t *) 0x10000000)
+#define MAP ((uint8_t *) 0x20000000)
+#define UNMAPPED ((uint8_t *) 0x30000000)
+#define ANON_CNT 8
+
+/* Returns the faults in the latency histogram of ST. */
+static long long
+histogram_sum (const struct vmstat *st)
+{
+  long long sum = 0;
+  int i;
+
+  for (i = 0; i < VMSTAT_BUCKETS; i++)
+    sum += st->fault_cycles[i];
+  return sum;
+}
+
+/* Checks that the thread's counts went up by MINOR, MAJOR and WP
+   since BEFORE, and updates BEFORE. */
+static void
+check_counts (const char *what, struct vmstat *before, long long minor,
+              long long major, long long wp)
+{
+  const struct vmstat *st = &thread_current ()->spt.stats;
+
+  if (st->minor_fault_cnt - before->minor_fault_cnt != minor
+      || st->major_fault_cnt - before->major_fault_cnt != major
+      || st->wp_fault_cnt - before->wp_fault_cnt != wp)
+    fail ("%s: %lld minor, %lld major, %lld wp faults counted", what,
+          st->minor_fault_cnt - before->minor_fault_cnt,
+          st->major_fault_cnt - before->major_fault_cnt,
+          st->wp_fault_cnt - before->wp_fault_cnt);
+  *before = *st;
+}
+
+void
+test_fault_stats (void)
+{
+  struct vmstat before;
+  struct vmstat *st = &thread_current ()->spt.stats;
+  struct file *file;
+  size_t i;
+
+  aspace_begin ();
+  before = *st;
+
+  /* Fresh anonymous pages: no disk reads. */
+  for (i = 0; i < ANON_CNT; i++)
+    if (!vm_alloc_page (VM_ANON, ANON + i * PGSIZE, true)
+        || !aspace_fault (ANON + i * PGSIZE, true))
+      fail ("cannot fault in anonymous page %zu", i);
+  check_counts ("anonymous writes", &before, ANON_CNT, 0, 0);
+  msg ("anonymous pages: minor faults");
+
+  /* A read maps the zero page read-only; the write after it faults
+     on the present page. */
+  if (!vm_alloc_page (VM_ANON, UNMAPPED - PGSIZE, true)
+      || !aspace_fault (UNMAPPED - PGSIZE, false)
+      || !aspace_fault (UNMAPPED - PGSIZE, true))
+    fail ("cannot fault in the zero page and write it");
+  check_counts ("zero page", &before, 1, 0, 1);
+  msg ("write after read of fresh memory: write-protect fault");
+
+  /* A page of a mapped file is read from disk.  The mapping is
+     writable so that no cached frame can stand in for the read. */
+  if (!filesys_create ("fault-stats", PGSIZE)
+      || (file = filesys_open ("fault-stats")) == NULL)
+    fail ("cannot create file");
+  if (do_mmap (MAP, PGSIZE, true, file, 0) != MAP
+      || !aspace_fault (MAP, false))
+    fail ("cannot fault in a page of the file");
+  check_counts ("file read", &before, 0, 1, 0);
+  msg ("file page: major fault");
+
+  /* Nothing is counted for a fault that is not resolved. */
+  if (aspace_fault (UNMAPPED, false))
+    fail ("fault on an unmapped page resolved");
+  check_counts ("unmapped", &before, 0, 0, 0);
+
+  if (histogram_sum (st) != st->minor_fault_cnt + st->major_fault_cnt
+      + st->wp_fault_cnt)
+    fail ("latency histogram does not add up to the fault count");
+  if (vm_stats.minor_fault_cnt < st->minor_fault_cnt
+      || vm_stats.major_fault_cnt < st->major_fault_cnt
+      || vm_stats.wp_fault_cnt < st->wp_fault_cnt
+      || histogram_sum (&vm_stats) < histogram_sum (st))
+    fail ("system counts are below the thread's");
+  msg ("latency histogram adds up");
+
+  do_munmap (MAP);
+  file_close (file);
+  filesys_remove ("fault-stats");
+  aspace_end ();
+}
@@ -0,0 +1,13 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fault-stats) begin
+(fault-stats) anonymous pages: minor faults
+(fault-stats) write after read of fresh memory: write-protect fault
+(fault-stats) file page: major fault
+(fault-stats) latency histogram adds up
+(fault-stats) end
+EOF
+pass;
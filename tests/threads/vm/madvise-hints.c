@@ -0,0 +1,147 @@
+/* Maps a file and reads it through from start to end under each
+   madvise() hint, counting the page faults that each scan takes.
+   The counts follow from how far vm_fault_around() maps ahead:
+   with no advice the window grows from 2 pages by doubling, after
+   MADV_SEQUENTIAL it is at its widest from the first fault, and
+   after MADV_RANDOM nothing is mapped ahead.  After MADV_WILLNEED
+   the scan must not fault at all.  A sequential scan must also
+   leave the pages well behind it marked as not accessed, so that
+   they are evicted first, where a scan with no advice leaves them
+   accessed.  After MADV_DONTNEED, scanning again must fault the
+   pages back in from the file. */
+
+#include <debug.h>
+#include <stdint.h>
+#include "tests/threads/tests.h"
+#include "tests/threads/vm/aspace.h"
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/file.h"
+#include "vm/vm.h"
+
+#define MAP ((uint8_t *) 0x10000000)
+#define PAGE_CNT 64
+#define BEHIND 10               /* A page a sequential scan leaves
+                                   well behind it. */
+
+/* Returns the byte at offset OFS of the file. */
+static uint8_t
+file_byte (size_t ofs)
+{
+  return (ofs / PGSIZE * 7 + ofs % PGSIZE) & 0xff;
+}
+
+/* Returns the number of faults handled for the running thread. */
+static long long
+fault_cnt (void)
+{
+  const struct vmstat *st = &thread_current ()->spt.stats;
+
+  return st->minor_fault_cnt + st->major_fault_cnt;
+}
+
+/* Creates the file and fills it with file_byte(). */
+static struct file *
+make_file (void)
+{
+  struct file *file;
+  uint8_t *buf;
+  size_t i, j;
+
+  if (!filesys_create ("madvise", PAGE_CNT * PGSIZE))
+    fail ("cannot create file");
+  file = filesys_open ("madvise");
+  buf = palloc_get_page (PAL_ASSERT);
+  if (file == NULL)
+    fail ("cannot open file");
+  for (i = 0; i < PAGE_CNT; i++)
+    {
+      for (j = 0; j < PGSIZE; j++)
+        buf[j] = file_byte (i * PGSIZE + j);
+      if (file_write (file, buf, PGSIZE) != PGSIZE)
+        fail ("cannot write file");
+    }
+  palloc_free_page (buf);
+  return file;
+}
+
+/* Maps FILE at MAP and gives it ADVICE. */
+static void
+map (struct file *file, int advice)
+{
+  if (do_mmap (MAP, PAGE_CNT * PGSIZE, false, file, 0) != MAP)
+    fail ("mmap failed");
+  if (vm_madvise (MAP, PAGE_CNT * PGSIZE, advice) != 0)
+    fail ("madvise (%d) failed", advice);
+}
+
+/* Reads the first and last bytes of every page at MAP in order,
+   checking them, and returns the number of faults taken. */
+static long long
+scan (const char *name)
+{
+  volatile uint8_t *map = MAP;
+  long long faults = fault_cnt ();
+  size_t i;
+
+  for (i = 0; i < PAGE_CNT; i++)
+    {
+      size_t first = i * PGSIZE, last = first + PGSIZE - 1;
+
+      if (map[first] != file_byte (first) || map[last] != file_byte (last))
+        fail ("%s: page %zu read bad data", name, i);
+    }
+  return fault_cnt () - faults;
+}
+
+/* Returns true if page IDX at MAP has been accessed. */
+static bool
+accessed (size_t idx)
+{
+  return pml4_is_accessed (thread_current ()->pml4, MAP + idx * PGSIZE);
+}
+
+void
+test_madvise_hints (void)
+{
+  struct file *file;
+  long long faults;
+
+  aspace_begin ();
+  file = make_file ();
+
+  map (file, VM_ADV_NORMAL);
+  msg ("normal: %lld faults", scan ("normal"));
+  if (!accessed (BEHIND))
+    fail ("normal: page %d deactivated", BEHIND);
+  do_munmap (MAP);
+
+  map (file, VM_ADV_SEQUENTIAL);
+  msg ("sequential: %lld faults", scan ("sequential"));
+  if (accessed (BEHIND) || !accessed (PAGE_CNT - 1))
+    fail ("sequential: pages behind the scan not deactivated");
+  do_munmap (MAP);
+
+  map (file, VM_ADV_RANDOM);
+  msg ("random: %lld faults", scan ("random"));
+  do_munmap (MAP);
+
+  map (file, VM_ADV_WILLNEED);
+  msg ("willneed: %lld faults", scan ("willneed"));
+
+  if (vm_madvise (MAP, PAGE_CNT * PGSIZE, VM_ADV_DONTNEED) != 0)
+    fail ("madvise (dontneed) failed");
+  faults = scan ("dontneed");
+  if (faults == 0)
+    fail ("dontneed: no faults on rescan");
+  msg ("dontneed: pages read again on rescan");
+  do_munmap (MAP);
+
+  file_close (file);
+  filesys_remove ("madvise");
+  aspace_end ();
+}
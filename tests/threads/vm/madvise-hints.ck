@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(madvise-hints) begin
+(madvise-hints) normal: 5 faults
+(madvise-hints) sequential: 4 faults
+(madvise-hints) random: 64 faults
+(madvise-hints) willneed: 0 faults
+(madvise-hints) dontneed: pages read again on rescan
+(madvise-hints) end
+EOF
+pass;
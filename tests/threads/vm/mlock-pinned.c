@@ -0,0 +1,98 @@
+/* Locks one of a few resident pages in memory and checks that
+   its frame is pinned: that the eviction policy never picks it,
+   that compaction may not move it and that same-page merging
+   leaves it alone, while the other frames stay fair game.  Then
+   unlocks it and checks that the frame is unpinned again. */
+
+#include <debug.h>
+#include <stdint.h>
+#include "tests/threads/tests.h"
+#include "tests/threads/vm/aspace.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/frame.h"
+#include "vm/merge.h"
+#include "vm/vm.h"
+
+#define BASE ((uint8_t *) 0x10000000)
+#define PAGE_CNT 4
+#define LOCKED 1                /* Index of the page locked. */
+
+/* Returns the frame of the page at VA. */
+static struct frame *
+frame_of (uint8_t *va)
+{
+  struct page *page = spt_find_page (&thread_current ()->spt, va);
+
+  ASSERT (page != NULL && page->frame != NULL);
+  return page->frame;
+}
+
+/* Returns true if the eviction policy picks FRAME within a few
+   sweeps of the clock over the frame table. */
+static bool
+victim_picks (struct frame *frame)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&frame_lock));
+
+  for (i = 0; i < 4 * frame_table_size (); i++)
+    if (vm_get_victim () == frame)
+      return true;
+  return false;
+}
+
+void
+test_mlock_pinned (void)
+{
+  uint8_t *locked = BASE + LOCKED * PGSIZE;
+  uint8_t *other = BASE;
+  struct frame *frame;
+  size_t i;
+
+  aspace_begin ();
+  for (i = 0; i < PAGE_CNT; i++)
+    {
+      if (!vm_alloc_page (VM_ANON, BASE + i * PGSIZE, true))
+        fail ("out of memory for pages");
+      BASE[i * PGSIZE] = i;
+    }
+
+  if (vm_mlock (locked, PGSIZE) != 0)
+    fail ("mlock failed");
+  frame = frame_of (locked);
+  if (thread_current ()->spt.stats.locked_cnt != 1)
+    fail ("locked page not counted");
+
+  lock_acquire (&frame_lock);
+  if (!(frame->flags & FRAME_PINNED))
+    fail ("frame of a locked page not pinned");
+  if (victim_picks (frame))
+    fail ("eviction picked a pinned frame");
+  if (frame_movable (frame))
+    fail ("compaction may move a pinned frame");
+  if (merge_candidate (frame))
+    fail ("same-page merging may take a pinned frame");
+  if (!victim_picks (frame_of (other)) || !frame_movable (frame_of (other))
+      || !merge_candidate (frame_of (other)))
+    fail ("frame of an unlocked page treated as pinned");
+  lock_release (&frame_lock);
+  msg ("pinned frame skipped by eviction, compaction and merging");
+
+  if (vm_munlock (locked, PGSIZE) != 0)
+    fail ("munlock failed");
+  if (thread_current ()->spt.stats.locked_cnt != 0)
+    fail ("page still counted as locked after munlock");
+  lock_acquire (&frame_lock);
+  if (frame->flags & FRAME_PINNED)
+    fail ("frame still pinned after munlock");
+  if (!victim_picks (frame) || !frame_movable (frame)
+      || !merge_candidate (frame))
+    fail ("unpinned frame still skipped");
+  lock_release (&frame_lock);
+  msg ("frame unpinned by munlock");
+
+  aspace_end ();
+}
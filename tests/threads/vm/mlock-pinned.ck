@@ -0,0 +1,11 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(mlock-pinned) begin
+(mlock-pinned) pinned frame skipped by eviction, compaction and merging
+(mlock-pinned) frame unpinned by munlock
+(mlock-pinned) end
+EOF
+pass;
@@ -0,0 +1,155 @@
+/* Compares the cost of supplemental page table lookups, as done
+   on every page fault, between the radix-tree SPT in vm/vm.c and
+   a hash table keyed by virtual address built on
+   lib/kernel/hash.c.  The pages are laid out like a typical
+   process: program text and data, a heap, a memory-mapped file
+   and a stack. */
+
+#include <debug.h>
+#include <hash.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/malloc.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+#include "intrinsic.h"
+
+#define LOOKUP_CNT 200000
+
+/* Regions of the simulated address space. */
+struct region 
+  {
+    uintptr_t start;            /* First page. */
+    size_t page_cnt;            /* Number of pages. */
+  };
+
+static const struct region regions[] = 
+  {
+    {0x400000, 256},                        /* Text. */
+    {0x500000, 512},                        /* Data and heap. */
+    {0x10000000, 1024},                     /* Memory-mapped file. */
+    {USER_STACK - 64 * PGSIZE, 64},         /* Stack. */
+  };
+
+#define REGION_CNT (sizeof regions / sizeof *regions)
+
+/* Hash table entry for one page. */
+struct hash_page 
+  {
+    struct hash_elem elem;
+    void *va;
+    struct page *page;
+  };
+
+static uint64_t
+hash_page_hash (const struct hash_elem *e, void *aux UNUSED) 
+{
+  const struct hash_page *p = hash_entry (e, struct hash_page, elem);
+  return hash_bytes (&p->va, sizeof p->va);
+}
+
+static bool
+hash_page_less (const struct hash_elem *a, const struct hash_elem *b,
+                void *aux UNUSED) 
+{
+  return hash_entry (a, struct hash_page, elem)->va
+         < hash_entry (b, struct hash_page, elem)->va;
+}
+
+static void
+hash_page_free (struct hash_elem *e, void *aux UNUSED) 
+{
+  free (hash_entry (e, struct hash_page, elem));
+}
+
+/* Returns the next pseudo-random index below N. */
+static size_t
+next_index (uint64_t *x, size_t n) 
+{
+  *x = *x * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (*x >> 33) % n;
+}
+
+void
+test_spt_lookup (void) 
+{
+  struct supplemental_page_table spt;
+  struct hash table;
+  void **vas;
+  size_t page_cnt = 0;
+  size_t i, r;
+  uint64_t x, start, radix_cycles, hash_cycles;
+
+  for (r = 0; r < REGION_CNT; r++)
+    page_cnt += regions[r].page_cnt;
+  vas = malloc (page_cnt * sizeof *vas);
+  ASSERT (vas != NULL);
+
+  supplemental_page_table_init (&spt);
+  hash_init (&table, hash_page_hash, hash_page_less, NULL);
+  i = 0;
+  for (r = 0; r < REGION_CNT; r++) 
+    {
+      size_t j;
+
+      for (j = 0; j < regions[r].page_cnt; j++) 
+        {
+          void *va = (void *) (regions[r].start + j * PGSIZE);
+          struct page *page = malloc (sizeof *page);
+          struct hash_page *hp = malloc (sizeof *hp);
+
+          ASSERT (page != NULL && hp != NULL);
+          uninit_new (page, va, NULL, VM_ANON, NULL, anon_initializer);
+          if (!spt_insert_page (&spt, page))
+            fail ("spt_insert_page failed for %p", va);
+          hp->va = va;
+          hp->page = page;
+          hash_insert (&table, &hp->elem);
+          vas[i++] = va;
+        }
+    }
+  msg ("inserted %zu pages in %zu regions", page_cnt, REGION_CNT);
+
+  x = 1;
+  start = rdtsc ();
+  for (i = 0; i < LOOKUP_CNT; i++) 
+    {
+      void *va = vas[next_index (&x, page_cnt)];
+      struct page *page = spt_find_page (&spt, va);
+
+      if (page == NULL || page->va != va)
+        fail ("radix tree lookup of %p failed", va);
+    }
+  radix_cycles = (rdtsc () - start) / LOOKUP_CNT;
+
+  x = 1;
+  start = rdtsc ();
+  for (i = 0; i < LOOKUP_CNT; i++) 
+    {
+      struct hash_page key, *hp;
+      struct hash_elem *e;
+
+      key.va = vas[next_index (&x, page_cnt)];
+      e = hash_find (&table, &key.elem);
+      hp = e != NULL ? hash_entry (e, struct hash_page, elem) : NULL;
+      if (hp == NULL || hp->page->va != key.va)
+        fail ("hash table lookup of %p failed", key.va);
+    }
+  hash_cycles = (rdtsc () - start) / LOOKUP_CNT;
+
+  msg ("all lookups found the right page");
+  msg ("radix tree: %"PRIu64" cycles per lookup, %zu kB",
+       radix_cycles, spt.node_cnt * PGSIZE / 1024);
+  msg ("hash table: %"PRIu64" cycles per lookup, %zu kB",
+       hash_cycles, (table.bucket_cnt * sizeof (struct list)
+                     + table.elem_cnt * sizeof (struct hash_page)) / 1024);
+
+  /* Removing everything must free every node. */
+  hash_destroy (&table, hash_page_free);
+  supplemental_page_table_kill (&spt);
+  if (spt.page_cnt != 0 || spt.node_cnt != 0)
+    fail ("%zu pages and %zu nodes left after kill",
+          spt.page_cnt, spt.node_cnt);
+  free (vas);
+}
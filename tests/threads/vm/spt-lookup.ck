@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::threads::bench;
+check_bench ('inserted 1856 pages in 4 regions',
+	     'all lookups found the right page',
+	     'radix tree: \d+ cycles per lookup, \d+ kB',
+	     'hash table: \d+ cycles per lookup, \d+ kB');
@@ -0,0 +1,70 @@
+/* Writes every page of a 2 MB aligned block of fresh anonymous
+   memory, then reads it back a few times, reporting the page
+   faults that the writes take and the cycles per page that each
+   read pass takes.  With transparent huge pages the block must
+   fault once, in thp_claim(), and the scans run off a single TLB
+   entry; thp-scan-nothp runs the same test with 4 kB pages only,
+   where every page faults, for comparison. */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include "tests/threads/tests.h"
+#include "tests/threads/vm/aspace.h"
+#include "threads/pte.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+#include "intrinsic.h"
+
+#define BLOCK ((uint8_t *) 0x40000000)
+#define PASS_CNT 4
+
+/* Returns the number of faults handled for the running thread. */
+static long long
+fault_cnt (void)
+{
+  const struct vmstat *st = &thread_current ()->spt.stats;
+
+  return st->minor_fault_cnt + st->major_fault_cnt;
+}
+
+void
+test_thp_scan (void)
+{
+  volatile uint8_t *block = BLOCK;
+  unsigned expected = 0;
+  long long faults;
+  int pass;
+  size_t i;
+
+  aspace_begin ();
+  for (i = 0; i < HPG_PAGES; i++)
+    if (!vm_alloc_page (VM_ANON, BLOCK + i * PGSIZE, true))
+      fail ("out of memory for pages");
+
+  faults = fault_cnt ();
+  for (i = 0; i < HPG_PAGES; i++)
+    {
+      block[i * PGSIZE] = i;
+      expected += (uint8_t) i;
+    }
+  msg ("%lld faults writing %zu pages", fault_cnt () - faults,
+       (size_t) HPG_PAGES);
+
+  for (pass = 0; pass < PASS_CNT; pass++)
+    {
+      unsigned sum = 0;
+      uint64_t start, end;
+
+      start = rdtsc ();
+      for (i = 0; i < HPG_PAGES; i++)
+        sum += block[i * PGSIZE];
+      end = rdtsc ();
+      if (sum != expected)
+        fail ("scan read bad data");
+      msg ("pass %d: %"PRIu64" cycles per page", pass,
+           (end - start) / HPG_PAGES);
+    }
+
+  aspace_end ();
+}
@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::threads::bench;
+check_bench ('1 faults writing 512 pages',
+	     'pass 0: \d+ cycles per page',
+	     'pass 1: \d+ cycles per page',
+	     'pass 2: \d+ cycles per page',
+	     'pass 3: \d+ cycles per page');
@@ -0,0 +1,94 @@
+/* Writes to a 2 MB aligned block of fresh anonymous memory, which
+   must come in as one huge page mapped by a single page directory
+   entry.  Then write-protects one of its pages and unmaps
+   another, each of which must split the mapping into 4 kB pages
+   that keep the frames, permissions and contents of the 2 MB
+   page. */
+
+#include <debug.h>
+#include <stdint.h>
+#include "tests/threads/tests.h"
+#include "tests/threads/vm/aspace.h"
+#include "threads/mmu.h"
+#include "threads/pte.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+
+#define BLOCK ((uint8_t *) 0x40000000)
+#define WP_PAGE 5               /* Page write-protected. */
+#define CLEAR_PAGE 7            /* Page unmapped. */
+
+/* Checks that every page of BLOCK but CLEAR_PAGE, if CLEARED, is
+   mapped to the frame at KVA's offset in the 2 MB run with 4 kB
+   pages, writable but for WP_PAGE, and holds the byte it was
+   given. */
+static void
+check_split (uint64_t *pml4, uint8_t *kva, bool cleared)
+{
+  uint64_t *pde = pml4e_walk_pde (pml4, (uint64_t) BLOCK, false);
+  size_t i;
+
+  if (pde == NULL || (*pde & (PTE_P | PTE_PS)) != PTE_P)
+    fail ("block still mapped by a 2 MB entry");
+  for (i = 0; i < HPG_PAGES; i++)
+    {
+      uint8_t *va = BLOCK + i * PGSIZE;
+      uint64_t *pte = pml4e_walk (pml4, (uint64_t) va, false);
+
+      if (cleared && i == CLEAR_PAGE)
+        {
+          if (pml4_get_page (pml4, va) != NULL)
+            fail ("page %zu still mapped after clearing it", i);
+          continue;
+        }
+      if (pml4_get_page (pml4, va) != kva + i * PGSIZE)
+        fail ("page %zu moved to another frame", i);
+      if (((*pte & PTE_W) != 0) == (i == WP_PAGE))
+        fail ("page %zu has the wrong permissions", i);
+      if (va[0] != (uint8_t) i)
+        fail ("page %zu lost its contents", i);
+    }
+}
+
+void
+test_thp_split (void)
+{
+  uint64_t *pml4;
+  uint64_t *pde;
+  uint8_t *kva;
+  size_t i;
+
+  aspace_begin ();
+  pml4 = thread_current ()->pml4;
+  for (i = 0; i < HPG_PAGES; i++)
+    if (!vm_alloc_page (VM_ANON, BLOCK + i * PGSIZE, true))
+      fail ("out of memory for pages");
+
+  if (!aspace_fault (BLOCK, true))
+    fail ("fault on the block failed");
+  pde = pml4e_walk_pde (pml4, (uint64_t) BLOCK, false);
+  if (pde == NULL || (*pde & (PTE_P | PTE_PS)) != (PTE_P | PTE_PS))
+    fail ("block not mapped by a 2 MB entry");
+  kva = pml4_get_page (pml4, BLOCK);
+  for (i = 0; i < HPG_PAGES; i++)
+    if (pml4_get_page (pml4, BLOCK + i * PGSIZE) != kva + i * PGSIZE)
+      fail ("page %zu not in the 2 MB frame run", i);
+  msg ("one fault mapped the block with one 2 MB entry");
+
+  /* Runs off the 2 MB entry, without further faults. */
+  for (i = 0; i < HPG_PAGES; i++)
+    BLOCK[i * PGSIZE] = i;
+
+  if (!pml4_set_writable (pml4, BLOCK + WP_PAGE * PGSIZE, false))
+    fail ("write-protecting a page failed");
+  check_split (pml4, kva, false);
+  msg ("write-protecting a page split the block");
+
+  if (!pml4_clear_page (pml4, BLOCK + CLEAR_PAGE * PGSIZE))
+    fail ("clearing a page failed");
+  check_split (pml4, kva, true);
+  msg ("clearing a page left the others in place");
+
+  aspace_end ();
+}
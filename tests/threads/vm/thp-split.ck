@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(thp-split) begin
+(thp-split) one fault mapped the block with one 2 MB entry
+(thp-split) write-protecting a page split the block
+(thp-split) clearing a page left the others in place
+(thp-split) end
+EOF
+pass;
@@ -0,0 +1,145 @@
+/* Compresses pages with the contents typical of anonymous memory,
+   as the compressed swap pool in vm/anon.c does on eviction, and
+   reports the compressed size and the cycles taken to compress
+   and decompress each.  Every page must decompress back to its
+   original contents.  Pages that compress to more than 3/4 of a
+   page go to the swap disk instead of the pool. */
+
+#include <debug.h>
+#include <inttypes.h>
+#include <lz.h>
+#include <stdio.h>
+#include <string.h>
+#include "tests/threads/tests.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include "intrinsic.h"
+
+#define ROUND_CNT 50
+
+/* Fills PAGE with one kind of contents. */
+typedef void fill_func (uint8_t *page);
+
+static void
+fill_zero (uint8_t *page) 
+{
+  memset (page, 0, PGSIZE);
+}
+
+/* A heap: small records of pointers and counters. */
+static void
+fill_heap (uint8_t *page) 
+{
+  uint64_t *words = (uint64_t *) page;
+  size_t i;
+
+  for (i = 0; i < PGSIZE / sizeof *words; i += 4) 
+    {
+      words[i] = 0x4747f000 + i * 8;
+      words[i + 1] = i / 4;
+      words[i + 2] = 0;
+      words[i + 3] = i % 3 == 0 ? 0x4747f020 + i * 8 : 0;
+    }
+}
+
+/* Text, as in a buffer of log lines. */
+static void
+fill_text (uint8_t *page) 
+{
+  size_t ofs = 0;
+  int line = 0;
+
+  while (ofs < PGSIZE) 
+    {
+      char buf[64];
+      size_t len = snprintf (buf, sizeof buf,
+                             "line %d: read %d bytes from file %d\n",
+                             line, line * 37 % 512, line % 7);
+      if (len > PGSIZE - ofs)
+        len = PGSIZE - ofs;
+      memcpy (page + ofs, buf, len);
+      ofs += len;
+      line++;
+    }
+}
+
+/* Random bytes, as in compressed or encrypted data. */
+static void
+fill_random (uint8_t *page) 
+{
+  uint64_t x = 1;
+  size_t i;
+
+  for (i = 0; i < PGSIZE; i++) 
+    {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      page[i] = x >> 56;
+    }
+}
+
+static const struct pattern 
+  {
+    const char *name;
+    fill_func *fill;
+  }
+patterns[] = 
+  {
+    {"zero", fill_zero},
+    {"heap", fill_heap},
+    {"text", fill_text},
+    {"random", fill_random},
+  };
+
+#define PATTERN_CNT (sizeof patterns / sizeof *patterns)
+
+void
+test_zswap_compress (void) 
+{
+  uint8_t *page = palloc_get_page (PAL_ASSERT);
+  uint8_t *out = palloc_get_page (PAL_ASSERT);
+  uint8_t *comp = malloc (2 * PGSIZE);
+  void *work = malloc (LZ_WORK_SIZE);
+  size_t i;
+
+  ASSERT (comp != NULL && work != NULL);
+
+  for (i = 0; i < PATTERN_CNT; i++) 
+    {
+      uint64_t start, comp_cycles, decomp_cycles;
+      size_t size = 0;
+      int r;
+
+      patterns[i].fill (page);
+
+      start = rdtsc ();
+      for (r = 0; r < ROUND_CNT; r++)
+        size = lz_compress (page, PGSIZE, comp, 2 * PGSIZE, work);
+      comp_cycles = (rdtsc () - start) / ROUND_CNT;
+      if (size == 0)
+        fail ("%s page did not fit in two pages", patterns[i].name);
+
+      start = rdtsc ();
+      for (r = 0; r < ROUND_CNT; r++)
+        if (!lz_decompress (comp, size, out, PGSIZE))
+          fail ("%s page did not decompress", patterns[i].name);
+      decomp_cycles = (rdtsc () - start) / ROUND_CNT;
+      if (memcmp (page, out, PGSIZE))
+        fail ("%s page decompressed wrongly", patterns[i].name);
+
+      msg ("%s page: %zu bytes, %"PRIu64" cycles to compress, "
+           "%"PRIu64" to decompress", patterns[i].name, size,
+           comp_cycles, decomp_cycles);
+    }
+
+  /* A poorly compressible page must be turned away, not
+     truncated. */
+  if (lz_compress (page, PGSIZE, comp, PGSIZE * 3 / 4, work) != 0)
+    fail ("random page fit in 3/4 of a page");
+  msg ("random page rejected by the pool");
+
+  free (work);
+  free (comp);
+  palloc_free_page (out);
+  palloc_free_page (page);
+}
@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::threads::bench;
+check_bench ('zero page: \d+ bytes, \d+ cycles to compress, \d+ to decompress',
+	     'heap page: \d+ bytes, \d+ cycles to compress, \d+ to decompress',
+	     'text page: \d+ bytes, \d+ cycles to compress, \d+ to decompress',
+	     'random page: \d+ bytes, \d+ cycles to compress, \d+ to decompress',
+	     'random page rejected by the pool');
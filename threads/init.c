@@ -17,10 +17,12 @@
 #include "threads/io.h"
 #include "threads/loader.h"
 #include "threads/malloc.h"
+#include "threads/memtrack.h"
 #include "threads/mmu.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
 #include "threads/thread.h"
+#include "threads/vmalloc.h"
 #ifdef USERPROG
 #include "userprog/process.h"
 #include "userprog/exception.h"
@@ -31,6 +33,7 @@
 #include "tests/threads/tests.h"
 #ifdef VM
 #include "vm/vm.h"
+#include "vm/merge.h"
 #endif
 #ifdef FILESYS
 #include "devices/disk.h"
@@ -38,6 +41,9 @@
 #include "filesys/fsutil.h"
 #endif
 
+/* Physical memory size, in 4 kB pages. */
+size_t ram_pages;
+
 /* Page-map-level-4 with kernel mappings only. */
 uint64_t *base_pml4;
 
@@ -49,6 +55,12 @@ static bool format_filesys;
 /* -q: Power off after kernel tasks complete? */
 bool power_off_when_done;
 
+/* -nohuge: Map physical memory with 4 kB pages only? */
+static bool huge_direct_map = true;
+
+/* -nopcid: Flush the TLB on every page table switch? */
+static bool use_pcid = true;
+
 bool thread_tests;
 
 static void bss_init (void);
@@ -84,8 +96,10 @@ main (void) {
 
 	/* Initialize memory system. */
 	mem_end = palloc_init ();
+	ram_pages = mem_end / PGSIZE;
 	malloc_init ();
 	paging_init (mem_end);
+	vmalloc_init ();
 
 #ifdef USERPROG
 	tss_init ();
@@ -152,9 +166,20 @@ paging_init (uint64_t mem_end) {
 	extern char start, _end_kernel_text;
 	// Maps physical address [0 ~ mem_end] to
 	//   [LOADER_KERN_BASE ~ LOADER_KERN_BASE + mem_end].
+	// Whole 2 MB chunks that hold no kernel text are mapped with a
+	// single huge page each, which saves page tables and TLB entries.
 	for (uint64_t pa = 0; pa < mem_end; pa += PGSIZE) {
 		uint64_t va = (uint64_t) ptov(pa);
 
+		if (huge_direct_map && (pa & HPGMASK) == 0 && pa + HPGSIZE <= mem_end
+				&& (va + HPGSIZE <= (uint64_t) &start
+					|| va >= (uint64_t) &_end_kernel_text)) {
+			if ((pte = pml4e_walk_pde (pml4, va, 1)) != NULL)
+				*pte = pa | PTE_P | PTE_W | PTE_PS;
+			pa += HPGSIZE - PGSIZE;
+			continue;
+		}
+
 		perm = PTE_P | PTE_W;
 		if ((uint64_t) &start <= va && va < (uint64_t) &_end_kernel_text)
 			perm &= ~PTE_W;
@@ -165,6 +190,9 @@ paging_init (uint64_t mem_end) {
 
 	// reload cr3
 	pml4_activate(0);
+	if (use_pcid)
+		pcid_init ();
+	pml4_template_init ();
 }
 
 /* Breaks the kernel command line into words and returns them as
@@ -221,11 +249,31 @@ parse_options (char **argv) {
 			random_init (atoi (value));
 		else if (!strcmp (name, "-mlfqs"))
 			thread_mlfqs = true;
+		else if (!strcmp (name, "-mtrack"))
+			memtrack_enabled = true;
+		else if (!strcmp (name, "-nohuge"))
+			huge_direct_map = false;
+		else if (!strcmp (name, "-nopcid"))
+			use_pcid = false;
 #ifdef USERPROG
 		else if (!strcmp (name, "-ul"))
 			user_page_limit = atoi (value);
 		else if (!strcmp (name, "-threads-tests"))
 			thread_tests = true;
+#endif
+#ifdef VM
+		else if (!strcmp (name, "-zswap"))
+			zswap_pages = atoi (value);
+		else if (!strcmp (name, "-wlow"))
+			reclaim_low = atoi (value);
+		else if (!strcmp (name, "-whigh"))
+			reclaim_high = atoi (value);
+		else if (!strcmp (name, "-merge"))
+			merge_interval = atoi (value);
+		else if (!strcmp (name, "-nothp"))
+			thp_enabled = false;
+		else if (!strcmp (name, "-mlock"))
+			mlock_limit = atoi (value);
 #endif
 		else
 			PANIC ("unknown option `%s' (use -h for help)", name);
@@ -326,8 +374,19 @@ usage (void) {
 			"  -f                 Format file system disk during startup.\n"
 			"  -rs=SEED           Set random number seed to SEED.\n"
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
+			"  -mtrack            Track allocations by call site.\n"
+			"  -nohuge            Map physical memory with 4 kB pages only.\n"
+			"  -nopcid            Do not tag TLB entries with PCIDs.\n"
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+			"  -zswap=COUNT       Keep up to COUNT pages of compressed swap.\n"
+			"  -wlow=COUNT        Start page reclaim below COUNT free frames.\n"
+			"  -whigh=COUNT       Stop page reclaim at COUNT free frames.\n"
+			"  -merge=MS          Merge identical pages, scanning every MS ms.\n"
+			"  -nothp             Back anonymous memory with 4 kB pages only.\n"
+			"  -mlock=COUNT       Let each process lock up to COUNT pages.\n"
 #endif
 			);
 	power_off ();
@@ -354,6 +413,8 @@ static void
 print_stats (void) {
 	timer_print_stats ();
 	thread_print_stats ();
+	palloc_print_stats ();
+	tlb_print_stats ();
 #ifdef FILESYS
 	disk_print_stats ();
 #endif
@@ -362,4 +423,8 @@ print_stats (void) {
 #ifdef USERPROG
 	exception_print_stats ();
 #endif
+#ifdef VM
+	vm_print_stats ();
+#endif
+	memtrack_print_stats ();
 }
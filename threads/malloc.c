@@ -5,9 +5,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/memtrack.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "threads/vmalloc.h"
 
 /* A simple implementation of malloc().
 
@@ -32,7 +34,15 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.  Big blocks
+   of VMALLOC_THRESHOLD pages or more, and smaller ones the kernel
+   pool is too fragmented to satisfy, are mapped with vmalloc()
+   instead, which does not need physically contiguous pages.
+
+   When the allocation tracker is enabled (see memtrack.c), every
+   block carries a struct memtrack_tag just before the bytes
+   handed to the caller, recording the call site, size and birth
+   time of the allocation. */
 
 /* Descriptor. */
 struct desc {
@@ -42,6 +52,9 @@ struct desc {
 	struct lock lock;           /* Lock. */
 };
 
+/* Big blocks of at least this many pages always use vmalloc(). */
+#define VMALLOC_THRESHOLD 4
+
 /* Magic number for detecting arena corruption. */
 #define ARENA_MAGIC 0x9a548eed
 
@@ -63,6 +76,10 @@ static size_t desc_cnt;         /* Number of descriptors. */
 
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static void *alloc_block (size_t size);
+static void *get_big_pages (size_t page_cnt);
+static void free_block (void *);
+static void *tracked_malloc (size_t size, const void *caller);
 
 /* Initializes the malloc() descriptors. */
 void
@@ -83,6 +100,31 @@ malloc_init (void) {
    Returns a null pointer if memory is not available. */
 void *
 malloc (size_t size) {
+	return tracked_malloc (size, __builtin_return_address (0));
+}
+
+/* Allocates a SIZE-byte block on behalf of CALLER, prefixed by a
+   tag if the allocation tracker is enabled. */
+static void *
+tracked_malloc (size_t size, const void *caller) {
+	struct memtrack_tag *tag;
+
+	if (!memtrack_enabled)
+		return alloc_block (size);
+
+	if (size == 0)
+		return NULL;
+	tag = alloc_block (size + sizeof *tag);
+	if (tag == NULL)
+		return NULL;
+	memtrack_alloc (tag, MT_MALLOC, caller, size);
+	return tag + 1;
+}
+
+/* Obtains and returns a new block of at least SIZE bytes,
+   without any tracking. */
+static void *
+alloc_block (size_t size) {
 	struct desc *d;
 	struct block *b;
 	struct arena *a;
@@ -100,7 +142,7 @@ malloc (size_t size) {
 		/* SIZE is too big for any descriptor.
 		   Allocate enough pages to hold SIZE plus an arena. */
 		size_t page_cnt = DIV_ROUND_UP (size + sizeof *a, PGSIZE);
-		a = palloc_get_multiple (0, page_cnt);
+		a = get_big_pages (page_cnt);
 		if (a == NULL)
 			return NULL;
 
@@ -143,6 +185,20 @@ malloc (size_t size) {
 	return b;
 }
 
+/* Obtains PAGE_CNT pages for a big block.  Small ones come
+   physically contiguous from the page allocator when possible;
+   the rest are mapped page by page with vmalloc(). */
+static void *
+get_big_pages (size_t page_cnt) {
+	void *pages = NULL;
+
+	if (page_cnt < VMALLOC_THRESHOLD)
+		pages = palloc_get_multiple (0, page_cnt);
+	if (pages == NULL && page_cnt > 1)
+		pages = vmalloc (page_cnt * PGSIZE);
+	return pages;
+}
+
 /* Allocates and return A times B bytes initialized to zeroes.
    Returns a null pointer if memory is not available. */
 void *
@@ -156,7 +212,7 @@ calloc (size_t a, size_t b) {
 		return NULL;
 
 	/* Allocate and zero memory. */
-	p = malloc (size);
+	p = tracked_malloc (size, __builtin_return_address (0));
 	if (p != NULL)
 		memset (p, 0, size);
 
@@ -173,6 +229,17 @@ block_size (void *block) {
 	return d != NULL ? d->block_size : PGSIZE * a->free_cnt - pg_ofs (block);
 }
 
+/* Returns the number of bytes usable by the caller in BLOCK,
+   a pointer returned by malloc(). */
+static size_t
+user_size (void *block) {
+	if (memtrack_enabled) {
+		struct memtrack_tag *tag = (struct memtrack_tag *) block - 1;
+		return block_size (tag) - sizeof *tag;
+	}
+	return block_size (block);
+}
+
 /* Attempts to resize OLD_BLOCK to NEW_SIZE bytes, possibly
    moving it in the process.
    If successful, returns the new block; on failure, returns a
@@ -185,9 +252,10 @@ realloc (void *old_block, size_t new_size) {
 		free (old_block);
 		return NULL;
 	} else {
-		void *new_block = malloc (new_size);
+		void *new_block = tracked_malloc (new_size,
+				__builtin_return_address (0));
 		if (old_block != NULL && new_block != NULL) {
-			size_t old_size = block_size (old_block);
+			size_t old_size = user_size (old_block);
 			size_t min_size = new_size < old_size ? new_size : old_size;
 			memcpy (new_block, old_block, min_size);
 			free (old_block);
@@ -200,6 +268,18 @@ realloc (void *old_block, size_t new_size) {
    malloc(), calloc(), or realloc(). */
 void
 free (void *p) {
+	if (p != NULL && memtrack_enabled) {
+		struct memtrack_tag *tag = (struct memtrack_tag *) p - 1;
+		memtrack_free (tag);
+		p = tag;
+	}
+	free_block (p);
+}
+
+/* Frees block P, which must have been obtained from
+   alloc_block(). */
+static void
+free_block (void *p) {
 	if (p != NULL) {
 		struct block *b = p;
 		struct arena *a = block_to_arena (b);
@@ -233,7 +313,10 @@ free (void *p) {
 			lock_release (&d->lock);
 		} else {
 			/* It's a big block.  Free its pages. */
-			palloc_free_multiple (a, a->free_cnt);
+			if (is_vmalloc_vaddr (a))
+				vfree (a);
+			else
+				palloc_free_multiple (a, a->free_cnt);
 			return;
 		}
 	}
@@ -0,0 +1,203 @@
+#include "threads/memtrack.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include "threads/interrupt.h"
+#include "intrinsic.h"
+
+/* Allocation tracker.
+
+   When enabled with the -mtrack kernel command-line option,
+   malloc() and the page allocator report every allocation and
+   free here.  Allocations are attributed to the return address
+   of the allocator call, so the call sites printed at power-off
+   can be turned into source lines with the `backtrace' utility.
+
+   A leak check brackets a stretch of execution: memtrack_mark()
+   starts a new epoch, and memtrack_report_leaks() lists the call
+   sites whose allocations from that epoch are still live.  The
+   end of the stretch must be a point where everything started
+   in it is known to be finished.  With VM, the epoch starts when
+   initd is created, and the reaper reports once the last user
+   process has exited and every address space is torn down. */
+
+#define SITE_CNT 512                /* Table size, a power of 2. */
+#define SITE_OTHER 0                /* Catch-all once the table fills. */
+
+/* Statistics for one call site. */
+struct site {
+	const void *caller;             /* Return address, null if unused. */
+	enum memtrack_kind kind;        /* Allocator that was called. */
+	size_t alloc_cnt;               /* Number of allocations. */
+	size_t free_cnt;                /* Number of frees. */
+	size_t live_bytes;              /* Bytes currently allocated. */
+	size_t peak_bytes;              /* Maximum of live_bytes. */
+	uint64_t lifetime;              /* Cycles summed over freed blocks. */
+	size_t leak_cnt;                /* Live blocks from current epoch. */
+	size_t leak_bytes;              /* Bytes in those blocks. */
+};
+
+/* -mtrack: Record per-call-site allocation statistics? */
+bool memtrack_enabled;
+
+static struct site sites[SITE_CNT];
+static uint8_t epoch;               /* 0 until the first mark. */
+
+static const char *kind_name (enum memtrack_kind);
+static void print_site (const struct site *);
+
+/* Returns the index of the site for CALLER calling KIND,
+   claiming a free slot if CALLER has not been seen before.
+   Interrupts must be off. */
+static uint16_t
+lookup_site (enum memtrack_kind kind, const void *caller) {
+	size_t hash = ((uintptr_t) caller >> 2) * 2654435761u + kind;
+	size_t i;
+
+	for (i = 0; i < SITE_CNT; i++) {
+		size_t idx = (hash + i) & (SITE_CNT - 1);
+		struct site *s = &sites[idx];
+
+		if (idx == SITE_OTHER)
+			continue;
+		if (s->caller == NULL) {
+			s->caller = caller;
+			s->kind = kind;
+			return idx;
+		}
+		if (s->caller == caller && s->kind == kind)
+			return idx;
+	}
+	return SITE_OTHER;
+}
+
+/* Records a SIZE-byte allocation of type KIND made by CALLER,
+   filling in TAG so that memtrack_free() can attribute it
+   later. */
+void
+memtrack_alloc (struct memtrack_tag *tag, enum memtrack_kind kind,
+		const void *caller, size_t size) {
+	enum intr_level old_level = intr_disable ();
+	uint16_t idx = lookup_site (kind, caller);
+	struct site *s = &sites[idx];
+
+	s->alloc_cnt++;
+	s->live_bytes += size;
+	if (s->live_bytes > s->peak_bytes)
+		s->peak_bytes = s->live_bytes;
+	if (epoch != 0) {
+		s->leak_cnt++;
+		s->leak_bytes += size;
+	}
+
+	tag->site = idx;
+	tag->epoch = epoch;
+	tag->live = 1;
+	tag->size = size;
+	tag->birth = rdtsc ();
+	intr_set_level (old_level);
+}
+
+/* Records that the allocation described by TAG was freed.
+   Tags that were never filled in are ignored. */
+void
+memtrack_free (struct memtrack_tag *tag) {
+	enum intr_level old_level = intr_disable ();
+
+	if (tag->live) {
+		struct site *s = &sites[tag->site];
+
+		s->free_cnt++;
+		s->live_bytes -= tag->size;
+		s->lifetime += rdtsc () - tag->birth;
+		if (tag->epoch != 0 && tag->epoch == epoch) {
+			s->leak_cnt--;
+			s->leak_bytes -= tag->size;
+		}
+		tag->live = 0;
+	}
+	intr_set_level (old_level);
+}
+
+/* Starts a new leak-check epoch.  Allocations made from now on
+   are reported by memtrack_report_leaks() until they are
+   freed. */
+void
+memtrack_mark (void) {
+	enum intr_level old_level = intr_disable ();
+	size_t i;
+
+	if (++epoch == 0)
+		epoch = 1;
+	for (i = 0; i < SITE_CNT; i++)
+		sites[i].leak_cnt = sites[i].leak_bytes = 0;
+	intr_set_level (old_level);
+}
+
+/* Prints the call sites with allocations from the current epoch
+   that are still live. */
+void
+memtrack_report_leaks (void) {
+	size_t leak_cnt = 0, leak_bytes = 0;
+	size_t i;
+
+	if (!memtrack_enabled)
+		return;
+
+	for (i = 0; i < SITE_CNT; i++) {
+		const struct site *s = &sites[i];
+		if (s->leak_cnt == 0)
+			continue;
+		if (leak_cnt == 0)
+			printf ("Memtrack: allocations still live:\n");
+		printf ("  %18p %-6s %8zu blocks %10zu bytes\n",
+				s->caller, kind_name (s->kind), s->leak_cnt, s->leak_bytes);
+		leak_cnt += s->leak_cnt;
+		leak_bytes += s->leak_bytes;
+	}
+	printf ("Memtrack: %zu leaked blocks, %zu bytes\n", leak_cnt, leak_bytes);
+}
+
+/* Prints per-call-site statistics, largest peak first. */
+void
+memtrack_print_stats (void) {
+	static uint16_t order[SITE_CNT];
+	size_t cnt = 0;
+	size_t i, j;
+
+	if (!memtrack_enabled)
+		return;
+
+	/* Insertion sort of the used sites by peak bytes. */
+	for (i = 0; i < SITE_CNT; i++) {
+		if (sites[i].alloc_cnt == 0)
+			continue;
+		for (j = cnt; j > 0
+				&& sites[order[j - 1]].peak_bytes < sites[i].peak_bytes; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+		cnt++;
+	}
+
+	printf ("Memtrack: %zu call sites\n", cnt);
+	printf ("  %18s %-6s %8s %8s %10s %10s %12s\n", "caller", "kind",
+			"allocs", "frees", "live", "peak", "avg-cycles");
+	for (i = 0; i < cnt; i++)
+		print_site (&sites[order[i]]);
+}
+
+/* Prints one line of statistics for S. */
+static void
+print_site (const struct site *s) {
+	uint64_t avg_life = s->free_cnt ? s->lifetime / s->free_cnt : 0;
+
+	printf ("  %18p %-6s %8zu %8zu %10zu %10zu %12"PRIu64"\n",
+			s->caller, kind_name (s->kind), s->alloc_cnt, s->free_cnt,
+			s->live_bytes, s->peak_bytes, avg_life);
+}
+
+/* Returns a short name for allocator KIND. */
+static const char *
+kind_name (enum memtrack_kind kind) {
+	return kind == MT_MALLOC ? "malloc" : "palloc";
+}
@@ -1,21 +1,84 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/pte.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
 #include "intrinsic.h"
 
+/* Page-table pages.
+ *
+ * A page-table page, at any level, must start out zeroed.  Instead of
+ * zeroing each one as it is allocated, on the way into a fork or an
+ * exec, pages are zeroed as they are freed, which with VM is mostly
+ * done by the reaper thread, and kept in a small cache that new page
+ * tables come from first.  Once the cache holds PT_CACHE_MAX pages,
+ * freed pages go straight back to the kernel pool.  The cache is
+ * only touched with interrupts off. */
+
+#define PT_CACHE_MAX 32
+
+static void *pt_cache[PT_CACHE_MAX];
+static size_t pt_cache_cnt;
+
+/* Page-table page statistics. */
+static long long pt_alloc_cnt;          /* Pages allocated. */
+static long long pt_cache_hit_cnt;      /* ...taken from the cache. */
+
+/* Indexes of the present entries of base_pml4.  Every page table
+ * shares these entries, and with them all of the kernel's lower-level
+ * tables, so a new one needs only them filled in. */
+static unsigned kernel_pml4e[PGSIZE / sizeof (uint64_t)];
+static size_t kernel_pml4e_cnt;
+
+/* Returns a zeroed page for a page table, or a null pointer if memory
+ * runs out. */
+static uint64_t *
+pt_alloc (void) {
+	enum intr_level old_level = intr_disable ();
+	void *page = pt_cache_cnt > 0 ? pt_cache[--pt_cache_cnt] : NULL;
+
+	pt_alloc_cnt++;
+	if (page != NULL)
+		pt_cache_hit_cnt++;
+	intr_set_level (old_level);
+	return page != NULL ? page : palloc_get_page (PAL_ZERO);
+}
+
+/* Frees PT, a page-table page, keeping it zeroed in the cache if
+ * there is room. */
+static void
+pt_free (uint64_t *pt) {
+	enum intr_level old_level;
+
+	if (pt_cache_cnt < PT_CACHE_MAX) {
+		memset (pt, 0, PGSIZE);
+		old_level = intr_disable ();
+		if (pt_cache_cnt < PT_CACHE_MAX) {
+			pt_cache[pt_cache_cnt++] = pt;
+			pt = NULL;
+		}
+		intr_set_level (old_level);
+	}
+	if (pt != NULL)
+		palloc_free_page (pt);
+}
+
 static uint64_t *
 pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 	int idx = PDX (va);
 	if (pdp) {
 		uint64_t *pte = (uint64_t *) pdp[idx];
+		/* A huge page has no page table; its PDE is the leaf. */
+		if (((uint64_t) pte & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+			return &pdp[idx];
 		if (!((uint64_t) pte & PTE_P)) {
 			if (create) {
-				uint64_t *new_page = palloc_get_page (PAL_ZERO);
+				uint64_t *new_page = pt_alloc ();
 				if (new_page)
 					pdp[idx] = vtop (new_page) | PTE_U | PTE_W | PTE_P;
 				else
@@ -35,9 +98,11 @@ pdpe_walk (uint64_t *pdpe, const uint64_t va, int create) {
 	int allocated = 0;
 	if (pdpe) {
 		uint64_t *pde = (uint64_t *) pdpe[idx];
+		/* 1 GB pages are never created. */
+		ASSERT (!((uint64_t) pde & PTE_PS));
 		if (!((uint64_t) pde & PTE_P)) {
 			if (create) {
-				uint64_t *new_page = palloc_get_page (PAL_ZERO);
+				uint64_t *new_page = pt_alloc ();
 				if (new_page) {
 					pdpe[idx] = vtop (new_page) | PTE_U | PTE_W | PTE_P;
 					allocated = 1;
@@ -49,7 +114,7 @@ pdpe_walk (uint64_t *pdpe, const uint64_t va, int create) {
 		pte = pgdir_walk (ptov (PTE_ADDR (pdpe[idx])), va, create);
 	}
 	if (pte == NULL && allocated) {
-		palloc_free_page ((void *) ptov (PTE_ADDR (pdpe[idx])));
+		pt_free (ptov (PTE_ADDR (pdpe[idx])));
 		pdpe[idx] = 0;
 	}
 	return pte;
@@ -60,7 +125,9 @@ pdpe_walk (uint64_t *pdpe, const uint64_t va, int create) {
  * If PML4E does not have a page table for VADDR, behavior depends
  * on CREATE.  If CREATE is true, then a new page table is
  * created and a pointer into it is returned.  Otherwise, a null
- * pointer is returned. */
+ * pointer is returned.
+ * If VADDR lies in a 2 MB page, the address of its page directory
+ * entry, which has PTE_PS set, is returned instead. */
 uint64_t *
 pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 	uint64_t *pte = NULL;
@@ -70,7 +137,9 @@ pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 		uint64_t *pdpe = (uint64_t *) pml4e[idx];
 		if (!((uint64_t) pdpe & PTE_P)) {
 			if (create) {
-				uint64_t *new_page = palloc_get_page (PAL_ZERO);
+				/* See pml4_template_init(). */
+				ASSERT (pml4e != base_pml4 || kernel_pml4e_cnt == 0);
+				uint64_t *new_page = pt_alloc ();
 				if (new_page) {
 					pml4e[idx] = vtop (new_page) | PTE_U | PTE_W | PTE_P;
 					allocated = 1;
@@ -82,21 +151,67 @@ pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 		pte = pdpe_walk (ptov (PTE_ADDR (pml4e[idx])), va, create);
 	}
 	if (pte == NULL && allocated) {
-		palloc_free_page ((void *) ptov (PTE_ADDR (pml4e[idx])));
+		pt_free (ptov (PTE_ADDR (pml4e[idx])));
 		pml4e[idx] = 0;
 	}
 	return pte;
 }
 
+/* Returns the address of the page directory entry for virtual
+ * address VA in PML4, creating the intermediate tables if CREATE
+ * is true.  Returns a null pointer if they do not exist and CREATE
+ * is false, or if memory allocation fails. */
+uint64_t *
+pml4e_walk_pde (uint64_t *pml4, const uint64_t va, int create) {
+	const unsigned idx[] = { PML4 (va), PDPE (va) };
+	uint64_t *table = pml4;
+
+	for (unsigned level = 0; level < sizeof idx / sizeof *idx; level++) {
+		uint64_t *entry = &table[idx[level]];
+		if (!(*entry & PTE_P)) {
+			uint64_t *new_page = create ? pt_alloc () : NULL;
+			if (new_page == NULL)
+				return NULL;
+			*entry = vtop (new_page) | PTE_U | PTE_W | PTE_P;
+		}
+		ASSERT (!(*entry & PTE_PS));
+		table = ptov (PTE_ADDR (*entry));
+	}
+	return &table[PDX (va)];
+}
+
+/* Records the kernel's top-level entries for pml4_create() and fills
+ * the page-table cache halfway.  Called once base_pml4 maps the whole
+ * kernel.  No top-level entries may be added to base_pml4 afterward;
+ * vmalloc(), for one, maps pages under an entry that exists by then. */
+void
+pml4_template_init (void) {
+	unsigned i;
+
+	for (i = 0; i < PGSIZE / sizeof (uint64_t); i++)
+		if (base_pml4[i] & PTE_P)
+			kernel_pml4e[kernel_pml4e_cnt++] = i;
+	while (pt_cache_cnt < PT_CACHE_MAX / 2) {
+		void *page = palloc_get_page (PAL_ZERO);
+		if (page == NULL)
+			break;
+		pt_cache[pt_cache_cnt++] = page;
+	}
+}
+
 /* Creates a new page map level 4 (pml4) has mappings for kernel
  * virtual addresses, but none for user virtual addresses.
  * Returns the new page directory, or a null pointer if memory
  * allocation fails. */
 uint64_t *
 pml4_create (void) {
-	uint64_t *pml4 = palloc_get_page (0);
+	uint64_t *pml4 = pt_alloc ();
+	size_t i;
+
+	ASSERT (kernel_pml4e_cnt > 0);
 	if (pml4)
-		memcpy (pml4, base_pml4, PGSIZE);
+		for (i = 0; i < kernel_pml4e_cnt; i++)
+			pml4[kernel_pml4e[i]] = base_pml4[kernel_pml4e[i]];
 	return pml4;
 }
 
@@ -122,7 +237,13 @@ pgdir_for_each (uint64_t *pdp, pte_for_each_func *func, void *aux,
 		unsigned pml4_index, unsigned pdp_index) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
+		if ((pdp[i] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+			void *va = (void *) (((uint64_t) pml4_index << PML4SHIFT) |
+								 ((uint64_t) pdp_index << PDPESHIFT) |
+								 ((uint64_t) i << PDXSHIFT));
+			if (!func (&pdp[i], va, aux))
+				return false;
+		} else if (((uint64_t) pte) & PTE_P)
 			if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
 					pml4_index, pdp_index, i))
 				return false;
@@ -143,7 +264,9 @@ pdp_for_each (uint64_t *pdp,
 	return true;
 }
 
-/* Apply FUNC to each available pte entries including kernel's. */
+/* Apply FUNC to each available pte entries including kernel's.
+ * A 2 MB page is visited once, with its PDE and the address of
+ * its first byte. */
 bool
 pml4_for_each (uint64_t *pml4, pte_for_each_func *func, void *aux) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
@@ -162,17 +285,19 @@ pt_destroy (uint64_t *pt) {
 		if (((uint64_t) pte) & PTE_P)
 			palloc_free_page ((void *) PTE_ADDR (pte));
 	}
-	palloc_free_page ((void *) pt);
+	pt_free (pt);
 }
 
 static void
 pgdir_destroy (uint64_t *pdp) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
+		if ((pdp[i] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+			palloc_free_multiple (ptov (HPTE_ADDR (pdp[i])), HPG_PAGES);
+		else if (((uint64_t) pte) & PTE_P)
 			pt_destroy (PTE_ADDR (pte));
 	}
-	palloc_free_page ((void *) pdp);
+	pt_free (pdp);
 }
 
 static void
@@ -182,7 +307,180 @@ pdpe_destroy (uint64_t *pdpe) {
 		if (((uint64_t) pde) & PTE_P)
 			pgdir_destroy ((void *) PTE_ADDR (pde));
 	}
-	palloc_free_page ((void *) pdpe);
+	pt_free (pdpe);
+}
+
+/* Process-context identifiers.
+ *
+ * Without PCIDs, loading CR3 flushes every TLB entry for user
+ * addresses, so a process that has just been switched back in starts
+ * with a cold TLB.  With CR4.PCIDE set, each TLB entry is tagged with
+ * the PCID in CR3 when it was made, and loading CR3 with bit 63 set
+ * keeps the entries of the other PCIDs.
+ *
+ * There are only 4096 PCIDs, and far fewer are worth having, so page
+ * tables get one of PCID_CNT from a small table when they are
+ * activated, taking the next one round-robin once all are in use.
+ * PCID 0 belongs to base_pml4.  A page table that gets a PCID anew
+ * flushes its entries on activation, since they may be left over from
+ * the previous owner.
+ *
+ * The catch is invalidation.  invlpg affects the current PCID only, so
+ * a change to the page table of a process that is not running marks
+ * its PCID stale, and its next activation flushes.  A change to the
+ * kernel's mappings, which every page table shares, marks all the
+ * other PCIDs stale.  Interrupts are off while the table changes. */
+
+#define PCID_CNT 64                 /* PCIDs handed out, including 0. */
+#define CR3_NOFLUSH (1ULL << 63)    /* Keep TLB entries on CR3 load. */
+#define CR4_PCIDE (1 << 17)         /* CR4: PCIDs enabled. */
+#define CPUID_1_ECX_PCID (1 << 17)  /* CPUID 1, ECX: PCIDs supported. */
+
+struct pcid {
+	uint64_t *pml4;             /* Page table using it, or null. */
+	bool stale;                 /* TLB may hold outdated entries? */
+};
+
+static struct pcid pcids[PCID_CNT];
+static bool pcid_enabled;
+static unsigned pcid_next = 1;      /* Next PCID to take back. */
+
+/* PCID statistics. */
+static long long pcid_keep_cnt;     /* Activations that kept the TLB. */
+static long long pcid_flush_cnt;    /* ...that flushed a stale PCID. */
+static long long pcid_assign_cnt;   /* ...that assigned a PCID. */
+static long long pcid_recycle_cnt;  /* ...taking it from another. */
+
+/* Page table switch statistics. */
+static long long cr3_load_cnt;      /* Loads of CR3. */
+static long long cr3_same_cnt;      /* Switches to the loaded table. */
+static long long cr3_lazy_cnt;      /* Switches to kernel threads. */
+
+/* Huge page statistics. */
+static long long huge_split_cnt;    /* User huge pages split. */
+
+/* Turns on PCIDs if the CPU supports them.  Must be called with
+ * base_pml4 active. */
+void
+pcid_init (void) {
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid (1, &eax, &ebx, &ecx, &edx);
+	if (!(ecx & CPUID_1_ECX_PCID))
+		return;
+	ASSERT ((rcr3 () & PGMASK) == 0);
+
+	pcids[0].pml4 = base_pml4;
+	lcr4 (rcr4 () | CR4_PCIDE);
+	pcid_enabled = true;
+}
+
+/* Returns true if PCIDs are in use. */
+bool
+pcid_is_enabled (void) {
+	return pcid_enabled;
+}
+
+/* Returns the PCID of PML4, or -1 if it has none. */
+static int
+pcid_find (const uint64_t *pml4) {
+	int id;
+
+	for (id = 0; id < PCID_CNT; id++)
+		if (pcids[id].pml4 == pml4)
+			return id;
+	return -1;
+}
+
+/* Returns the value to load into CR3 to activate PML4, assigning it a
+ * PCID if it has none.  Interrupts must be off. */
+static uint64_t
+pcid_cr3 (uint64_t *pml4) {
+	int id = pcid_find (pml4);
+	bool flush;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (id < 0) {
+		id = pcid_find (NULL);
+		if (id < 0) {
+			id = pcid_next;
+			pcid_next = pcid_next + 1 < PCID_CNT ? pcid_next + 1 : 1;
+			pcid_recycle_cnt++;
+		}
+		pcids[id].pml4 = pml4;
+		pcid_assign_cnt++;
+		flush = true;
+	} else if (pcids[id].stale) {
+		pcid_flush_cnt++;
+		flush = true;
+	} else {
+		pcid_keep_cnt++;
+		flush = false;
+	}
+	pcids[id].stale = false;
+	return vtop (pml4) | id | (flush ? 0 : CR3_NOFLUSH);
+}
+
+/* Returns true if PML4 is the active page table. */
+static bool
+pml4_is_active (const uint64_t *pml4) {
+	return (rcr3 () & ~(uint64_t) PGMASK) == vtop (pml4);
+}
+
+/* Invalidates the TLB entry for user virtual page VA of PML4, after a
+ * change to its PTE.  Only the active page table's entries can be
+ * invalidated directly; a page table that is not active has its PCID
+ * flushed when it is next activated. */
+void
+tlb_invalidate (uint64_t *pml4, const void *va) {
+	if (pml4_is_active (pml4))
+		invlpg ((uint64_t) va);
+	else if (pcid_enabled) {
+		enum intr_level old_level = intr_disable ();
+		int id = pcid_find (pml4);
+
+		if (id >= 0)
+			pcids[id].stale = true;
+		intr_set_level (old_level);
+	}
+}
+
+/* Invalidates the TLB entries for kernel virtual page VA, after a
+ * change to its PTE.  The kernel's mappings are shared by every page
+ * table, so entries for VA may be tagged with any PCID. */
+void
+tlb_invalidate_kernel (const void *va) {
+	enum intr_level old_level;
+	int id, cur;
+
+	invlpg ((uint64_t) va);
+	if (!pcid_enabled)
+		return;
+
+	old_level = intr_disable ();
+	cur = rcr3 () & PGMASK;
+	for (id = 0; id < PCID_CNT; id++)
+		if (id != cur && pcids[id].pml4 != NULL)
+			pcids[id].stale = true;
+	intr_set_level (old_level);
+}
+
+/* Prints page table switch, page-table page and PCID statistics. */
+void
+tlb_print_stats (void) {
+	printf ("TLB: %lld CR3 loads, %lld avoided (%lld for kernel threads), "
+			"%lld huge pages split\n", cr3_load_cnt, cr3_same_cnt + cr3_lazy_cnt,
+			cr3_lazy_cnt, huge_split_cnt);
+	printf ("Page tables: %lld pages allocated, %lld from the zeroed cache\n",
+			pt_alloc_cnt, pt_cache_hit_cnt);
+	if (!pcid_enabled) {
+		printf ("TLB: PCIDs off\n");
+		return;
+	}
+	printf ("TLB: %lld switches kept the TLB, %lld flushed a stale PCID, "
+			"%lld assigned one (%lld recycled)\n",
+			pcid_keep_cnt, pcid_flush_cnt, pcid_assign_cnt, pcid_recycle_cnt);
 }
 
 /* Destroys pml4e, freeing all the pages it references. */
@@ -192,18 +490,112 @@ pml4_destroy (uint64_t *pml4) {
 		return;
 	ASSERT (pml4 != base_pml4);
 
+	/* A kernel thread may still be running on it; see pml4_switch().
+	 * Its PCID goes before the page can be reused as a page table. */
+	enum intr_level old_level = intr_disable ();
+	if (pml4_is_active (pml4))
+		pml4_activate (NULL);
+	if (pcid_enabled) {
+		int id = pcid_find (pml4);
+		if (id >= 0)
+			pcids[id].pml4 = NULL;
+	}
+	intr_set_level (old_level);
+
 	/* if PML4 (vaddr) >= 1, it's kernel space by define. */
 	uint64_t *pdpe = ptov ((uint64_t *) pml4[0]);
 	if (((uint64_t) pdpe) & PTE_P)
 		pdpe_destroy ((void *) PTE_ADDR (pdpe));
-	palloc_free_page ((void *) pml4);
+	pt_free (pml4);
 }
 
 /* Loads page directory PD into the CPU's page directory base
- * register. */
+ * register, unless it is already loaded.  With PCIDs, the TLB entries
+ * of other page tables stay. */
 void
 pml4_activate (uint64_t *pml4) {
-	lcr3 (vtop (pml4 ? pml4 : base_pml4));
+	enum intr_level old_level;
+
+	if (pml4 == NULL)
+		pml4 = base_pml4;
+
+	/* The active page table never has stale TLB entries, since
+	 * tlb_invalidate() flushes them on the spot. */
+	old_level = intr_disable ();
+	if (pml4_is_active (pml4))
+		cr3_same_cnt++;
+	else {
+		lcr3 (pcid_enabled ? pcid_cr3 (pml4) : vtop (pml4));
+		cr3_load_cnt++;
+	}
+	intr_set_level (old_level);
+}
+
+/* Switches to PML4 for a thread about to run.  A null PML4 means a
+ * kernel thread, which touches only kernel addresses.  Those are
+ * mapped alike in every page table, so a kernel thread borrows
+ * whichever page table is active rather than loading base_pml4, and
+ * switching from a process to a kernel thread and back to the same
+ * process loads CR3 not at all.  The borrowed page table may be
+ * destroyed while borrowed, which pml4_destroy() allows for. */
+void
+pml4_switch (uint64_t *pml4) {
+	if (pml4 == NULL)
+		cr3_lazy_cnt++;
+	else
+		pml4_activate (pml4);
+}
+
+/* Replaces the 2 MB page that PDE maps in PML4 with a page table
+ * mapping the same frames with 4 kB pages, each with the permissions
+ * and accessed and dirty bits of the 2 MB page.  VA is an address in
+ * the 2 MB page.  Returns false, leaving the 2 MB page alone, if no
+ * memory is left for the page table. */
+static bool
+huge_split (uint64_t *pml4, uint64_t *pde, uint64_t va) {
+	uint64_t *pt = pt_alloc ();
+	uint64_t pa = HPTE_ADDR (*pde);
+	uint64_t flags = *pde & PTE_FLAGS & ~(uint64_t) PTE_PS;
+	unsigned i;
+
+	ASSERT ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS));
+
+	if (pt == NULL)
+		return false;
+	for (i = 0; i < HPG_PAGES; i++)
+		pt[i] = (pa + i * PGSIZE) | flags;
+	*pde = vtop (pt) | PTE_U | PTE_W | PTE_P;
+	tlb_invalidate (pml4, (void *) (va & ~HPGMASK));
+	huge_split_cnt++;
+	return true;
+}
+
+/* Stores in *PTEP the page table entry for user virtual page VA in
+ * PML4, about to be changed for VA alone, or a null pointer if there
+ * is none.  A 2 MB page covering VA is split first.  Returns false if
+ * that fails for lack of memory. */
+static bool
+pte_for_update (uint64_t *pml4, const void *va, uint64_t **ptep) {
+	uint64_t *pte = pml4e_walk (pml4, (uint64_t) va, false);
+
+	if (pte != NULL && (*pte & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+		if (!huge_split (pml4, pte, (uint64_t) va))
+			return false;
+		pte = pml4e_walk (pml4, (uint64_t) va, false);
+	}
+	*ptep = pte;
+	return true;
+}
+
+/* Returns true if no entry of page table PT is present. */
+static bool
+pt_is_empty (const uint64_t *pt) {
+	unsigned i;
+
+	for (i = 0; i < PGSIZE / sizeof *pt; i++)
+		if (pt[i] & PTE_P)
+			return false;
+	return true;
 }
 
 /* Looks up the physical address that corresponds to user virtual
@@ -216,8 +608,11 @@ pml4_get_page (uint64_t *pml4, const void *uaddr) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) uaddr, 0);
 
-	if (pte && (*pte & PTE_P))
+	if (pte && (*pte & PTE_P)) {
+		if (*pte & PTE_PS)
+			return ptov (HPTE_ADDR (*pte)) + ((uint64_t) uaddr & HPGMASK);
 		return ptov (PTE_ADDR (*pte)) + pg_ofs (uaddr);
+	}
 	return NULL;
 }
 
@@ -238,28 +633,98 @@ pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) upage, 1);
 
-	if (pte)
+	if (pte) {
+		ASSERT (!(*pte & PTE_PS));
 		*pte = vtop (kpage) | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+	}
 	return pte != NULL;
 }
 
+/* Maps the 2 MB of user virtual memory starting at UPAGE in PML4
+ * to the physically contiguous frames starting at kernel virtual
+ * address KPAGE with a single page directory entry.  Both addresses
+ * must be 2 MB aligned, and no page of the range may be mapped with
+ * 4 kB pages.  A page table left over for the range with nothing
+ * present in it is freed.  Returns true if successful, false if
+ * memory allocation failed or a page of the range is mapped. */
+bool
+pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
+	uint64_t *pde;
+	ASSERT (((uint64_t) upage & HPGMASK) == 0);
+	ASSERT ((vtop (kpage) & HPGMASK) == 0);
+	ASSERT (is_user_vaddr (upage));
+	ASSERT (pml4 != base_pml4);
+
+	pde = pml4e_walk_pde (pml4, (uint64_t) upage, 1);
+	if (pde == NULL)
+		return false;
+	if ((*pde & (PTE_P | PTE_PS)) == PTE_P) {
+		uint64_t *pt = ptov (PTE_ADDR (*pde));
+
+		if (!pt_is_empty (pt))
+			return false;
+		*pde = 0;
+		pt_free (pt);
+	}
+	*pde = vtop (kpage) | PTE_P | PTE_PS | (rw ? PTE_W : 0) | PTE_U;
+	tlb_invalidate (pml4, upage);
+	return true;
+}
+
 /* Marks user virtual page UPAGE "not present" in page
  * directory PD.  Later accesses to the page will fault.  Other
  * bits in the page table entry are preserved.
- * UPAGE need not be mapped. */
-void
+ * UPAGE need not be mapped.  If it lies in a 2 MB page, that is
+ * split into 4 kB pages first.  Returns false, changing nothing, if
+ * no memory is left for the split. */
+bool
 pml4_clear_page (uint64_t *pml4, void *upage) {
 	uint64_t *pte;
 	ASSERT (pg_ofs (upage) == 0);
 	ASSERT (is_user_vaddr (upage));
 
-	pte = pml4e_walk (pml4, (uint64_t) upage, false);
+	if (!pte_for_update (pml4, upage, &pte))
+		return false;
 
 	if (pte != NULL && (*pte & PTE_P) != 0) {
 		*pte &= ~PTE_P;
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) upage);
+		tlb_invalidate (pml4, upage);
+	}
+	return true;
+}
+
+/* Splits the 2 MB page covering user virtual page UPAGE in PML4, if
+ * any, into 4 kB pages, so that UPAGE's entry can then be changed
+ * without allocating memory.  Returns false, changing nothing, if no
+ * memory is left for the split. */
+bool
+pml4_split_page (uint64_t *pml4, const void *upage) {
+	uint64_t *pte;
+
+	return pte_for_update (pml4, upage, &pte);
+}
+
+/* Points the PTE for user virtual page UPAGE in PML4 at the frame
+ * identified by kernel virtual address KPAGE, preserving the other
+ * bits of the entry.  Used to move a page to a different frame
+ * without the process noticing.  Does nothing if PML4 has no PTE for
+ * UPAGE.  A 2 MB page covering UPAGE is split first.  Returns false,
+ * changing nothing, if no memory is left for the split. */
+bool
+pml4_move_page (uint64_t *pml4, void *upage, void *kpage) {
+	uint64_t *pte;
+	ASSERT (pg_ofs (upage) == 0);
+	ASSERT (pg_ofs (kpage) == 0);
+	ASSERT (is_user_vaddr (upage));
+
+	if (!pte_for_update (pml4, upage, &pte))
+		return false;
+
+	if (pte != NULL) {
+		*pte = vtop (kpage) | (*pte & PTE_FLAGS);
+		tlb_invalidate (pml4, upage);
 	}
+	return true;
 }
 
 /* Returns true if the PTE for virtual page VPAGE in PML4 is dirty,
@@ -273,19 +738,24 @@ pml4_is_dirty (uint64_t *pml4, const void *vpage) {
 }
 
 /* Set the dirty bit to DIRTY in the PTE for virtual page VPAGE
- * in PML4. */
-void
+ * in PML4.  A 2 MB page covering VPAGE is split first, since it has
+ * only one dirty bit for all of its pages.  Returns false, changing
+ * nothing, if no memory is left for the split. */
+bool
 pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
-	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+	uint64_t *pte;
+
+	if (!pte_for_update (pml4, vpage, &pte))
+		return false;
 	if (pte) {
 		if (dirty)
 			*pte |= PTE_D;
 		else
-			*pte &= ~(uint32_t) PTE_D;
+			*pte &= ~(uint64_t) PTE_D;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		tlb_invalidate (pml4, vpage);
 	}
+	return true;
 }
 
 /* Returns true if the PTE for virtual page VPAGE in PML4 has been
@@ -299,7 +769,9 @@ pml4_is_accessed (uint64_t *pml4, const void *vpage) {
 }
 
 /* Sets the accessed bit to ACCESSED in the PTE for virtual page
-   VPAGE in PD. */
+   VPAGE in PD.  For a page in a 2 MB page, this sets the bit of the
+   whole 2 MB page, which the hardware also sets for all of its
+   pages at once. */
 void
 pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
@@ -307,9 +779,228 @@ pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
 		if (accessed)
 			*pte |= PTE_A;
 		else
-			*pte &= ~(uint32_t) PTE_A;
+			*pte &= ~(uint64_t) PTE_A;
+
+		tlb_invalidate (pml4, vpage);
+	}
+}
+
+/* Sets the writable bit to WRITABLE in the PTE for user virtual
+ * page VPAGE in PML4.  Other bits in the PTE are preserved.  Does
+ * nothing if VPAGE is not mapped.  A 2 MB page covering VPAGE is
+ * split first.  Returns false, changing nothing, if no memory is left
+ * for the split. */
+bool
+pml4_set_writable (uint64_t *pml4, const void *vpage, bool writable) {
+	uint64_t *pte;
+
+	if (!pte_for_update (pml4, vpage, &pte))
+		return false;
+	if (pte && (*pte & PTE_P)) {
+		if (writable)
+			*pte |= PTE_W;
+		else
+			*pte &= ~(uint64_t) PTE_W;
+
+		tlb_invalidate (pml4, vpage);
+	}
+	return true;
+}
+
+/* Range operations.
+ *
+ * The functions above walk all four levels from the root for every
+ * page.  The ones below walk once per page table and then run through
+ * its entries in order, and they flush the TLB once for the whole
+ * range: page by page while that is cheap, or all at once when more
+ * than TLB_FLUSH_MAX pages change. */
+
+#define TLB_FLUSH_MAX 32
+
+/* Called by pml4_range_apply() on the leaf entry PTE for VA, which is
+ * present.  Returns true if it changed PTE in a way the TLB must see. */
+typedef bool pte_range_func (uint64_t *pte, uint64_t va, void *aux);
+
+/* Splits the 2 MB page of PML4 that covers VA, if there is one and
+ * it does not lie entirely inside [START, END).  Returns false if no
+ * memory is left for the split. */
+static bool
+range_split_edge (uint64_t *pml4, uint64_t va, uint64_t start,
+		uint64_t end) {
+	uint64_t *pde = pml4e_walk_pde (pml4, va, false);
+	uint64_t base = va & ~HPGMASK;
+
+	if (pde == NULL || (*pde & (PTE_P | PTE_PS)) != (PTE_P | PTE_PS)
+			|| (base >= start && end - base >= HPGSIZE))
+		return true;
+	return huge_split (pml4, pde, va);
+}
+
+/* Calls FUNC on every present leaf entry of PML4 for the user pages in
+ * [START, END), then invalidates the TLB entries of those it changed.
+ * A 2 MB page entirely inside the range is passed to FUNC as one
+ * entry; one that straddles either end is split first.  Returns false,
+ * without calling FUNC, if no memory is left for a split.  That cannot
+ * happen if START and END are 2 MB aligned. */
+static bool
+pml4_range_apply (uint64_t *pml4, uint64_t start, uint64_t end,
+		pte_range_func *func, void *aux) {
+	bool active = pml4_is_active (pml4);
+	size_t changed = 0;
+	uint64_t va = start;
+
+	ASSERT (start % PGSIZE == 0 && end % PGSIZE == 0);
+	ASSERT (start <= end && end <= KERN_BASE);
+
+	if (start < end && (!range_split_edge (pml4, start, start, end)
+				|| !range_split_edge (pml4, end - PGSIZE, start, end)))
+		return false;
+
+	while (va < end) {
+		uint64_t *pde = pml4e_walk_pde (pml4, va, false);
+		uint64_t *pt;
+
+		if (pde == NULL) {
+			/* No page directory: skip the 1 GB it would cover. */
+			va = (va | ((1UL << PDPESHIFT) - 1)) + 1;
+			continue;
+		}
+		if ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+			ASSERT (va % HPGSIZE == 0 && end - va >= HPGSIZE);
+			if (func (pde, va, aux) && ++changed <= TLB_FLUSH_MAX && active)
+				invlpg (va);
+			va += HPGSIZE;
+			continue;
+		}
+		if (!(*pde & PTE_P)) {
+			va = (va | HPGMASK) + 1;
+			continue;
+		}
+
+		pt = ptov (PTE_ADDR (*pde));
+		do {
+			uint64_t *pte = &pt[PTX (va)];
+
+			if ((*pte & PTE_P) && func (pte, va, aux)
+					&& ++changed <= TLB_FLUSH_MAX && active)
+				invlpg (va);
+			va += PGSIZE;
+		} while (va < end && PTX (va) != 0);
+	}
+
+	if (changed == 0)
+		return true;
+	if (!active)
+		tlb_invalidate (pml4, (void *) start);
+	else if (changed > TLB_FLUSH_MAX) {
+		/* Reloading CR3 flushes the current PCID. */
+		enum intr_level old_level = intr_disable ();
+		lcr3 (rcr3 ());
+		intr_set_level (old_level);
+	}
+	return true;
+}
+
+/* Maps the CNT user pages starting at UPAGE in PML4 to the frames at
+ * kernel virtual addresses KPAGES[0] through KPAGES[CNT - 1], making
+ * them read/write if WRITABLE is true and read-only otherwise.  A null
+ * element leaves its page alone.  None of the pages to map may be
+ * mapped already.  Returns true if successful, false if memory
+ * allocation failed or a page was already mapped, in which case
+ * nothing is mapped. */
+bool
+pml4_set_range (uint64_t *pml4, void *upage, void *const kpages[],
+		size_t cnt, bool rw) {
+	uint64_t start = (uint64_t) upage;
+	uint64_t end = start + cnt * PGSIZE;
+	uint64_t va, span_end;
+	size_t i, j;
+
+	ASSERT (pg_ofs (upage) == 0);
+	ASSERT (start <= end && end <= KERN_BASE);
+	ASSERT (pml4 != base_pml4);
+
+	/* Walk to each page table once, check that the pages in its span
+	 * are free, and fill in their entries.  If a page turns out to be
+	 * mapped, or a page table cannot be allocated, the spans already
+	 * filled are cleared again. */
+	for (va = start, i = 0; va < end; va = span_end) {
+		uint64_t *pde = pml4e_walk_pde (pml4, va, true);
+		uint64_t *pt;
+		size_t n;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		span_end = (va | HPGMASK) + 1 < end ? (va | HPGMASK) + 1 : end;
+		n = (span_end - va) / PGSIZE;
+		if (pde == NULL || (*pde & PTE_PS))
+			goto fail;
+		if (!(*pde & PTE_P)) {
+			pt = pt_alloc ();
+			if (pt == NULL)
+				goto fail;
+			*pde = vtop (pt) | PTE_U | PTE_W | PTE_P;
+		}
+		pt = ptov (PTE_ADDR (*pde));
+
+		for (j = 0; j < n; j++)
+			if (kpages[i + j] != NULL && (pt[PTX (va) + j] & PTE_P))
+				goto fail;
+		for (j = 0; j < n; j++)
+			if (kpages[i + j] != NULL) {
+				ASSERT (pg_ofs (kpages[i + j]) == 0);
+				pt[PTX (va) + j] = vtop (kpages[i + j]) | PTE_P
+					| (rw ? PTE_W : 0) | PTE_U;
+			}
+		i += n;
 	}
+	return true;
+
+fail:
+	for (j = 0; j < i; j++)
+		if (kpages[j] != NULL)
+			pml4_clear_page (pml4, (uint8_t *) upage + j * PGSIZE);
+	return false;
+}
+
+static bool
+clear_pte (uint64_t *pte, uint64_t va UNUSED, void *aux UNUSED) {
+	/* A cleared 2 MB entry must not keep PTE_PS, or the 4 kB pages
+	 * mapped there later would find it instead of a page table. */
+	if (*pte & PTE_PS)
+		*pte = 0;
+	else
+		*pte &= ~(uint64_t) PTE_P;
+	return true;
+}
+
+/* Marks the user pages in [START, END) of PML4 "not present", like
+ * pml4_clear_page() on each of them, preserving the other bits of
+ * their page table entries.  A 2 MB page entirely inside the range is
+ * removed, entry and all.  Pages in the range need not be mapped.
+ * Returns false, changing nothing, if no memory is left to split a
+ * 2 MB page that straddles either end. */
+bool
+pml4_clear_range (uint64_t *pml4, void *start, void *end) {
+	return pml4_range_apply (pml4, (uint64_t) start, (uint64_t) end,
+			clear_pte, NULL);
+}
+
+static bool
+protect_pte (uint64_t *pte, uint64_t va UNUSED, void *writable_) {
+	uint64_t old = *pte;
+
+	if (*(bool *) writable_)
+		*pte |= PTE_W;
+	else
+		*pte &= ~(uint64_t) PTE_W;
+	return *pte != old;
+}
+
+/* Sets the writable bit to WRITABLE in the page table entries of the
+ * mapped user pages in [START, END) of PML4.  Returns false, changing
+ * nothing, if no memory is left to split a 2 MB page that straddles
+ * either end. */
+bool
+pml4_protect_range (uint64_t *pml4, void *start, void *end, bool writable) {
+	return pml4_range_apply (pml4, (uint64_t) start, (uint64_t) end,
+			protect_pte, &writable);
 }
@@ -8,9 +8,16 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/loader.h"
+#include "threads/memtrack.h"
+#include "threads/pte.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "threads/vmalloc.h"
+#ifdef VM
+#include "vm/vm.h"
+#endif
 
 /* Page allocator.  Hands out memory in page-size (or
    page-multiple) chunks.  See malloc.h for an allocator that
@@ -24,13 +31,22 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   When a multi-page request fails only because no run of free
+   pages is long enough, the pool is compacted: pages in use that
+   are reached only through page tables are moved out of the way
+   to assemble a free run.  Those are frames backing user pages
+   in the user pool (see vm/frame.c) and pages mapped by vmalloc()
+   in the kernel pool.  Everything else is immovable. */
 
 /* A memory pool. */
 struct pool {
 	struct lock lock;               /* Mutual exclusion. */
 	struct bitmap *used_map;        /* Bitmap of free pages. */
 	uint8_t *base;                  /* Base of pool. */
+	size_t free_cnt;                /* Number of free pages. */
+	struct memtrack_tag *tags;      /* Per-page tags, if tracking. */
 };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -38,10 +54,25 @@ static struct pool kernel_pool, user_pool;
 
 /* Maximum number of pages to put in user pool. */
 size_t user_page_limit = SIZE_MAX;
+
+/* Scratch map of the kernel pool pages that vmalloc() can move. */
+static struct bitmap *kernel_movable;
+
+/* Compaction statistics. */
+static long long compact_cnt;       /* # of compaction passes. */
+static long long compact_moved;     /* # of pages moved. */
+static size_t run_before, run_after; /* Longest free run, last pass. */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end);
 
 static bool page_from_pool (const struct pool *, void *page);
+static void init_movable_map (void **bm_base);
+#ifdef VM
+static void init_memmap (void **mm_base);
+#endif
+static void *get_pages (enum palloc_flags, size_t page_cnt,
+		const void *caller);
+static size_t compact_pool (struct pool *, size_t page_cnt);
 
 /* multiboot info */
 struct multiboot_info {
@@ -160,6 +191,7 @@ populate_pools (struct area *base_mem, struct area *ext_mem) {
 					// generate kernel pool
 					init_pool (&kernel_pool,
 							&free_start, region_start, start + rem * PGSIZE);
+					init_movable_map (&free_start);
 					// Transition to the next state
 					if (rem == size_in_pg) {
 						rem = user_pages;
@@ -189,6 +221,9 @@ populate_pools (struct area *base_mem, struct area *ext_mem) {
 
 	// generate the user pool
 	init_pool(&user_pool, &free_start, region_start, end);
+#ifdef VM
+	init_memmap (&free_start);
+#endif
 
 	// Iterate over the e820_entry. Setup the usable.
 	uint64_t usable_bound = (uint64_t) free_start;
@@ -224,11 +259,13 @@ split:
 			if ((uint64_t) pool_end < end) {
 				page_cnt = ((uint64_t) pool_end - start) / PGSIZE;
 				bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+				pool->free_cnt += page_cnt;
 				start = (uint64_t) pool_end;
 				goto split;
 			} else {
 				page_cnt = ((uint64_t) end - start) / PGSIZE;
 				bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+				pool->free_cnt += page_cnt;
 			}
 		}
 	}
@@ -253,6 +290,24 @@ palloc_init (void) {
 	return ext_mem.end;
 }
 
+/* Adds DELTA to the free page count of POOL.  Pages are freed
+   from contexts that cannot take the pool lock, so this disables
+   interrupts instead. */
+static void
+adjust_free_cnt (struct pool *pool, long delta) {
+	enum intr_level old_level = intr_disable ();
+	pool->free_cnt += delta;
+	intr_set_level (old_level);
+}
+
+/* Returns the number of free pages in the pool selected by FLAGS.
+   The count may be stale by the time the caller looks at it. */
+size_t
+palloc_free_cnt (enum palloc_flags flags) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	return pool->free_cnt;
+}
+
 /* Obtains and returns a group of PAGE_CNT contiguous free pages.
    If PAL_USER is set, the pages are obtained from the user pool,
    otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
@@ -261,6 +316,59 @@ palloc_init (void) {
    FLAGS, in which case the kernel panics. */
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
+	return get_pages (flags, page_cnt, __builtin_return_address (0));
+}
+
+/* Obtains a single free page and returns its kernel virtual
+   address.
+   If PAL_USER is set, the page is obtained from the user pool,
+   otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
+   then the page is filled with zeros.  If no pages are
+   available, returns a null pointer, unless PAL_ASSERT is set in
+   FLAGS, in which case the kernel panics. */
+void *
+palloc_get_page (enum palloc_flags flags) {
+	return get_pages (flags, 1, __builtin_return_address (0));
+}
+
+/* Obtains HPG_PAGES contiguous free pages whose physical address
+   is a multiple of HPGSIZE, so that they can be mapped with a
+   single huge page, and returns the kernel virtual address of the
+   first.  FLAGS is as for palloc_get_multiple().  Unlike that
+   function, never compacts the pool: a huge page is only worth
+   having if it comes cheap. */
+void *
+palloc_get_huge (enum palloc_flags flags) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	size_t page_cnt = bitmap_size (pool->used_map);
+	size_t page_idx = (HPGSIZE - vtop (pool->base) % HPGSIZE) % HPGSIZE / PGSIZE;
+	void *pages = NULL;
+
+	lock_acquire (&pool->lock);
+	for (; page_idx + HPG_PAGES <= page_cnt; page_idx += HPG_PAGES)
+		if (bitmap_none (pool->used_map, page_idx, HPG_PAGES)) {
+			bitmap_set_multiple (pool->used_map, page_idx, HPG_PAGES, true);
+			pages = pool->base + PGSIZE * page_idx;
+			break;
+		}
+	lock_release (&pool->lock);
+
+	if (pages) {
+		adjust_free_cnt (pool, -(long) HPG_PAGES);
+		if (pool->tags != NULL)
+			memtrack_alloc (&pool->tags[page_idx], MT_PALLOC,
+					__builtin_return_address (0), HPGSIZE);
+		if (flags & PAL_ZERO)
+			memset (pages, 0, HPGSIZE);
+	} else if (flags & PAL_ASSERT)
+		PANIC ("palloc_get_huge: out of pages");
+	return pages;
+}
+
+/* Allocates PAGE_CNT contiguous pages as palloc_get_multiple()
+   does, attributing them to CALLER if tracking is enabled. */
+static void *
+get_pages (enum palloc_flags flags, size_t page_cnt, const void *caller) {
 	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
 
 	lock_acquire (&pool->lock);
@@ -268,12 +376,19 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 	lock_release (&pool->lock);
 	void *pages;
 
+	if (page_idx == BITMAP_ERROR && page_cnt > 1)
+		page_idx = compact_pool (pool, page_cnt);
+
 	if (page_idx != BITMAP_ERROR)
 		pages = pool->base + PGSIZE * page_idx;
 	else
 		pages = NULL;
 
 	if (pages) {
+		adjust_free_cnt (pool, -(long) page_cnt);
+		if (pool->tags != NULL)
+			memtrack_alloc (&pool->tags[page_idx], MT_PALLOC, caller,
+					PGSIZE * page_cnt);
 		if (flags & PAL_ZERO)
 			memset (pages, 0, PGSIZE * page_cnt);
 	} else {
@@ -284,18 +399,6 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 	return pages;
 }
 
-/* Obtains a single free page and returns its kernel virtual
-   address.
-   If PAL_USER is set, the page is obtained from the user pool,
-   otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
-   then the page is filled with zeros.  If no pages are
-   available, returns a null pointer, unless PAL_ASSERT is set in
-   FLAGS, in which case the kernel panics. */
-void *
-palloc_get_page (enum palloc_flags flags) {
-	return palloc_get_multiple (flags, 1);
-}
-
 /* Frees the PAGE_CNT pages starting at PAGES. */
 void
 palloc_free_multiple (void *pages, size_t page_cnt) {
@@ -314,12 +417,15 @@ palloc_free_multiple (void *pages, size_t page_cnt) {
 		NOT_REACHED ();
 
 	page_idx = pg_no (pages) - pg_no (pool->base);
+	if (pool->tags != NULL)
+		memtrack_free (&pool->tags[page_idx]);
 
 #ifndef NDEBUG
 	memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
 	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
 	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	adjust_free_cnt (pool, page_cnt);
 }
 
 /* Frees the page at PAGE. */
@@ -328,6 +434,186 @@ palloc_free_page (void *page) {
 	palloc_free_multiple (page, 1);
 }
 
+/* Moves pages of the pool selected by FLAGS so that PAGE_CNT
+   contiguous pages become free, if possible.  Returns true if
+   such a run was assembled.  Multi-page allocations compact on
+   their own when they fail; this is for doing it ahead of time.
+   The caller must not hold the frame table lock. */
+bool
+palloc_compact (enum palloc_flags flags, size_t page_cnt) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	size_t page_idx = compact_pool (pool, page_cnt);
+
+	if (page_idx == BITMAP_ERROR)
+		return false;
+	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	return true;
+}
+
+/* Prints page allocator statistics. */
+void
+palloc_print_stats (void) {
+	printf ("Palloc: %lld compactions, %lld pages moved, "
+			"longest free run %zu -> %zu pages in last pass\n",
+			compact_cnt, compact_moved, run_before, run_after);
+}
+
+/* Freezes the movable pages of POOL for a compaction pass. */
+static void
+mobility_begin (struct pool *pool) {
+	if (pool == &kernel_pool) {
+		bitmap_set_all (kernel_movable, false);
+		vmalloc_compact_begin (kernel_movable, pool->base);
+	}
+#ifdef VM
+	else
+		lock_acquire (&frame_lock);
+#endif
+}
+
+/* Ends a compaction pass over POOL. */
+static void
+mobility_end (struct pool *pool) {
+	if (pool == &kernel_pool)
+		vmalloc_compact_end ();
+#ifdef VM
+	else
+		lock_release (&frame_lock);
+#endif
+}
+
+/* Returns true if the in-use page IDX of POOL can be moved. */
+static bool
+page_movable (struct pool *pool, size_t idx) {
+	if (pool == &kernel_pool)
+		return bitmap_test (kernel_movable, idx);
+#ifdef VM
+	return frame_movable (&memmap[idx]);
+#else
+	return false;
+#endif
+}
+
+/* Moves page FROM of POOL to the free page TO. */
+static bool
+move_page (struct pool *pool, size_t from, size_t to) {
+	bool success = false;
+
+	if (pool == &kernel_pool)
+		success = vmalloc_move_page (pool->base + from * PGSIZE,
+				pool->base + to * PGSIZE);
+#ifdef VM
+	else
+		success = frame_migrate (&memmap[from], &memmap[to]);
+#endif
+	if (success && pool->tags != NULL) {
+		pool->tags[to] = pool->tags[from];
+		pool->tags[from].live = 0;
+	}
+	return success;
+}
+
+/* Returns the length of the longest run of free pages in POOL. */
+static size_t
+longest_free_run (const struct pool *pool) {
+	size_t cnt = bitmap_size (pool->used_map);
+	size_t longest = 0, run = 0;
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		run = bitmap_test (pool->used_map, i) ? 0 : run + 1;
+		if (run > longest)
+			longest = run;
+	}
+	return longest;
+}
+
+/* Returns the start of the run of PAGE_CNT pages in POOL that can
+   be freed by moving the fewest pages, or BITMAP_ERROR if no run
+   can be freed at all. */
+static size_t
+find_window (struct pool *pool, size_t page_cnt) {
+	size_t cnt = bitmap_size (pool->used_map);
+	size_t free_cnt = bitmap_count (pool->used_map, 0, cnt, false);
+	size_t best = BITMAP_ERROR, best_used = SIZE_MAX;
+	size_t start = 0, used = 0;
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		if (bitmap_test (pool->used_map, i)) {
+			if (!page_movable (pool, i)) {
+				start = i + 1;
+				used = 0;
+				continue;
+			}
+			used++;
+		}
+		if (i + 1 - start > page_cnt) {
+			if (bitmap_test (pool->used_map, start))
+				used--;
+			start++;
+		}
+		/* The pages we move need somewhere to go outside the run. */
+		if (i + 1 - start == page_cnt && used < best_used
+				&& free_cnt - (page_cnt - used) >= used) {
+			best = start;
+			best_used = used;
+		}
+	}
+	return best;
+}
+
+/* Tries to assemble PAGE_CNT contiguous free pages in POOL by
+   moving movable pages out of the way.  On success, returns the
+   index of the first page, with the run already marked in use
+   for the caller.  Otherwise, returns BITMAP_ERROR. */
+static size_t
+compact_pool (struct pool *pool, size_t page_cnt) {
+	size_t end, start, i;
+
+	mobility_begin (pool);
+	lock_acquire (&pool->lock);
+	run_before = longest_free_run (pool);
+	start = find_window (pool, page_cnt);
+	if (start != BITMAP_ERROR) {
+		end = start + page_cnt;
+		for (i = start; i < end; i++) {
+			size_t dst;
+
+			if (!bitmap_test (pool->used_map, i))
+				continue;
+
+			/* Pick a free page outside the run. */
+			dst = bitmap_scan (pool->used_map, 0, 1, false);
+			if (dst != BITMAP_ERROR && dst >= start && dst < end)
+				dst = bitmap_scan (pool->used_map, end, 1, false);
+			if (dst == BITMAP_ERROR)
+				break;
+
+			bitmap_mark (pool->used_map, dst);
+			if (!move_page (pool, i, dst)) {
+				bitmap_reset (pool->used_map, dst);
+				break;
+			}
+			bitmap_reset (pool->used_map, i);
+			compact_moved++;
+		}
+
+		if (i == end && bitmap_none (pool->used_map, start, page_cnt))
+			bitmap_set_multiple (pool->used_map, start, page_cnt, true);
+		else
+			start = BITMAP_ERROR;
+	}
+	run_after = longest_free_run (pool);
+	if (start != BITMAP_ERROR && page_cnt > run_after)
+		run_after = page_cnt;
+	compact_cnt++;
+	lock_release (&pool->lock);
+	mobility_end (pool);
+
+	return start;
+}
+
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
@@ -338,6 +624,7 @@ init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
 	size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (pgcnt), PGSIZE) * PGSIZE;
 
 	lock_init(&p->lock);
+	p->free_cnt = 0;
 	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_pages);
 	p->base = (void *) start;
 
@@ -345,8 +632,47 @@ init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
 	bitmap_set_all(p->used_map, true);
 
 	*bm_base += bm_pages;
+
+	// The allocation tracker's tags follow the bitmap.
+	p->tags = NULL;
+	if (memtrack_enabled) {
+		size_t tag_bytes = ROUND_UP (pgcnt * sizeof *p->tags, PGSIZE);
+		p->tags = *bm_base;
+		memset (p->tags, 0, tag_bytes);
+		*bm_base += tag_bytes;
+	}
+}
+
+/* Creates the scratch map of movable kernel pool pages at
+   *BM_BASE, behind the kernel pool's bitmap. */
+static void
+init_movable_map (void **bm_base) {
+	size_t pgcnt = bitmap_size (kernel_pool.used_map);
+	size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (pgcnt), PGSIZE) * PGSIZE;
+
+	kernel_movable = bitmap_create_in_buf (pgcnt, *bm_base, bm_pages);
+	*bm_base += bm_pages;
 }
 
+#ifdef VM
+/* Carves the frame descriptor array for the user pool out of the
+   memory at *MM_BASE, right behind the pools' bitmaps. */
+static void
+init_memmap (void **mm_base) {
+	size_t i;
+
+	memmap_cnt = bitmap_size (user_pool.used_map);
+	memmap = *mm_base;
+	memmap_kva = user_pool.base;
+	for (i = 0; i < memmap_cnt; i++)
+		memmap[i] = (struct frame) {
+			.lru_prev = FRAME_NONE,
+			.lru_next = FRAME_NONE,
+		};
+	*mm_base += ROUND_UP (memmap_cnt * sizeof *memmap, PGSIZE);
+}
+#endif
+
 /* Returns true if PAGE was allocated from POOL,
    false otherwise. */
 static bool
@@ -0,0 +1,204 @@
+#include "threads/vmalloc.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <string.h>
+#include "threads/init.h"
+#include "threads/interrupt.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/pte.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "intrinsic.h"
+
+/* Virtually contiguous kernel allocations.
+
+   palloc_get_multiple() needs physically contiguous pages, which
+   a fragmented kernel pool may not have even when plenty of pages
+   are free.  vmalloc() instead takes pages one at a time from the
+   kernel pool and maps them side by side in a dedicated kernel
+   virtual range, [VMALLOC_START, VMALLOC_END).
+
+   Every allocation is followed by one unmapped guard page.  That
+   catches overruns, and it also lets vfree() find the end of an
+   allocation by walking the page table until the first page
+   that is not present, so no size needs to be stored.
+
+   The page tables for the range hang off the kernel's PML4 slot,
+   which pml4_create() shares with every process, so a mapping
+   made here is visible in all address spaces at once.
+
+   Because the pages are only reached through those mappings, the
+   page allocator's compaction pass may move them; see
+   vmalloc_compact_begin(). */
+
+#define VMALLOC_PAGES ((VMALLOC_END - VMALLOC_START) / PGSIZE)
+
+static struct lock vmalloc_lock;    /* Protects the map and page tables. */
+static struct bitmap *used_map;     /* One bit per page of the range. */
+
+static void unmap_pages (uint8_t *va, size_t page_cnt);
+
+/* Initializes the vmalloc() range.  Must be called after
+   base_pml4 has been set up. */
+void
+vmalloc_init (void) {
+	size_t bm_size = bitmap_buf_size (VMALLOC_PAGES);
+
+	ASSERT (base_pml4 != NULL);
+	ASSERT (bm_size <= PGSIZE);
+
+	lock_init (&vmalloc_lock);
+	used_map = bitmap_create_in_buf (VMALLOC_PAGES,
+			palloc_get_page (PAL_ASSERT), bm_size);
+}
+
+/* Obtains SIZE bytes of virtually contiguous kernel memory,
+   rounded up to whole pages, and returns its page-aligned kernel
+   virtual address.  Returns a null pointer if the range or the
+   kernel pool is exhausted, or before vmalloc_init(). */
+void *
+vmalloc (size_t size) {
+	size_t page_cnt = DIV_ROUND_UP (size, PGSIZE);
+	size_t page_idx, i;
+	uint8_t *va;
+
+	if (used_map == NULL || page_cnt == 0)
+		return NULL;
+
+	lock_acquire (&vmalloc_lock);
+	page_idx = bitmap_scan_and_flip (used_map, 0, page_cnt + 1, false);
+	if (page_idx == BITMAP_ERROR) {
+		lock_release (&vmalloc_lock);
+		return NULL;
+	}
+
+	va = (uint8_t *) VMALLOC_START + page_idx * PGSIZE;
+	for (i = 0; i < page_cnt; i++) {
+		void *kpage = palloc_get_page (0);
+		uint64_t *pte = NULL;
+
+		if (kpage != NULL)
+			pte = pml4e_walk (base_pml4, (uint64_t) (va + i * PGSIZE), 1);
+		if (pte == NULL) {
+			palloc_free_page (kpage);
+			unmap_pages (va, i);
+			bitmap_set_multiple (used_map, page_idx, page_cnt + 1, false);
+			lock_release (&vmalloc_lock);
+			return NULL;
+		}
+		*pte = vtop (kpage) | PTE_P | PTE_W;
+	}
+	lock_release (&vmalloc_lock);
+
+	return va;
+}
+
+/* Frees P, which must have been returned by vmalloc(). */
+void
+vfree (void *p) {
+	uint8_t *va = p;
+	size_t page_cnt = 0;
+
+	if (p == NULL)
+		return;
+	ASSERT (is_vmalloc_vaddr (p));
+	ASSERT (pg_ofs (p) == 0);
+
+	lock_acquire (&vmalloc_lock);
+	for (;;) {
+		uint64_t *pte = pml4e_walk (base_pml4,
+				(uint64_t) (va + page_cnt * PGSIZE), 0);
+		if (pte == NULL || (*pte & PTE_P) == 0)
+			break;
+		page_cnt++;
+	}
+	ASSERT (page_cnt > 0);
+	unmap_pages (va, page_cnt);
+	bitmap_set_multiple (used_map, pg_no (va) - pg_no (VMALLOC_START),
+			page_cnt + 1, false);
+	lock_release (&vmalloc_lock);
+}
+
+/* Unmaps the PAGE_CNT pages starting at VA and returns their
+   frames to the kernel pool.  The page tables themselves are
+   kept for later allocations. */
+static void
+unmap_pages (uint8_t *va, size_t page_cnt) {
+	size_t i;
+
+	ASSERT (lock_held_by_current_thread (&vmalloc_lock));
+
+	for (i = 0; i < page_cnt; i++, va += PGSIZE) {
+		uint64_t *pte = pml4e_walk (base_pml4, (uint64_t) va, 0);
+		void *kpage;
+
+		ASSERT (pte != NULL && (*pte & PTE_P) != 0);
+		kpage = ptov (PTE_ADDR (*pte));
+		*pte = 0;
+		tlb_invalidate_kernel (va);
+		palloc_free_page (kpage);
+	}
+}
+
+/* Starts a compaction pass over the kernel pool, whose first page
+   is BASE.  Sets the bit in MOVABLE for every kernel pool page that
+   backs a vmalloc() mapping, and holds the vmalloc lock until
+   vmalloc_compact_end() so that the mappings stay put. */
+void
+vmalloc_compact_begin (struct bitmap *movable, const void *base) {
+	size_t idx = 0;
+
+	if (used_map == NULL)
+		return;
+
+	lock_acquire (&vmalloc_lock);
+	while ((idx = bitmap_scan (used_map, idx, 1, true)) != BITMAP_ERROR) {
+		uint64_t va = VMALLOC_START + idx++ * PGSIZE;
+		uint64_t *pte = pml4e_walk (base_pml4, va, 0);
+		size_t page_idx;
+
+		if (pte == NULL || (*pte & PTE_P) == 0)
+			continue;
+		page_idx = pg_no (ptov (PTE_ADDR (*pte))) - pg_no (base);
+		if (page_idx < bitmap_size (movable))
+			bitmap_mark (movable, page_idx);
+	}
+}
+
+/* Moves the vmalloc() page at kernel pool page FROM to the free
+   page TO and remaps it.  FROM is left unused but allocated.
+   Returns false if FROM does not back a vmalloc() mapping. */
+bool
+vmalloc_move_page (void *from, void *to) {
+	size_t idx = 0;
+
+	ASSERT (lock_held_by_current_thread (&vmalloc_lock));
+
+	while ((idx = bitmap_scan (used_map, idx, 1, true)) != BITMAP_ERROR) {
+		uint64_t va = VMALLOC_START + idx++ * PGSIZE;
+		uint64_t *pte = pml4e_walk (base_pml4, va, 0);
+
+		if (pte != NULL && (*pte & PTE_P) != 0
+				&& ptov (PTE_ADDR (*pte)) == from) {
+			/* Other threads may touch the page whenever we are
+			   preempted, so copy and remap in one step. */
+			enum intr_level old_level = intr_disable ();
+			memcpy (to, from, PGSIZE);
+			*pte = vtop (to) | (*pte & PTE_FLAGS);
+			tlb_invalidate_kernel ((void *) va);
+			intr_set_level (old_level);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Ends a compaction pass started by vmalloc_compact_begin(). */
+void
+vmalloc_compact_end (void) {
+	if (used_map != NULL)
+		lock_release (&vmalloc_lock);
+}
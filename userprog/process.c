@@ -13,7 +13,9 @@
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
+#include "threads/memtrack.h"
 #include "threads/palloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
 #include "threads/vaddr.h"
@@ -27,10 +29,26 @@ static bool load (const char *file_name, struct intr_frame *if_);
 static void initd (void *f_name);
 static void __do_fork (void *);
 
+/* Passed from process_fork() to __do_fork(). */
+struct fork_args {
+	struct thread *parent;              /* Process being forked. */
+	struct intr_frame if_;              /* Parent's user context. */
+	struct semaphore done;              /* Upped once the child is set up. */
+	bool success;                       /* Did the child set up? */
+};
+
+/* Number of user processes that have started and not yet exited. */
+static int process_cnt;
+
 /* General process initializer for initd and other process. */
 static void
 process_init (void) {
 	struct thread *current = thread_current ();
+	enum intr_level old_level = intr_disable ();
+
+	current->user = true;
+	process_cnt++;
+	intr_set_level (old_level);
 }
 
 /* Starts the first userland program, called "initd", loaded from FILE_NAME.
@@ -43,6 +61,12 @@ process_create_initd (const char *file_name) {
 	char *fn_copy;
 	tid_t tid;
 
+#ifdef VM
+	/* Allocations from here on are reported if still live once every
+	 * user process has exited; see vm_reap_leak_check(). */
+	memtrack_mark ();
+#endif
+
 	/* Make a copy of FILE_NAME.
 	 * Otherwise there's a race between the caller and load(). */
 	fn_copy = palloc_get_page (0);
@@ -72,12 +96,25 @@ initd (void *f_name) {
 }
 
 /* Clones the current process as `name`. Returns the new process's thread id, or
- * TID_ERROR if the thread cannot be created. */
+ * TID_ERROR if the thread cannot be created.  Does not return until the
+ * child has its own copy of the address space, since the copy reads the
+ * parent's. */
 tid_t
-process_fork (const char *name, struct intr_frame *if_ UNUSED) {
+process_fork (const char *name, struct intr_frame *if_) {
+	struct fork_args args;
+	tid_t tid;
+
+	args.parent = thread_current ();
+	args.if_ = *if_;
+	sema_init (&args.done, 0);
+	args.success = false;
+
 	/* Clone current thread to new thread.*/
-	return thread_create (name,
-			PRI_DEFAULT, __do_fork, thread_current ());
+	tid = thread_create (name, PRI_DEFAULT, __do_fork, &args);
+	if (tid == TID_ERROR)
+		return TID_ERROR;
+	sema_down (&args.done);
+	return args.success ? tid : TID_ERROR;
 }
 
 #ifndef VM
@@ -91,22 +128,31 @@ duplicate_pte (uint64_t *pte, void *va, void *aux) {
 	void *newpage;
 	bool writable;
 
-	/* 1. TODO: If the parent_page is kernel page, then return immediately. */
+	/* 1. If the parent_page is kernel page, then return immediately. */
+	if (is_kernel_vaddr (va))
+		return true;
 
 	/* 2. Resolve VA from the parent's page map level 4. */
 	parent_page = pml4_get_page (parent->pml4, va);
 
-	/* 3. TODO: Allocate new PAL_USER page for the child and set result to
-	 *    TODO: NEWPAGE. */
+	/* 3. Allocate new PAL_USER page for the child and set result to
+	 *    NEWPAGE. */
+	newpage = palloc_get_page (PAL_USER);
+	if (newpage == NULL)
+		return false;
 
-	/* 4. TODO: Duplicate parent's page to the new page and
-	 *    TODO: check whether parent's page is writable or not (set WRITABLE
-	 *    TODO: according to the result). */
+	/* 4. Duplicate parent's page to the new page and check whether
+	 *    parent's page is writable or not (set WRITABLE according to the
+	 *    result). */
+	memcpy (newpage, parent_page, PGSIZE);
+	writable = is_writable (pte);
 
 	/* 5. Add new page to child's page table at address VA with WRITABLE
 	 *    permission. */
 	if (!pml4_set_page (current->pml4, va, newpage, writable)) {
-		/* 6. TODO: if fail to insert page, do error handling. */
+		/* 6. if fail to insert page, do error handling. */
+		palloc_free_page (newpage);
+		return false;
 	}
 	return true;
 }
@@ -119,23 +165,28 @@ duplicate_pte (uint64_t *pte, void *va, void *aux) {
 static void
 __do_fork (void *aux) {
 	struct intr_frame if_;
-	struct thread *parent = (struct thread *) aux;
+	struct fork_args *args = aux;
+	struct thread *parent = args->parent;
 	struct thread *current = thread_current ();
-	/* TODO: somehow pass the parent_if. (i.e. process_fork()'s if_) */
-	struct intr_frame *parent_if;
+	struct intr_frame *parent_if = &args->if_;
 	bool succ = true;
 
-	/* 1. Read the cpu context to local stack. */
+	/* 1. Read the cpu context to local stack.  The child sees fork()
+	 *    return 0. */
 	memcpy (&if_, parent_if, sizeof (struct intr_frame));
+	if_.R.rax = 0;
 
-	/* 2. Duplicate PT */
+	/* 2. Duplicate PT.  With VM, the pages are shared copy-on-write
+	 *    rather than copied. */
+#ifdef VM
+	supplemental_page_table_init (&current->spt);
+#endif
 	current->pml4 = pml4_create();
 	if (current->pml4 == NULL)
 		goto error;
 
 	process_activate (current);
 #ifdef VM
-	supplemental_page_table_init (&current->spt);
 	if (!supplemental_page_table_copy (&current->spt, &parent->spt))
 		goto error;
 #else
@@ -151,10 +202,15 @@ __do_fork (void *aux) {
 
 	process_init ();
 
-	/* Finally, switch to the newly created process. */
-	if (succ)
+	/* Finally, switch to the newly created process.  ARGS lives on the
+	 * parent's stack, so it must not be touched once the parent runs. */
+	if (succ) {
+		args->success = true;
+		sema_up (&args->done);
 		do_iret (&if_);
+	}
 error:
+	sema_up (&args->done);
 	thread_exit ();
 }
 
@@ -217,17 +273,24 @@ process_exit (void) {
 	 * TODO: We recommend you to implement process resource cleanup here. */
 
 	process_cleanup ();
+#ifdef VM
+	/* Interrupts stay off from here until thread_exit() schedules, so
+	 * that this thread is gone by the time the reaper checks. */
+	if (curr->user) {
+		intr_disable ();
+		if (--process_cnt == 0)
+			vm_reap_leak_check ();
+	}
+#endif
 }
 
-/* Free the current process's resources. */
+/* Free the current process's resources.  With VM, the address space
+ * is normally handed to the reaper thread to free in the background,
+ * so that the process's exit does not wait for it. */
 static void
 process_cleanup (void) {
 	struct thread *curr = thread_current ();
 
-#ifdef VM
-	supplemental_page_table_kill (&curr->spt);
-#endif
-
 	uint64_t *pml4;
 	/* Destroy the current process's page directory and switch back
 	 * to the kernel-only page directory. */
@@ -242,16 +305,24 @@ process_cleanup (void) {
 		 * that's been freed (and cleared). */
 		curr->pml4 = NULL;
 		pml4_activate (NULL);
-		pml4_destroy (pml4);
 	}
+
+#ifdef VM
+	if (vm_reap_later (&curr->spt, pml4))
+		return;
+	supplemental_page_table_kill (&curr->spt);
+#endif
+	if (pml4 != NULL)
+		pml4_destroy (pml4);
 }
 
 /* Sets up the CPU for running user code in the nest thread.
  * This function is called on every context switch. */
 void
 process_activate (struct thread *next) {
-	/* Activate thread's page tables. */
-	pml4_activate (next->pml4);
+	/* Activate thread's page tables.  A kernel thread keeps the
+	 * current ones. */
+	pml4_switch (next->pml4);
 
 	/* Set thread's kernel stack for use in processing interrupts. */
 	tss_update (next);
@@ -478,6 +549,9 @@ validate_segment (const struct Phdr *phdr, struct file *file) {
 /* load() helpers. */
 static bool install_page (void *upage, void *kpage, bool writable);
 
+/* Pages that load_segment() maps at a time. */
+#define LOAD_BATCH 16
+
 /* Loads a segment starting at offset OFS in FILE at address
  * UPAGE.  In total, READ_BYTES + ZERO_BYTES bytes of virtual
  * memory are initialized, as follows:
@@ -495,6 +569,10 @@ static bool install_page (void *upage, void *kpage, bool writable);
 static bool
 load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		uint32_t read_bytes, uint32_t zero_bytes, bool writable) {
+	void *kpages[LOAD_BATCH];
+	uint8_t *batch = upage;
+	size_t cnt = 0;
+
 	ASSERT ((read_bytes + zero_bytes) % PGSIZE == 0);
 	ASSERT (pg_ofs (upage) == 0);
 	ASSERT (ofs % PGSIZE == 0);
@@ -510,28 +588,34 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		/* Get a page of memory. */
 		uint8_t *kpage = palloc_get_page (PAL_USER);
 		if (kpage == NULL)
-			return false;
+			goto fail;
+		kpages[cnt++] = kpage;
 
 		/* Load this page. */
-		if (file_read (file, kpage, page_read_bytes) != (int) page_read_bytes) {
-			palloc_free_page (kpage);
-			return false;
-		}
+		if (file_read (file, kpage, page_read_bytes) != (int) page_read_bytes)
+			goto fail;
 		memset (kpage + page_read_bytes, 0, page_zero_bytes);
 
-		/* Add the page to the process's address space. */
-		if (!install_page (upage, kpage, writable)) {
-			printf("fail\n");
-			palloc_free_page (kpage);
-			return false;
-		}
-
 		/* Advance. */
 		read_bytes -= page_read_bytes;
 		zero_bytes -= page_zero_bytes;
-		upage += PGSIZE;
+
+		/* Add the pages to the process's address space, a batch at a
+		 * time. */
+		if (cnt == LOAD_BATCH || (read_bytes == 0 && zero_bytes == 0)) {
+			if (!pml4_set_range (thread_current ()->pml4, batch, kpages, cnt,
+						writable))
+				goto fail;
+			batch += cnt * PGSIZE;
+			cnt = 0;
+		}
 	}
 	return true;
+
+fail:
+	while (cnt > 0)
+		palloc_free_page (kpages[--cnt]);
+	return false;
 }
 
 /* Create a minimal stack by mapping a zeroed page at the USER_STACK */
@@ -574,11 +658,12 @@ install_page (void *upage, void *kpage, bool writable) {
  * If you want to implement the function for only project 2, implement it on the
  * upper block. */
 
+/* Loads PAGE, part of the writable segment described by AUX, a file
+ * region, from the executable.  Called on the first page fault at
+ * PAGE's address, or when the fault on a neighbour maps it ahead. */
 static bool
 lazy_load_segment (struct page *page, void *aux) {
-	/* TODO: Load the segment from the file */
-	/* TODO: This called when the first page fault occurs on address VA. */
-	/* TODO: VA is available when calling this function. */
+	return file_region_read (aux, page, frame_kva (page->frame));
 }
 
 /* Loads a segment starting at offset OFS in FILE at address
@@ -591,17 +676,28 @@ lazy_load_segment (struct page *page, void *aux) {
  * - ZERO_BYTES bytes at UPAGE + READ_BYTES must be zeroed.
  *
  * The pages initialized by this function must be writable by the
- * user process if WRITABLE is true, read-only otherwise.
+ * user process if WRITABLE is true, read-only otherwise.  Read-only
+ * segments are file pages, so that processes running the same
+ * executable share their frames and eviction drops them without
+ * writing them anywhere.  Writable segments are anonymous memory
+ * loaded from the file.
  *
  * Return true if successful, false if a memory allocation error
  * or disk read error occurs. */
 static bool
 load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		uint32_t read_bytes, uint32_t zero_bytes, bool writable) {
+	struct file_region *region;
+
 	ASSERT ((read_bytes + zero_bytes) % PGSIZE == 0);
 	ASSERT (pg_ofs (upage) == 0);
 	ASSERT (ofs % PGSIZE == 0);
 
+	/* Every page of the segment loads from the same region. */
+	region = file_region_create (file, ofs, upage, read_bytes, zero_bytes);
+	if (region == NULL)
+		return false;
+
 	while (read_bytes > 0 || zero_bytes > 0) {
 		/* Do calculate how to fill this page.
 		 * We will read PAGE_READ_BYTES bytes from FILE
@@ -609,17 +705,19 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
-		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		void *aux = NULL;
-		if (!vm_alloc_page_with_initializer (VM_ANON, upage,
-					writable, lazy_load_segment, aux))
+		if (!vm_alloc_page_with_initializer (writable ? VM_ANON : VM_FILE,
+					upage, writable, writable ? lazy_load_segment : NULL, region)) {
+			file_region_put (region);
 			return false;
+		}
+		file_region_get (region);
 
 		/* Advance. */
 		read_bytes -= page_read_bytes;
 		zero_bytes -= page_zero_bytes;
 		upage += PGSIZE;
 	}
+	file_region_put (region);
 	return true;
 }
 
@@ -629,11 +727,12 @@ setup_stack (struct intr_frame *if_) {
 	bool success = false;
 	void *stack_bottom = (void *) (((uint8_t *) USER_STACK) - PGSIZE);
 
-	/* TODO: Map the stack on stack_bottom and claim the page immediately.
-	 * TODO: If success, set the rsp accordingly.
-	 * TODO: You should mark the page is stack. */
-	/* TODO: Your code goes here */
-
+	/* Map the stack on stack_bottom and claim the page immediately. */
+	if (vm_alloc_page (VM_ANON | VM_STACK, stack_bottom, true)
+			&& vm_claim_page (stack_bottom)) {
+		if_->rsp = USER_STACK;
+		success = true;
+	}
 	return success;
 }
 #endif /* VM */
@@ -7,6 +7,9 @@
 #include "userprog/gdt.h"
 #include "threads/flags.h"
 #include "intrinsic.h"
+#ifdef VM
+#include "vm/vm.h"
+#endif
 
 void syscall_entry (void);
 void syscall_handler (struct intr_frame *);
@@ -39,7 +42,30 @@ syscall_init (void) {
 
 /* The main system call interface */
 void
-syscall_handler (struct intr_frame *f UNUSED) {
+syscall_handler (struct intr_frame *f) {
+	switch (f->R.rax) {
+#ifdef VM
+		case SYS_MADVISE:
+			f->R.rax = vm_madvise ((void *) f->R.rdi, f->R.rsi, f->R.rdx);
+			return;
+		case SYS_VMSTAT:
+			f->R.rax = vm_get_stats (f->R.rdi, (void *) f->R.rsi);
+			return;
+		case SYS_MLOCK:
+			f->R.rax = vm_mlock ((void *) f->R.rdi, f->R.rsi);
+			return;
+		case SYS_MUNLOCK:
+			f->R.rax = vm_munlock ((void *) f->R.rdi, f->R.rsi);
+			return;
+		case SYS_MLOCKALL:
+			f->R.rax = vm_mlockall (f->R.rdi);
+			return;
+		case SYS_MUNLOCKALL:
+			f->R.rax = vm_munlockall ();
+			return;
+#endif
+	}
+
 	// TODO: Your implementation goes here.
 	printf ("system call!\n");
 	thread_exit ();
@@ -1,7 +1,18 @@
 /* anon.c: Implementation of page for non-disk image (a.k.a. anonymous page). */
 
 #include "vm/vm.h"
+#include <bitmap.h>
+#include <lz.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
 #include "devices/disk.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "threads/vmalloc.h"
 
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
@@ -17,11 +28,101 @@ static const struct page_operations anon_ops = {
 	.type = VM_ANON,
 };
 
+/* Swap area.
+ *
+ * The swap disk is divided into page-sized slots, allocated from a
+ * bitmap.  A page keeps its slot after it is swapped back in, so a
+ * page that is evicted again before it is written needs no I/O.
+ *
+ * Swap-out is clustered: SWAP_CLUSTER contiguous slots are reserved
+ * at a time, evicted pages are copied into the cluster buffer, and
+ * the whole cluster is written with one multi-sector command once it
+ * fills.  Until then the buffer also serves swap-ins of its slots.
+ *
+ * Swap-in reads ahead: after a fault brings in a slot, the following
+ * slots that hold pages of the same process are read and mapped too,
+ * while free frames last.  Pages evicted together tend to be used
+ * together.
+ *
+ * In front of the disk sits an in-memory pool of compressed pages
+ * ("zswap").  A dirty page on its way out is compressed first, and if
+ * it shrinks to ZSWAP_MAX_SIZE or less it is kept in the pool instead
+ * of being written, so a later fault costs a decompression rather
+ * than a disk read.  The pool is zswap_pages pages of kernel memory,
+ * carved into ZSWAP_CHUNK-byte chunks; a compressed page takes a run
+ * of contiguous chunks.  When the pool is full, the pages that have
+ * been in it longest are decompressed and written to disk to make
+ * room.  Pages that do not compress well go straight to disk.
+ *
+ * SWAP_LOCK protects the slot bitmap, SLOT_PAGE, the cluster and the
+ * pool. */
+
+#define SECTORS_PER_SLOT (PGSIZE / DISK_SECTOR_SIZE)
+#define SWAP_CLUSTER 8              /* Slots written per burst. */
+#define SWAP_READAHEAD 4            /* Slots read ahead of a fault. */
+#define ZSWAP_CHUNK 64              /* Pool allocation unit, in bytes. */
+#define ZSWAP_MAX_SIZE (PGSIZE * 3 / 4) /* Largest page kept in the pool. */
+
+static struct lock swap_lock;
+static struct bitmap *swap_slots;   /* Allocated slots. */
+static struct page **slot_page;     /* Page in each slot, or NULL. */
+
+static uint8_t *cluster_buf;        /* SWAP_CLUSTER pages. */
+static size_t cluster_base;         /* First slot of the cluster. */
+static size_t cluster_cnt;          /* Pages in the cluster buffer. */
+
+size_t zswap_pages = 64;            /* Pool size, 0 to disable. */
+static uint8_t *zswap_pool;         /* Compressed pages. */
+static struct bitmap *zswap_chunks; /* Allocated chunks of the pool. */
+static struct list zswap_list;      /* Pages in the pool, oldest first. */
+static uint8_t *zswap_buf;          /* Compressor output, one page. */
+static uint8_t *zswap_tmp;          /* Decompressor output, one page. */
+static void *zswap_work;            /* Compressor scratch memory. */
+
+/* Statistics. */
+static long long swap_write_cnt;    /* Pages written. */
+static long long swap_burst_cnt;    /* Multi-page writes. */
+static long long swap_read_cnt;     /* Pages read on faults. */
+static long long readahead_cnt;     /* Pages read ahead of faults. */
+static long long cluster_hit_cnt;   /* Swap-ins served by the buffer. */
+static long long zswap_store_cnt;   /* Pages put in the pool. */
+static long long zswap_reject_cnt;  /* Pages that compressed poorly. */
+static long long zswap_raw_bytes;   /* Bytes put in the pool... */
+static long long zswap_comp_bytes;  /* ...and their compressed size. */
+static long long zswap_hit_cnt;     /* Swap-ins served by the pool. */
+static long long zswap_aged_cnt;    /* Pages moved from pool to disk. */
+static long long zswap_drop_cnt;    /* Pages freed while in the pool. */
+
+static void cluster_flush (void);
+static bool swap_write (struct page *page, const void *data);
+
 /* Initialize the data for anonymous pages */
 void
 vm_anon_init (void) {
-	/* TODO: Set up the swap_disk. */
-	swap_disk = NULL;
+	size_t slot_cnt = 0;
+
+	lock_init (&swap_lock);
+	swap_disk = disk_get (1, 1);
+	if (swap_disk != NULL)
+		slot_cnt = disk_size (swap_disk) / SECTORS_PER_SLOT;
+
+	swap_slots = bitmap_create (slot_cnt);
+	slot_page = calloc (slot_cnt, sizeof *slot_page);
+	cluster_buf = vmalloc (SWAP_CLUSTER * PGSIZE);
+	if (swap_slots == NULL || (slot_cnt > 0 && slot_page == NULL)
+			|| cluster_buf == NULL)
+		PANIC ("cannot allocate swap slot table");
+
+	list_init (&zswap_list);
+	if (zswap_pages > 0) {
+		zswap_pool = vmalloc (zswap_pages * PGSIZE);
+		zswap_chunks = bitmap_create (zswap_pages * PGSIZE / ZSWAP_CHUNK);
+		zswap_buf = vmalloc (2 * PGSIZE + LZ_WORK_SIZE);
+		if (zswap_pool == NULL || zswap_chunks == NULL || zswap_buf == NULL)
+			PANIC ("cannot allocate %zu-page zswap pool", zswap_pages);
+		zswap_tmp = zswap_buf + PGSIZE;
+		zswap_work = zswap_buf + 2 * PGSIZE;
+	}
 }
 
 /* Initialize the file mapping */
@@ -31,22 +132,325 @@ anon_initializer (struct page *page, enum vm_type type, void *kva) {
 	page->operations = &anon_ops;
 
 	struct anon_page *anon_page = &page->anon;
+	anon_page->slot = SLOT_NONE;
+	anon_page->zchunk = ZCHUNK_NONE;
+
+	/* A fresh anonymous page reads as zeros. */
+	memset (kva, 0, PGSIZE);
+	return true;
+}
+
+/* Returns true if PAGE has an up-to-date copy in swap as of its last
+ * swap-in.  Combined with a clear dirty bit, this means PAGE can be
+ * evicted without I/O. */
+bool
+anon_has_swap_copy (const struct page *page) {
+	return page->anon.slot != SLOT_NONE;
+}
+
+/* Returns true if SLOT is in the cluster buffer.  SWAP_LOCK must be
+ * held. */
+static bool
+slot_in_cluster (size_t slot) {
+	return slot >= cluster_base && slot < cluster_base + cluster_cnt;
+}
+
+/* Releases SLOT.  A slot in the cluster buffer keeps its bitmap bit
+ * until the cluster is flushed, so that it cannot be handed out
+ * twice.  SWAP_LOCK must be held. */
+static void
+slot_free (size_t slot) {
+	slot_page[slot] = NULL;
+	if (!slot_in_cluster (slot))
+		bitmap_reset (swap_slots, slot);
+}
+
+/* Reads SLOT from the swap disk into KVA. */
+static void
+slot_read (size_t slot, void *kva) {
+	disk_read_multiple (swap_disk, slot * SECTORS_PER_SLOT,
+			SECTORS_PER_SLOT, kva);
+}
+
+/* Returns the page whose anon_page is on the zswap list at E. */
+static struct page *
+zswap_page (struct list_elem *e) {
+	return list_entry (e, struct page, anon.zelem);
+}
+
+/* Releases PAGE's chunks in the pool.  SWAP_LOCK must be held. */
+static void
+zswap_free (struct page *page) {
+	struct anon_page *anon_page = &page->anon;
+
+	ASSERT (anon_page->zchunk != ZCHUNK_NONE);
+
+	bitmap_set_multiple (zswap_chunks, anon_page->zchunk,
+			DIV_ROUND_UP (anon_page->zsize, ZSWAP_CHUNK), false);
+	list_remove (&anon_page->zelem);
+	anon_page->zchunk = ZCHUNK_NONE;
+}
+
+/* Decompresses PAGE from the pool into KVA.  SWAP_LOCK must be
+ * held. */
+static void
+zswap_load (struct page *page, void *kva) {
+	struct anon_page *anon_page = &page->anon;
+
+	if (!lz_decompress (zswap_pool + anon_page->zchunk * ZSWAP_CHUNK,
+				anon_page->zsize, kva, PGSIZE))
+		PANIC ("zswap: page %p does not decompress", page->va);
+}
+
+/* Makes room in the pool by writing the page that has been there
+ * longest to the swap disk.  Returns false if the pool is empty or
+ * the disk is full.  SWAP_LOCK must be held. */
+static bool
+zswap_age (void) {
+	struct page *page;
+
+	if (list_empty (&zswap_list))
+		return false;
+
+	page = zswap_page (list_front (&zswap_list));
+	zswap_load (page, zswap_tmp);
+	if (!swap_write (page, zswap_tmp))
+		return false;
+	zswap_free (page);
+	zswap_aged_cnt++;
+	return true;
+}
+
+/* Tries to keep PAGE, which is being evicted, in the pool instead of
+ * writing it to disk.  Returns false if the pool is disabled, the
+ * page does not compress well, or no room can be made.  SWAP_LOCK
+ * must be held. */
+static bool
+zswap_store (struct page *page) {
+	struct anon_page *anon_page = &page->anon;
+	size_t size, chunk_cnt, chunk;
+
+	if (zswap_pool == NULL)
+		return false;
+
+	size = lz_compress (frame_kva (page->frame), PGSIZE, zswap_buf,
+			ZSWAP_MAX_SIZE, zswap_work);
+	if (size == 0) {
+		zswap_reject_cnt++;
+		return false;
+	}
+
+	chunk_cnt = DIV_ROUND_UP (size, ZSWAP_CHUNK);
+	while ((chunk = bitmap_scan_and_flip (zswap_chunks, 0, chunk_cnt, false))
+			== BITMAP_ERROR)
+		if (!zswap_age ())
+			return false;
+
+	memcpy (zswap_pool + chunk * ZSWAP_CHUNK, zswap_buf, size);
+	anon_page->zchunk = chunk;
+	anon_page->zsize = size;
+	list_push_back (&zswap_list, &anon_page->zelem);
+	zswap_store_cnt++;
+	zswap_raw_bytes += PGSIZE;
+	zswap_comp_bytes += size;
+	return true;
+}
+
+/* Reads the slots after SLOT that hold non-resident pages of the
+ * process that owns PAGE into free frames and maps them. */
+static void
+swap_readahead (struct page *page, size_t slot) {
+	size_t last = slot + SWAP_READAHEAD;
+	size_t i;
+
+	if (last >= bitmap_size (swap_slots))
+		last = bitmap_size (swap_slots) - 1;
+
+	for (i = slot + 1; i <= last; i++) {
+		struct page *next;
+		void *kva;
+
+		lock_acquire (&swap_lock);
+		next = slot_page[i];
+		if (next == NULL || next->spt != page->spt || next->frame != NULL
+				|| slot_in_cluster (i)) {
+			lock_release (&swap_lock);
+			break;
+		}
+		lock_release (&swap_lock);
+
+		/* Never dip into the reclaim reserve for a guess. */
+		if (vm_frames_low ())
+			break;
+		kva = palloc_get_page (PAL_USER);
+		if (kva == NULL)
+			break;
+		slot_read (i, kva);
+		if (!vm_install_page (next, kva_to_frame (kva))) {
+			palloc_free_page (kva);
+			break;
+		}
+		vm_stat_inc (next->spt, swap_read_cnt);
+		readahead_cnt++;
+	}
 }
 
 /* Swap in the page by read contents from the swap disk. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
 	struct anon_page *anon_page = &page->anon;
+	size_t slot;
+
+	lock_acquire (&swap_lock);
+	if (anon_page->zchunk != ZCHUNK_NONE) {
+		zswap_load (page, kva);
+		zswap_free (page);
+		zswap_hit_cnt++;
+		lock_release (&swap_lock);
+		return true;
+	}
+
+	/* The pool may have moved the page to disk, so look at the slot
+	 * only now. */
+	slot = anon_page->slot;
+	ASSERT (slot != SLOT_NONE);
+	if (slot_in_cluster (slot)) {
+		memcpy (kva, cluster_buf + (slot - cluster_base) * PGSIZE, PGSIZE);
+		cluster_hit_cnt++;
+		lock_release (&swap_lock);
+		return true;
+	}
+	lock_release (&swap_lock);
+
+	slot_read (slot, kva);
+	vm_stat_inc (page->spt, swap_read_cnt);
+	swap_read_cnt++;
+	swap_readahead (page, slot);
+	return true;
 }
 
-/* Swap out the page by writing contents to the swap disk. */
+/* Swap out the page by writing contents to the swap disk.  The page
+ * has already been unmapped by the caller. */
 static bool
 anon_swap_out (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
+	bool success;
+
+	/* The copy in swap is still good. */
+	if (anon_page->slot != SLOT_NONE
+			&& !pml4_is_dirty (page->pml4, page->va))
+		return true;
+
+	lock_acquire (&swap_lock);
+	if (anon_page->slot != SLOT_NONE) {
+		slot_free (anon_page->slot);
+		anon_page->slot = SLOT_NONE;
+	}
+	success = zswap_store (page) || swap_write (page, frame_kva (page->frame));
+	lock_release (&swap_lock);
+	return success;
+}
+
+/* Writes DATA, the contents of PAGE, to a fresh swap slot by way of
+ * the cluster buffer.  Returns false if swap is full.  SWAP_LOCK must
+ * be held. */
+static bool
+swap_write (struct page *page, const void *data) {
+	size_t slot;
+
+	ASSERT (lock_held_by_current_thread (&swap_lock));
+
+	if (cluster_cnt == 0) {
+		cluster_base = bitmap_scan_and_flip (swap_slots, 0, SWAP_CLUSTER, false);
+		if (cluster_base == BITMAP_ERROR) {
+			/* Too fragmented for a cluster: write this page alone. */
+			cluster_base = 0;
+			slot = bitmap_scan_and_flip (swap_slots, 0, 1, false);
+			if (slot == BITMAP_ERROR)
+				return false;
+			slot_page[slot] = page;
+			page->anon.slot = slot;
+			disk_write_multiple (swap_disk, slot * SECTORS_PER_SLOT,
+					SECTORS_PER_SLOT, data);
+			vm_stat_inc (page->spt, swap_write_cnt);
+			swap_write_cnt++;
+			return true;
+		}
+	}
+
+	slot = cluster_base + cluster_cnt;
+	memcpy (cluster_buf + cluster_cnt * PGSIZE, data, PGSIZE);
+	cluster_cnt++;
+	slot_page[slot] = page;
+	page->anon.slot = slot;
+	if (cluster_cnt == SWAP_CLUSTER)
+		cluster_flush ();
+	return true;
+}
+
+/* Writes the cluster buffer to its slots in one burst and empties
+ * it.  Slots freed while in the buffer are released now.  SWAP_LOCK
+ * must be held. */
+static void
+cluster_flush (void) {
+	size_t i;
+
+	ASSERT (lock_held_by_current_thread (&swap_lock));
+
+	disk_write_multiple (swap_disk, cluster_base * SECTORS_PER_SLOT,
+			cluster_cnt * SECTORS_PER_SLOT, cluster_buf);
+	swap_burst_cnt++;
+	for (i = 0; i < cluster_cnt; i++) {
+		struct page *page = slot_page[cluster_base + i];
+
+		if (page != NULL) {
+			vm_stat_inc (page->spt, swap_write_cnt);
+			swap_write_cnt++;
+		} else
+			bitmap_reset (swap_slots, cluster_base + i);
+	}
+	cluster_cnt = 0;
 }
 
 /* Destroy the anonymous page. PAGE will be freed by the caller. */
 static void
 anon_destroy (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
+
+	vm_unmap_page (page);
+	lock_acquire (&swap_lock);
+	if (anon_page->zchunk != ZCHUNK_NONE) {
+		zswap_free (page);
+		zswap_drop_cnt++;
+	}
+	if (anon_page->slot != SLOT_NONE) {
+		slot_free (anon_page->slot);
+		anon_page->slot = SLOT_NONE;
+	}
+	lock_release (&swap_lock);
+}
+
+/* Prints swap statistics. */
+void
+anon_print_stats (void) {
+	if (swap_disk != NULL)
+		printf ("Swap: %lld pages written in %lld bursts, %lld read, "
+				"%lld read ahead, %lld from cluster buffer\n",
+				swap_write_cnt, swap_burst_cnt, swap_read_cnt, readahead_cnt,
+				cluster_hit_cnt);
+
+	if (zswap_pool != NULL) {
+		long long ratio = zswap_comp_bytes > 0
+			? zswap_raw_bytes * 100 / zswap_comp_bytes : 0;
+		long long fault_cnt = zswap_hit_cnt + cluster_hit_cnt + swap_read_cnt;
+
+		/* A page that left the pool other than by aging was never
+		 * written to disk. */
+		printf ("Zswap: %lld pages stored, %lld rejected, "
+				"compression %lld.%02lld:1, %lld hits (%lld%% of swap-ins), "
+				"%lld aged to disk, %lld disk writes avoided\n",
+				zswap_store_cnt, zswap_reject_cnt, ratio / 100, ratio % 100,
+				zswap_hit_cnt, fault_cnt > 0 ? zswap_hit_cnt * 100 / fault_cnt : 0,
+				zswap_aged_cnt, zswap_hit_cnt + zswap_drop_cnt);
+	}
 }
@@ -1,6 +1,15 @@
 /* file.c: Implementation of memory backed file object (mmaped object). */
 
 #include "vm/vm.h"
+#include <hash.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "threads/vmalloc.h"
 
 static bool file_backed_swap_in (struct page *page, void *kva);
 static bool file_backed_swap_out (struct page *page);
@@ -14,45 +23,584 @@ static const struct page_operations file_ops = {
 	.type = VM_FILE,
 };
 
+/* Protects the reference counts of file regions, which forked
+ * processes share. */
+static struct lock region_lock;
+
+/* Write-back of mapped files.
+ *
+ * Only pages whose dirty bit is set are written.  Runs of them at
+ * consecutive offsets of one region are staged in WB_BUF and go out in
+ * a single write, rather than one write per page.  Each page's dirty
+ * bit is cleared as it is staged, under FRAME_LOCK, so that it is not
+ * written again until it is modified again, and set again if the
+ * write fails.  FRAME_LOCK is released for the write itself; WB_LOCK,
+ * taken before it, protects WB_BUF meanwhile.  Pages whose frame is
+ * being evicted are left to the evictor, which writes them out
+ * itself. */
+
+#define WB_MAX 16               /* Most pages in one write. */
+
+/* A run of dirty pages being staged for write-back. */
+struct write_back {
+	struct file_region *region; /* Region of the pages. */
+	uint8_t *next;              /* Address of a page that extends the run,
+	                               or null if none does. */
+	size_t bytes;               /* Bytes staged in WB_BUF. */
+	size_t page_cnt;            /* Number of pages staged. */
+	struct page *pages[WB_MAX]; /* Pages staged. */
+	bool success;               /* False after a write failed. */
+};
+
+static uint8_t *wb_buf;
+static struct lock wb_lock;
+
+/* Write-back statistics. */
+static long long wb_page_cnt;   /* Pages written. */
+static long long wb_write_cnt;  /* Writes issued. */
+static long long wb_clean_cnt;  /* Resident pages skipped as clean. */
+
+/* Shared text.
+ *
+ * Read-only pages of a file, the text and read-only data of every copy
+ * of a program in particular, are the same in every process that maps
+ * them.  The text cache maps each such page, identified by its file's
+ * inode, its offset and the number of bytes that come from the file,
+ * to a frame that holds it, so that a fault on the same page in
+ * another process maps that frame instead of reading the page again.
+ * The pages mapping a frame are its references, in its sharer chain;
+ * the frame is evicted like any other, which takes every sharer with
+ * it.
+ *
+ * Nothing is removed from the cache when a frame is evicted or freed.
+ * Instead, an entry is checked against the first page mapping its
+ * frame before use, and dropped if the frame has moved on.  The cache
+ * is emptied whenever it has more entries than there are frames, which
+ * only happens if most of them are stale.  FRAME_LOCK protects it. */
+
+/* A text cache entry. */
+struct text_entry {
+	struct hash_elem elem;
+	struct inode *inode;        /* File. */
+	off_t ofs;                  /* Offset of the page in the file. */
+	size_t bytes;               /* Bytes from the file; the rest is zero. */
+	struct frame *frame;        /* Frame that held the page. */
+};
+
+static struct hash text_cache;
+
+/* Text cache statistics. */
+static long long text_load_cnt;     /* Pages entered when loaded. */
+static long long text_share_cnt;    /* Faults that shared a frame. */
+
+static hash_hash_func text_hash;
+static hash_less_func text_less;
+
 /* The initializer of file vm */
 void
 vm_file_init (void) {
+	lock_init (&region_lock);
+	lock_init (&wb_lock);
+	wb_buf = vmalloc (WB_MAX * PGSIZE);
+	if (wb_buf == NULL)
+		PANIC ("cannot allocate write-back buffer");
+	hash_init (&text_cache, text_hash, text_less, NULL);
+}
+
+/* Creates a region of READ_BYTES + ZERO_BYTES bytes of memory at
+ * START, a multiple of PGSIZE in all, whose first READ_BYTES come
+ * from FILE starting at offset OFS and whose rest is zero.  The region
+ * reopens FILE, so the caller may close it.  The caller holds the one
+ * reference to the new region.  Returns a null pointer if memory runs
+ * out. */
+struct file_region *
+file_region_create (struct file *file, off_t ofs, void *start,
+		size_t read_bytes, size_t zero_bytes) {
+	struct file_region *region;
+
+	ASSERT ((read_bytes + zero_bytes) % PGSIZE == 0);
+	ASSERT (pg_ofs (start) == 0);
+
+	region = malloc (sizeof *region);
+	if (region == NULL)
+		return NULL;
+	region->file = file_reopen (file);
+	if (region->file == NULL) {
+		free (region);
+		return NULL;
+	}
+	region->ofs = ofs;
+	region->start = start;
+	region->page_cnt = (read_bytes + zero_bytes) / PGSIZE;
+	region->read_bytes = read_bytes;
+	region->refcnt = 1;
+	region->next_fault = start;
+	region->ahead_start = start;
+	region->ahead_cnt = 0;
+	region->window = 2;
+	region->advice = VM_ADV_NORMAL;
+	return region;
+}
+
+/* Takes a reference to REGION and returns it. */
+struct file_region *
+file_region_get (struct file_region *region) {
+	lock_acquire (&region_lock);
+	ASSERT (region->refcnt > 0);
+	region->refcnt++;
+	lock_release (&region_lock);
+	return region;
+}
+
+/* Drops a reference to REGION, freeing it with the last one. */
+void
+file_region_put (struct file_region *region) {
+	bool last;
+
+	lock_acquire (&region_lock);
+	ASSERT (region->refcnt > 0);
+	last = --region->refcnt == 0;
+	lock_release (&region_lock);
+
+	if (last) {
+		file_close (region->file);
+		free (region);
+	}
+}
+
+/* Returns the number of bytes of the page at VA in REGION that come
+ * from the file. */
+static size_t
+region_page_bytes (const struct file_region *region, const void *va) {
+	size_t page_ofs = (const uint8_t *) va - region->start;
+
+	ASSERT (page_ofs < region->page_cnt * PGSIZE);
+	if (page_ofs >= region->read_bytes)
+		return 0;
+	return region->read_bytes - page_ofs < PGSIZE
+		? region->read_bytes - page_ofs : PGSIZE;
+}
+
+/* Reads PAGE, which lies in REGION, into KVA, zeroing what does not
+ * come from the file.  Returns false on a short read. */
+bool
+file_region_read (struct file_region *region, struct page *page,
+		void *kva) {
+	size_t page_ofs = (uint8_t *) page->va - region->start;
+	size_t read_bytes = region_page_bytes (region, page->va);
+
+	if (read_bytes > 0)
+		vm_stat_inc (page->spt, file_read_cnt);
+	if (file_read_at (region->file, kva, read_bytes, region->ofs + page_ofs)
+			!= (off_t) read_bytes)
+		return false;
+	memset ((uint8_t *) kva + read_bytes, 0, PGSIZE - read_bytes);
+	return true;
+}
+
+/* Returns true if no byte of the page at user address VA in REGION
+ * comes from the file, so that the page reads as all zeros. */
+bool
+file_region_is_zero (struct file_region *region, void *va) {
+	return region_page_bytes (region, va) == 0;
+}
+
+/* Returns the region that PAGE's contents come from, or a null pointer
+ * if they do not come from a file region.  A pending page with an AUX
+ * has a region as its AUX. */
+struct file_region *
+page_file_region (struct page *page) {
+	switch (VM_TYPE (page->operations->type)) {
+		case VM_UNINIT:
+			return page->uninit.aux;
+		case VM_FILE:
+			return page->file.region;
+		default:
+			return NULL;
+	}
+}
+
+/* Returns the hash of text cache entry E. */
+static uint64_t
+text_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct text_entry *t = hash_entry (e, struct text_entry, elem);
+	return hash_bytes (&t->inode, sizeof t->inode) ^ hash_int (t->ofs)
+		^ hash_int (t->bytes);
+}
+
+/* Returns true if text cache entry A is less than B. */
+static bool
+text_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct text_entry *a = hash_entry (a_, struct text_entry, elem);
+	const struct text_entry *b = hash_entry (b_, struct text_entry, elem);
+
+	if (a->inode != b->inode)
+		return a->inode < b->inode;
+	if (a->ofs != b->ofs)
+		return a->ofs < b->ofs;
+	return a->bytes < b->bytes;
+}
+
+/* Fills in KEY for PAGE and returns true if PAGE is a read-only page of
+ * a file region, which may go in the text cache.  Returns false
+ * otherwise. */
+static bool
+text_key (struct page *page, struct text_entry *key) {
+	struct file_region *region = page_file_region (page);
+
+	if (page->writable || region == NULL || page_get_type (page) != VM_FILE)
+		return false;
+	key->inode = file_get_inode (region->file);
+	key->ofs = region->ofs + ((uint8_t *) page->va - region->start);
+	key->bytes = region_page_bytes (region, page->va);
+	return true;
+}
+
+/* Returns true if FRAME is loaded and holds the page that KEY
+ * identifies.  The caller must hold FRAME_LOCK. */
+static bool
+text_frame_matches (struct frame *frame, const struct text_entry *key) {
+	struct text_entry cur;
+
+	return (frame->flags & FRAME_LRU) && frame->page != NULL
+		&& text_key (frame->page, &cur) && cur.inode == key->inode
+		&& cur.ofs == key->ofs && cur.bytes == key->bytes;
+}
+
+/* Frees text cache entry E. */
+static void
+text_free (struct hash_elem *e, void *aux UNUSED) {
+	free (hash_entry (e, struct text_entry, elem));
+}
+
+/* Enters FRAME, which PAGE has just been loaded into, in the text
+ * cache if PAGE is a read-only page of a file.  The caller must hold
+ * FRAME_LOCK. */
+void
+file_cache_frame (struct page *page, struct frame *frame) {
+	struct text_entry key, *e;
+	struct hash_elem *elem;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	if (!text_key (page, &key))
+		return;
+	elem = hash_find (&text_cache, &key.elem);
+	if (elem != NULL) {
+		e = hash_entry (elem, struct text_entry, elem);
+		if (!text_frame_matches (e->frame, e))
+			e->frame = frame;
+		return;
+	}
+
+	if (hash_size (&text_cache) >= memmap_cnt)
+		hash_clear (&text_cache, text_free);
+	e = malloc (sizeof *e);
+	if (e == NULL)
+		return;
+	*e = key;
+	e->frame = frame;
+	hash_insert (&text_cache, &e->elem);
+	text_load_cnt++;
+}
+
+/* Maps PAGE, a read-only page of a file that has no frame, to a frame
+ * in the text cache that already holds the same page, if there is one.
+ * Returns true if successful. */
+bool
+file_share_frame (struct page *page) {
+	struct text_entry key, *e;
+	struct hash_elem *elem;
+	struct frame *frame;
+
+	if (!text_key (page, &key))
+		return false;
+
+	lock_acquire (&frame_lock);
+	elem = hash_find (&text_cache, &key.elem);
+	if (elem == NULL) {
+		lock_release (&frame_lock);
+		return false;
+	}
+	e = hash_entry (elem, struct text_entry, elem);
+	frame = e->frame;
+	if (!text_frame_matches (frame, e)) {
+		hash_delete (&text_cache, elem);
+		free (e);
+		lock_release (&frame_lock);
+		return false;
+	}
+	if (!pml4_set_page (page->pml4, page->va, frame_kva (frame), false)) {
+		lock_release (&frame_lock);
+		return false;
+	}
+
+	/* A pending page becomes a file page without loading anything,
+	 * keeping the reference to its region that its AUX held. */
+	if (VM_TYPE (page->operations->type) == VM_UNINIT) {
+		struct file_region *region = page->uninit.aux;
+
+		page->operations = &file_ops;
+		page->file.region = region;
+	}
+	frame_add_page (frame, page);
+	text_share_cnt++;
+	lock_release (&frame_lock);
+	return true;
 }
 
 /* Initialize the file backed page */
 bool
 file_backed_initializer (struct page *page, enum vm_type type, void *kva) {
+	/* The region is still in the uninit part of the union. */
+	struct file_region *region = page->uninit.aux;
+
 	/* Set up the handler */
 	page->operations = &file_ops;
 
 	struct file_page *file_page = &page->file;
+	file_page->region = file_region_get (region);
+	return file_region_read (region, page, kva);
 }
 
 /* Swap in the page by read contents from the file. */
 static bool
 file_backed_swap_in (struct page *page, void *kva) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_page *file_page = &page->file;
+	return file_region_read (file_page->region, page, kva);
+}
+
+/* Starts an empty run in WB. */
+static void
+wb_init (struct write_back *wb) {
+	wb->region = NULL;
+	wb->next = NULL;
+	wb->bytes = 0;
+	wb->page_cnt = 0;
+	wb->success = true;
+}
+
+/* Writes the run staged in WB, if any, to its file, then starts an
+ * empty run.  If the write fails, the pages that still have a frame
+ * are marked dirty again.  FRAME_LOCK is released during the write. */
+static void
+wb_flush (struct write_back *wb) {
+	struct file_region *region = wb->region;
+	off_t ofs;
+	bool ok;
+	size_t i;
+
+	ASSERT (lock_held_by_current_thread (&wb_lock));
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	if (wb->page_cnt == 0)
+		return;
+	ofs = region->ofs + ((uint8_t *) wb->pages[0]->va - region->start);
+	lock_release (&frame_lock);
+	ok = file_write_at (region->file, wb_buf, wb->bytes, ofs)
+		== (off_t) wb->bytes;
+	lock_acquire (&frame_lock);
+	if (ok)
+		wb_page_cnt += wb->page_cnt;
+	else {
+		for (i = 0; i < wb->page_cnt; i++)
+			if (wb->pages[i]->frame != NULL)
+				pml4_set_dirty (wb->pages[i]->pml4, wb->pages[i]->va, true);
+		wb->success = false;
+	}
+	wb_write_cnt++;
+
+	wb->region = NULL;
+	wb->next = NULL;
+	wb->bytes = 0;
+	wb->page_cnt = 0;
+}
+
+/* Stages PAGE, a page of a mapped file that has a frame, in WB if it
+ * has been modified, writing out the run staged so far first if PAGE
+ * does not extend it. */
+static void
+wb_add (struct write_back *wb, struct page *page) {
+	struct file_region *region = page->file.region;
+	size_t bytes = region_page_bytes (region, page->va);
+
+	ASSERT (page->frame != NULL);
+
+	if (!pml4_is_dirty (page->pml4, page->va)) {
+		wb_clean_cnt++;
+		return;
+	}
+	/* Nothing past the end of the file is written. */
+	if (bytes == 0)
+		return;
+
+	if (wb->page_cnt > 0 && (region != wb->region
+				|| (uint8_t *) page->va != wb->next
+				|| wb->page_cnt == WB_MAX)) {
+		wb_flush (wb);
+		/* PAGE may have been evicted during the write. */
+		if (page->frame == NULL || (page->frame->flags & FRAME_EVICTING))
+			return;
+	}
+	wb->region = region;
+	pml4_set_dirty (page->pml4, page->va, false);
+	memcpy (wb_buf + wb->bytes, frame_kva (page->frame), bytes);
+	wb->bytes += bytes;
+	wb->pages[wb->page_cnt++] = page;
+	wb->next = bytes == PGSIZE ? (uint8_t *) page->va + PGSIZE : NULL;
 }
 
-/* Swap out the page by writeback contents to the file. */
+/* Stages PAGE in the run that AUX, a struct write_back, points to if
+ * it is a page of a mapped file that has a frame not being evicted. */
+static void
+wb_add_page (struct page *page, void *aux) {
+	if (VM_TYPE (page->operations->type) == VM_FILE && page->frame != NULL
+			&& !(page->frame->flags & FRAME_EVICTING))
+		wb_add (aux, page);
+}
+
+/* Writes back the modified pages of mapped files in [START, END) of
+ * SPT, which must belong to the current process. */
+void
+file_write_back (struct supplemental_page_table *spt, void *start,
+		void *end) {
+	struct write_back wb;
+
+	wb_init (&wb);
+	lock_acquire (&wb_lock);
+	lock_acquire (&frame_lock);
+	spt_for_each (spt, start, end, wb_add_page, &wb);
+	wb_flush (&wb);
+	lock_release (&frame_lock);
+	lock_release (&wb_lock);
+}
+
+/* Swap out the page by writeback contents to the file.
+ *
+ * If PAGE belongs to the current process, the modified pages that
+ * follow it in its region go out in the same write, which saves them
+ * a write of their own when they are evicted in turn.  The tables of
+ * other processes may change under us, so their neighbouring pages
+ * are left alone.  PAGE's frame is being evicted. */
 static bool
 file_backed_swap_out (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_region *region = page->file.region;
+	struct write_back wb;
+
+	wb_init (&wb);
+	lock_acquire (&wb_lock);
+	lock_acquire (&frame_lock);
+	wb_add (&wb, page);
+	if (page->spt == &thread_current ()->spt) {
+		uint8_t *end = region->start + region->page_cnt * PGSIZE;
+		uint8_t *va = page->va;
+
+		if ((size_t) (end - va) > WB_MAX * PGSIZE)
+			end = va + WB_MAX * PGSIZE;
+		spt_for_each (page->spt, va + PGSIZE, end, wb_add_page, &wb);
+	}
+	wb_flush (&wb);
+	lock_release (&frame_lock);
+	lock_release (&wb_lock);
+	return wb.success;
 }
 
 /* Destory the file backed page. PAGE will be freed by the caller. */
 static void
 file_backed_destroy (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_page *file_page = &page->file;
+
+	if (page->frame != NULL) {
+		struct write_back wb;
+
+		wb_init (&wb);
+		lock_acquire (&wb_lock);
+		lock_acquire (&frame_lock);
+		wb_add_page (page, &wb);
+		wb_flush (&wb);
+		lock_release (&frame_lock);
+		lock_release (&wb_lock);
+	}
+	vm_unmap_page (page);
+	file_region_put (file_page->region);
+}
+
+/* Prints file-backed memory statistics. */
+void
+file_print_stats (void) {
+	printf ("Write-back: %lld pages in %lld writes, %lld clean pages "
+			"skipped\n", wb_page_cnt, wb_write_cnt, wb_clean_cnt);
+	printf ("Text: %lld read-only pages cached when loaded, "
+			"%lld faults mapped a cached frame\n",
+			text_load_cnt, text_share_cnt);
 }
 
 /* Do the mmap */
 void *
 do_mmap (void *addr, size_t length, int writable,
 		struct file *file, off_t offset) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct file_region *region;
+	size_t page_cnt = DIV_ROUND_UP (length, PGSIZE);
+	size_t read_bytes = 0;
+	off_t file_len;
+	size_t i;
+
+	if (addr == NULL || pg_ofs (addr) != 0 || length == 0
+			|| offset < 0 || offset % PGSIZE != 0
+			|| (uint8_t *) addr + page_cnt * PGSIZE < (uint8_t *) addr
+			|| !is_user_vaddr (addr)
+			|| !is_user_vaddr ((uint8_t *) addr + page_cnt * PGSIZE - 1))
+		return NULL;
+
+	file_len = file_length (file);
+	if (file_len == 0)
+		return NULL;
+	if (offset < file_len)
+		read_bytes = (size_t) (file_len - offset) < length
+			? (size_t) (file_len - offset) : length;
+
+	for (i = 0; i < page_cnt; i++)
+		if (spt_find_page (spt, (uint8_t *) addr + i * PGSIZE) != NULL)
+			return NULL;
+
+	region = file_region_create (file, offset, addr, read_bytes,
+			page_cnt * PGSIZE - read_bytes);
+	if (region == NULL)
+		return NULL;
+	for (i = 0; i < page_cnt; i++) {
+		if (!vm_alloc_page_with_initializer (VM_FILE,
+					(uint8_t *) addr + i * PGSIZE, writable, NULL, region)) {
+			spt_remove_range (spt, addr, (uint8_t *) addr + i * PGSIZE);
+			file_region_put (region);
+			return NULL;
+		}
+		file_region_get (region);
+	}
+	file_region_put (region);
+	return addr;
 }
 
 /* Do the munmap */
 void
 do_munmap (void *addr) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct page *page = spt_find_page (spt, addr);
+	struct file_region *region;
+	uint8_t *start, *end;
+
+	if (page == NULL || page_get_type (page) != VM_FILE)
+		return;
+	region = page_file_region (page);
+	if (region->start != addr)
+		return;
+
+	/* Write back in as few writes as possible before the pages go.
+	 * Removing the last page frees the region. */
+	start = region->start;
+	end = start + region->page_cnt * PGSIZE;
+	file_write_back (spt, start, end);
+	if (pml4_clear_range (thread_current ()->pml4, start, end))
+		spt_remove_range (spt, start, end);
 }
@@ -0,0 +1,359 @@
+/* frame.c: Physical frame descriptors (memmap) and the frame table. */
+
+#include "vm/frame.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/interrupt.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+
+/* Every page of the user pool has a struct frame in memmap[], so the
+ * descriptor of a physical page is found by arithmetic alone, and the
+ * page(s) mapping it can be reached from there (reverse mapping).
+ *
+ * Frames that back user pages are additionally linked into the frame
+ * table, a circular list threaded through memmap by index.  The
+ * eviction policy walks this ring.  FRAME_LOCK protects the ring, the
+ * frame flags and the sharer chains. */
+
+struct frame *memmap;
+size_t memmap_cnt;
+uint8_t *memmap_kva;
+
+struct lock frame_lock;
+
+/* Signalled, with FRAME_LOCK, whenever an eviction finishes. */
+static struct condition evict_cond;
+
+/* Index of the first frame on the frame table, or FRAME_NONE. */
+static uint32_t lru_head = FRAME_NONE;
+
+/* Number of frames on the frame table. */
+static size_t lru_cnt;
+
+/* Page frame number of memmap[0]. */
+static uint64_t base_pfn;
+
+static inline uint32_t
+frame_idx (const struct frame *frame) {
+	return frame - memmap;
+}
+
+/* Initializes the frame table.  memmap has already been filled in by
+ * palloc_init(). */
+void
+frame_init (void) {
+	lock_init (&frame_lock);
+	cond_init (&evict_cond);
+	if (memmap_cnt > 0)
+		base_pfn = pg_no (vtop (memmap_kva));
+
+	ASSERT (sizeof (struct frame) < 32);
+	printf ("memmap: %zu frames, %zu bytes each, %zu kB total\n",
+			memmap_cnt, sizeof (struct frame),
+			memmap_cnt * sizeof (struct frame) / 1024);
+}
+
+/* Returns the descriptor of physical page PFN, or a null pointer if
+ * PFN is not in the user pool. */
+struct frame *
+pfn_to_frame (uint64_t pfn) {
+	if (pfn < base_pfn || pfn - base_pfn >= memmap_cnt)
+		return NULL;
+	return &memmap[pfn - base_pfn];
+}
+
+/* Returns the page frame number of FRAME. */
+uint64_t
+frame_to_pfn (const struct frame *frame) {
+	return base_pfn + frame_idx (frame);
+}
+
+/* Returns the descriptor of the user pool page at kernel virtual
+ * address KVA, or a null pointer if KVA is not in the user pool. */
+struct frame *
+kva_to_frame (const void *kva) {
+	return pfn_to_frame (pg_no (vtop (kva)));
+}
+
+/* Returns the kernel virtual address of FRAME's page. */
+void *
+frame_kva (const struct frame *frame) {
+	return memmap_kva + (size_t) frame_idx (frame) * PGSIZE;
+}
+
+/* Appends FRAME to the frame table, just behind the clock hand's
+ * starting point.  The caller must hold FRAME_LOCK. */
+void
+frame_table_insert (struct frame *frame) {
+	uint32_t idx = frame_idx (frame);
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	ASSERT (!(frame->flags & FRAME_LRU));
+
+	if (lru_head == FRAME_NONE) {
+		frame->lru_prev = frame->lru_next = idx;
+		lru_head = idx;
+	} else {
+		struct frame *head = &memmap[lru_head];
+		struct frame *tail = &memmap[head->lru_prev];
+
+		frame->lru_prev = head->lru_prev;
+		frame->lru_next = lru_head;
+		tail->lru_next = idx;
+		head->lru_prev = idx;
+	}
+	frame->flags |= FRAME_LRU;
+	lru_cnt++;
+}
+
+/* Removes FRAME from the frame table.  The caller must hold
+ * FRAME_LOCK. */
+void
+frame_table_remove (struct frame *frame) {
+	uint32_t idx = frame_idx (frame);
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	ASSERT (frame->flags & FRAME_LRU);
+
+	if (frame->lru_next == idx)
+		lru_head = FRAME_NONE;
+	else {
+		memmap[frame->lru_prev].lru_next = frame->lru_next;
+		memmap[frame->lru_next].lru_prev = frame->lru_prev;
+		if (lru_head == idx)
+			lru_head = frame->lru_next;
+	}
+	frame->lru_prev = frame->lru_next = FRAME_NONE;
+	frame->flags &= ~(FRAME_LRU | FRAME_MERGED);
+	lru_cnt--;
+}
+
+/* Returns the frame after FRAME on the frame table, wrapping around at
+ * the end, or the first frame if FRAME is null.  Returns a null pointer
+ * if the table is empty.  The caller must hold FRAME_LOCK. */
+struct frame *
+frame_table_next (struct frame *frame) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	if (lru_head == FRAME_NONE)
+		return NULL;
+	if (frame == NULL || !(frame->flags & FRAME_LRU))
+		return &memmap[lru_head];
+	return &memmap[frame->lru_next];
+}
+
+/* Returns the number of frames on the frame table.  The caller must
+ * hold FRAME_LOCK. */
+size_t
+frame_table_size (void) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	return lru_cnt;
+}
+
+/* Accessed and dirty bits.
+ *
+ * A user frame is mapped by the PTE of every page in its sharer chain
+ * and also by the kernel's direct map.  Only the user mappings are
+ * consulted.  The kernel touches user frames through their kernel
+ * addresses only to fill them on swap-in and to copy them out on
+ * swap-out, which says nothing about how the process uses the page;
+ * system calls reach user memory through the user addresses, so the
+ * user PTEs see those accesses.  The direct map may also use 2 MB
+ * pages, whose bits are shared by 512 frames and so are useless here
+ * anyway. */
+
+/* Returns true if any page mapping FRAME has been accessed since its
+ * accessed bit was last cleared.  The caller must hold FRAME_LOCK. */
+bool
+frame_is_accessed (const struct frame *frame) {
+	struct page *page;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	for (page = frame->page; page != NULL; page = page->frame_next)
+		if (pml4_is_accessed (page->pml4, page->va))
+			return true;
+	return false;
+}
+
+/* Clears the accessed bit of every page mapping FRAME.  The caller
+ * must hold FRAME_LOCK. */
+void
+frame_clear_accessed (struct frame *frame) {
+	struct page *page;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	for (page = frame->page; page != NULL; page = page->frame_next)
+		pml4_set_accessed (page->pml4, page->va, false);
+}
+
+/* Returns true if any page mapping FRAME has been written since its
+ * dirty bit was last cleared.  The caller must hold FRAME_LOCK. */
+bool
+frame_is_dirty (const struct frame *frame) {
+	struct page *page;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	for (page = frame->page; page != NULL; page = page->frame_next)
+		if (pml4_is_dirty (page->pml4, page->va))
+			return true;
+	return false;
+}
+
+/* Returns true if FRAME backs user pages and may be moved to another
+ * frame by frame_migrate().  The caller must hold FRAME_LOCK. */
+bool
+frame_movable (const struct frame *frame) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	return (frame->flags & (FRAME_LRU | FRAME_PINNED)) == FRAME_LRU
+		&& frame->page != NULL;
+}
+
+/* Moves the contents of FROM, a movable frame, to TO, an unused frame,
+ * and repoints every page mapping FROM, in both the page tables and
+ * the supplemental page tables, at TO.  TO takes FROM's place on the
+ * frame table.  FROM is left unused but still allocated from the user
+ * pool.  Returns false, moving nothing, if a page mapping FROM lies in
+ * a 2 MB page that there is no memory to split.  The caller must hold
+ * FRAME_LOCK. */
+bool
+frame_migrate (struct frame *from, struct frame *to) {
+	enum intr_level old_level;
+	struct page *page;
+
+	ASSERT (frame_movable (from));
+	ASSERT (to->page == NULL && to->flags == 0);
+
+	/* Splitting a 2 MB page allocates a page table, which may sleep,
+	 * so it is done first.  Then remapping needs no memory. */
+	for (page = from->page; page != NULL; page = page->frame_next)
+		if (!pml4_split_page (page->pml4, page->va))
+			return false;
+
+	/* The owning processes may run whenever we are preempted, so copy
+	 * and remap in one step. */
+	old_level = intr_disable ();
+	memcpy (frame_kva (to), frame_kva (from), PGSIZE);
+	for (page = from->page; page != NULL; page = page->frame_next)
+		if (!pml4_move_page (page->pml4, page->va, frame_kva (to)))
+			NOT_REACHED ();
+	for (page = from->page; page != NULL; page = page->frame_next)
+		page->frame = to;
+	to->page = from->page;
+	to->refcnt = from->refcnt;
+	to->flags = from->flags;
+
+	/* Take FROM's place on the frame table. */
+	if (from->lru_next == frame_idx (from))
+		to->lru_prev = to->lru_next = frame_idx (to);
+	else {
+		to->lru_prev = from->lru_prev;
+		to->lru_next = from->lru_next;
+		memmap[to->lru_prev].lru_next = frame_idx (to);
+		memmap[to->lru_next].lru_prev = frame_idx (to);
+	}
+	if (lru_head == frame_idx (from))
+		lru_head = frame_idx (to);
+
+	from->page = NULL;
+	from->refcnt = 0;
+	from->flags = 0;
+	from->lru_prev = from->lru_next = FRAME_NONE;
+	intr_set_level (old_level);
+	return true;
+}
+
+/* Records that PAGE maps FRAME.  A frame mapped by a locked page is
+ * pinned.  The caller must hold FRAME_LOCK. */
+void
+frame_add_page (struct frame *frame, struct page *page) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	page->frame = frame;
+	page->frame_next = frame->page;
+	frame->page = page;
+	frame->refcnt++;
+	if (page->locked)
+		frame->flags |= FRAME_PINNED;
+}
+
+/* Records that PAGE no longer maps FRAME.  The caller must hold
+ * FRAME_LOCK. */
+void
+frame_remove_page (struct frame *frame, struct page *page) {
+	struct page **p;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	ASSERT (frame->refcnt > 0);
+
+	for (p = &frame->page; *p != page; p = &(*p)->frame_next)
+		ASSERT (*p != NULL);
+	*p = page->frame_next;
+	page->frame_next = NULL;
+	page->frame = NULL;
+	frame->refcnt--;
+	if (page->locked)
+		frame_update_pinned (frame);
+}
+
+/* Pins FRAME if any page mapping it is locked in memory and unpins it
+ * otherwise.  The caller must hold FRAME_LOCK. */
+void
+frame_update_pinned (struct frame *frame) {
+	struct page *page;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	frame->flags &= ~FRAME_PINNED;
+	for (page = frame->page; page != NULL; page = page->frame_next)
+		if (page->locked) {
+			frame->flags |= FRAME_PINNED;
+			break;
+		}
+}
+
+/* Waits until PAGE's frame, if any, is not being evicted.  The caller
+ * must hold FRAME_LOCK, which is released while waiting: on return,
+ * PAGE has no frame if the eviction succeeded, and is mapped again if
+ * it failed. */
+void
+frame_wait_evict (struct page *page) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	while (page->frame != NULL && (page->frame->flags & FRAME_EVICTING))
+		cond_wait (&evict_cond, &frame_lock);
+}
+
+/* Ends the eviction of FRAME and wakes the threads waiting for it.
+ * The caller must hold FRAME_LOCK. */
+void
+frame_evict_done (struct frame *frame) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	ASSERT (frame->flags & FRAME_EVICTING);
+
+	frame->flags &= ~FRAME_EVICTING;
+	cond_broadcast (&evict_cond, &frame_lock);
+}
+
+/* Takes FRAME, which no page maps any more, off the frame table and
+ * returns it to the user pool. */
+void
+frame_free (struct frame *frame) {
+	ASSERT (frame->page == NULL && frame->refcnt == 0);
+
+	lock_acquire (&frame_lock);
+	if (frame->flags & FRAME_LRU)
+		frame_table_remove (frame);
+	frame->flags = 0;
+	lock_release (&frame_lock);
+	palloc_free_page (frame_kva (frame));
+}
@@ -0,0 +1,264 @@
+/* merge.c: Same-page merging of anonymous frames. */
+
+#include "vm/merge.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "threads/vmalloc.h"
+#include "vm/vm.h"
+
+/* A daemon walks the frame table looking for anonymous frames with
+ * the same contents, such as zero-filled heaps or the data pages of
+ * many copies of one program, and merges each set of them into one
+ * frame that all their pages map read-only.  A write to any of them
+ * faults, and vm_handle_wp() gives the writer a private copy again,
+ * just as after a fork.
+ *
+ * The daemon hashes each frame as it passes and keeps the hash in
+ * merge_checksum[], indexed like memmap, rather than in struct frame,
+ * which would grow for a feature that is off by default.  A frame
+ * whose hash changed since the last pass is being written and is left
+ * alone.  The hash stays with the slot when frame_migrate() moves a
+ * frame, which at worst puts off merging it by a pass.
+ * One whose hash held is looked up in a table of the steady frames
+ * seen so far this pass and merged into an entry with the same bytes,
+ * or else entered itself.  The table is only a hint: its frames may
+ * have been written, evicted or reused since they were entered, so an
+ * entry is checked again, and compared byte by byte, before it is
+ * used.
+ *
+ * The daemon holds FRAME_LOCK for MERGE_BATCH frames at a time and
+ * sleeps merge_interval milliseconds between batches.  It only runs if
+ * the interval is set on the kernel command line. */
+
+#define MERGE_BATCH 32          /* Frames examined per batch. */
+#define MERGE_MAX_SHARE 256     /* Most pages mapping a merged frame. */
+
+unsigned merge_interval;
+
+/* An entry of the table of steady frames. */
+struct merge_entry {
+	uint32_t frame;             /* memmap index; FRAME_NONE if empty. */
+	uint32_t hash;              /* Contents hash when entered. */
+};
+
+static uint32_t *merge_checksum;    /* Hash of each frame, last pass. */
+static struct merge_entry *merge_table;
+static size_t merge_table_cnt;  /* Number of entries, a power of 2. */
+static size_t merge_used;       /* Number of entries in use. */
+
+static struct frame *merge_cursor;   /* Next frame to examine. */
+static size_t merge_seen;            /* Frames examined this pass. */
+
+/* Statistics. */
+static long long pass_cnt;           /* Passes over the frame table. */
+static long long scan_cnt;           /* Frames hashed. */
+static long long merge_page_cnt;     /* Pages moved to another frame. */
+static long long merge_frame_cnt;    /* Frames freed by merging. */
+
+static void merge_daemon (void *aux);
+
+/* Starts the merging daemon if an interval was given. */
+void
+merge_init (void) {
+	if (merge_interval == 0)
+		return;
+
+	for (merge_table_cnt = 1; merge_table_cnt < 2 * memmap_cnt;
+			merge_table_cnt *= 2)
+		continue;
+	merge_checksum = vmalloc (memmap_cnt * sizeof *merge_checksum);
+	merge_table = vmalloc (merge_table_cnt * sizeof *merge_table);
+	if (merge_checksum == NULL || merge_table == NULL)
+		PANIC ("cannot allocate same-page merging table");
+	memset (merge_checksum, 0, memmap_cnt * sizeof *merge_checksum);
+	memset (merge_table, 0xff, merge_table_cnt * sizeof *merge_table);
+
+	if (thread_create ("merged", PRI_MIN, merge_daemon, NULL) == TID_ERROR)
+		PANIC ("cannot start same-page merging daemon");
+}
+
+/* Returns true if FRAME is on the frame table, not pinned, and mapped
+ * by anonymous pages only.  The caller must hold FRAME_LOCK. */
+bool
+merge_candidate (struct frame *frame) {
+	struct page *page;
+
+	if ((frame->flags & (FRAME_LRU | FRAME_PINNED)) != FRAME_LRU
+			|| frame->page == NULL)
+		return false;
+	for (page = frame->page; page != NULL; page = page->frame_next)
+		if (page_get_type (page) != VM_ANON)
+			return false;
+	return true;
+}
+
+/* Maps every page of FRAME read-only if PROTECT, or else restores the
+ * write access of a page that is alone on FRAME.  Returns false if a
+ * page lies in a 2 MB page that there is no memory to split; the pages
+ * after it are left alone.  The caller must hold FRAME_LOCK. */
+static bool
+merge_protect (struct frame *frame, bool protect) {
+	struct page *page;
+
+	for (page = frame->page; page != NULL; page = page->frame_next)
+		if (!pml4_set_writable (page->pml4, page->va,
+					!protect && page->writable && frame->refcnt == 1))
+			return false;
+	return true;
+}
+
+/* Moves the pages of FRAME onto STABLE and frees FRAME, if the two
+ * hold the same bytes.  Returns true if successful.  The caller must
+ * hold FRAME_LOCK. */
+static bool
+merge_try (struct frame *stable, struct frame *frame) {
+	struct page *page;
+
+	if (stable->refcnt + frame->refcnt > MERGE_MAX_SHARE)
+		return false;
+
+	/* Write-protect both first, so that neither changes between the
+	 * comparison and the merge: a write now faults and waits for
+	 * FRAME_LOCK.  A page that restoring write access cannot split was
+	 * never write-protected, so a failure there leaves it as it was. */
+	if (!merge_protect (stable, true) || !merge_protect (frame, true)
+			|| memcmp (frame_kva (stable), frame_kva (frame), PGSIZE)) {
+		merge_protect (stable, false);
+		merge_protect (frame, false);
+		return false;
+	}
+
+	/* Write-protecting split any 2 MB pages and the page tables exist,
+	 * so remapping cannot fail.  Dirty bits carry over, since they say
+	 * whether swap has the contents. */
+	frame_table_remove (frame);
+	while ((page = frame->page) != NULL) {
+		bool dirty = pml4_is_dirty (page->pml4, page->va);
+
+		pml4_clear_page (page->pml4, page->va);
+		frame_remove_page (frame, page);
+		pml4_set_page (page->pml4, page->va, frame_kva (stable), false);
+		if (dirty)
+			pml4_set_dirty (page->pml4, page->va, true);
+		frame_add_page (stable, page);
+		merge_page_cnt++;
+	}
+	stable->flags |= FRAME_MERGED;
+	frame->flags = 0;
+	palloc_free_page (frame_kva (frame));
+	merge_frame_cnt++;
+	return true;
+}
+
+/* Examines FRAME, merging it into a steady frame with the same
+ * contents or entering it in the table.  The caller must hold
+ * FRAME_LOCK. */
+static void
+merge_frame (struct frame *frame) {
+	struct merge_entry *e;
+	uint32_t hash;
+	size_t i;
+
+	if (!merge_candidate (frame))
+		return;
+	hash = hash_bytes (frame_kva (frame), PGSIZE);
+	scan_cnt++;
+	if (hash != merge_checksum[frame - memmap]) {
+		merge_checksum[frame - memmap] = hash;
+		return;
+	}
+
+	for (i = hash & (merge_table_cnt - 1); ;
+			i = (i + 1) & (merge_table_cnt - 1)) {
+		struct frame *stable;
+
+		e = &merge_table[i];
+		if (e->frame == FRAME_NONE)
+			break;
+		stable = &memmap[e->frame];
+		if (e->hash == hash && stable != frame
+				&& merge_checksum[e->frame] == hash
+				&& merge_candidate (stable) && merge_try (stable, frame))
+			return;
+	}
+
+	/* Keep the table at most half full, so that probes stay short. */
+	if (merge_used < merge_table_cnt / 2) {
+		e->frame = frame - memmap;
+		e->hash = hash;
+		merge_used++;
+	}
+}
+
+/* Examines the next MERGE_BATCH frames on the frame table, starting a
+ * new pass over it, with an empty table, whenever the last one has
+ * covered every frame. */
+static void
+merge_scan (void) {
+	size_t i;
+
+	lock_acquire (&frame_lock);
+	for (i = 0; i < MERGE_BATCH; i++) {
+		struct frame *frame = merge_cursor;
+
+		/* The cursor's frame may have left the table meanwhile. */
+		if (frame == NULL || !(frame->flags & FRAME_LRU))
+			frame = frame_table_next (NULL);
+		if (frame == NULL)
+			break;
+		merge_cursor = frame_table_next (frame);
+
+		if (merge_seen++ >= frame_table_size ()) {
+			memset (merge_table, 0xff, merge_table_cnt * sizeof *merge_table);
+			merge_used = 0;
+			merge_seen = 0;
+			pass_cnt++;
+		}
+		merge_frame (frame);
+	}
+	lock_release (&frame_lock);
+}
+
+/* The merging daemon's thread function. */
+static void
+merge_daemon (void *aux UNUSED) {
+	for (;;) {
+		timer_msleep (merge_interval);
+		merge_scan ();
+	}
+}
+
+/* Prints same-page merging statistics. */
+void
+merge_print_stats (void) {
+	struct frame *frame;
+	size_t shared_cnt = 0;
+	size_t i;
+
+	if (merge_table == NULL)
+		return;
+
+	/* Pages that still share a merged frame, less one per frame, are
+	 * the memory that merging saves now. */
+	lock_acquire (&frame_lock);
+	frame = frame_table_next (NULL);
+	for (i = frame_table_size (); i > 0; i--) {
+		if (frame->flags & FRAME_MERGED)
+			shared_cnt += frame->refcnt - 1;
+		frame = frame_table_next (frame);
+	}
+	lock_release (&frame_lock);
+
+	printf ("Merge: %lld passes, %lld pages scanned, %lld pages merged, "
+			"%lld frames freed, %zu kB saved now\n",
+			pass_cnt, scan_cnt, merge_page_cnt, merge_frame_cnt,
+			shared_cnt * PGSIZE / 1024);
+}
@@ -1,5 +1,7 @@
 vm_SRC = vm/vm.c          # Main api proxy
 vm_SRC += vm/uninit.c     # Uninitialized page
+vm_SRC += vm/frame.c      # Frame descriptors and frame table
 vm_SRC += vm/anon.c       # Anonymous page
 vm_SRC += vm/file.c       # File mapped page
+vm_SRC += vm/merge.c      # Same-page merging
 vm_SRC += vm/inspect.c    # Testing utility
@@ -51,9 +51,14 @@ uninit_initialize (struct page *page, void *kva) {
 	vm_initializer *init = uninit->init;
 	void *aux = uninit->aux;
 
-	/* TODO: You may need to fix this function. */
-	return uninit->page_initializer (page, uninit->type, kva) &&
+	bool success = uninit->page_initializer (page, uninit->type, kva) &&
 		(init ? init (page, aux) : true);
+
+	/* The page is no longer pending, so its reference to the file
+	 * region in AUX goes.  A file-backed page has taken its own. */
+	if (aux != NULL)
+		file_region_put (aux);
+	return success;
 }
 
 /* Free the resources hold by uninit_page. Although most of pages are transmuted
@@ -62,7 +67,10 @@ uninit_initialize (struct page *page, void *kva) {
  * PAGE will be freed by the caller. */
 static void
 uninit_destroy (struct page *page) {
-	struct uninit_page *uninit UNUSED = &page->uninit;
-	/* TODO: Fill this function.
-	 * TODO: If you don't have anything to do, just return. */
+	struct uninit_page *uninit = &page->uninit;
+
+	/* A pending page may map the zero page. */
+	vm_unmap_page (page);
+	if (uninit->aux != NULL)
+		file_region_put (uninit->aux);
 }
@@ -1,8 +1,38 @@
 /* vm.c: Generic interface for virtual memory objects. */
 
+#include <stdio.h>
+#include <string.h>
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/memtrack.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 #include "vm/vm.h"
 #include "vm/inspect.h"
+#include "vm/merge.h"
+#include "intrinsic.h"
+
+/* The zero page.  A read fault on anonymous memory that has never been
+ * written maps this one page, read-only, instead of a fresh frame of
+ * zeros; the first write fault replaces it with a private frame.  The
+ * page stays pending meanwhile, with ZERO_FRAME as its frame.
+ * ZERO_FRAME is never on the frame table, so nothing evicts or moves
+ * it, and it keeps no sharer chain. */
+static struct frame *zero_frame;
+
+/* Zero page statistics. */
+static long long zero_map_cnt;      /* Read faults that mapped it. */
+static long long zero_upgrade_cnt;  /* Later write faults on it. */
+
+struct vmstat vm_stats;
+
+static void reclaim_init (void);
+static void mlock_init (void);
+static void reaper_init (void);
+static bool reap_one (void);
 
 /* Initializes the virtual memory subsystem by invoking each subsystem's
  * intialize codes. */
@@ -15,7 +45,13 @@ vm_init (void) {
 #endif
 	register_inspect_intr ();
 	/* DO NOT MODIFY UPPER LINES. */
-	/* TODO: Your code goes here. */
+	frame_init ();
+	zero_frame = kva_to_frame (palloc_get_page (PAL_USER | PAL_ASSERT
+				| PAL_ZERO));
+	reaper_init ();
+	reclaim_init ();
+	mlock_init ();
+	merge_init ();
 }
 
 /* Get the type of the page. This function is useful if you want to know the
@@ -32,10 +68,48 @@ page_get_type (struct page *page) {
 	}
 }
 
+/* Paging by program, kept for the statistics printed at power-off.
+ * Processes are merged by name; once the log fills, further programs
+ * are not listed. */
+#define PAGING_LOG_CNT 16
+struct paging_log_entry {
+	char name[16];              /* Program name. */
+	long long minor_cnt;        /* Minor page faults. */
+	long long major_cnt;        /* Major page faults. */
+	long long read_cnt;         /* Pages read from swap. */
+	long long write_cnt;        /* Pages written to swap. */
+};
+static struct paging_log_entry paging_log[PAGING_LOG_CNT];
+
+/* Adds the paging done by the process with statistics ST to the log
+ * entry for NAME. */
+static void
+paging_log_record (const char *name, const struct vmstat *st) {
+	struct paging_log_entry *e;
+
+	if (st->minor_fault_cnt == 0 && st->major_fault_cnt == 0
+			&& st->swap_read_cnt == 0 && st->swap_write_cnt == 0)
+		return;
+	for (e = paging_log; e < paging_log + PAGING_LOG_CNT; e++) {
+		if (e->name[0] == '\0')
+			strlcpy (e->name, name, sizeof e->name);
+		if (!strcmp (e->name, name)) {
+			e->minor_cnt += st->minor_fault_cnt;
+			e->major_cnt += st->major_fault_cnt;
+			e->read_cnt += st->swap_read_cnt;
+			e->write_cnt += st->swap_write_cnt;
+			return;
+		}
+	}
+}
+
 /* Helpers */
-static struct frame *vm_get_victim (void);
 static bool vm_do_claim_page (struct page *page);
+static bool vm_do_claim_frame (struct page *page, struct frame *frame);
 static struct frame *vm_evict_frame (void);
+static bool mlock_allowed (struct supplemental_page_table *spt, size_t cnt);
+static void page_lock (struct page *page);
+static void page_unlock (struct page *page);
 
 /* Create the pending page object with initializer. If you want to create a
  * page, do not create it directly and make it through this function or
@@ -50,94 +124,1180 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 
 	/* Check wheter the upage is already occupied or not. */
 	if (spt_find_page (spt, upage) == NULL) {
-		/* TODO: Create the page, fetch the initialier according to the VM type,
-		 * TODO: and then create "uninit" page struct by calling uninit_new. You
-		 * TODO: should modify the field after calling the uninit_new. */
+		bool (*initializer) (struct page *, enum vm_type, void *);
+		struct page *page;
+
+		switch (VM_TYPE (type)) {
+			case VM_ANON:
+				initializer = anon_initializer;
+				break;
+			case VM_FILE:
+				initializer = file_backed_initializer;
+				break;
+			default:
+				goto err;
+		}
+
+		page = malloc (sizeof *page);
+		if (page == NULL)
+			goto err;
+		uninit_new (page, upage, init, type, aux, initializer);
+		page->spt = spt;
+		page->pml4 = thread_current ()->pml4;
+		page->writable = writable;
+		page->locked = false;
 
-		/* TODO: Insert the page into the spt. */
+		if (!spt_insert_page (spt, page)) {
+			free (page);
+			goto err;
+		}
+		if (spt->lock_future && mlock_allowed (spt, 1))
+			page_lock (page);
+		return true;
 	}
 err:
 	return false;
 }
 
+/* Supplemental page table.
+ *
+ * Level 0 is the root and level SPT_LEVELS - 1 holds the leaves.
+ * Interior entries point to nodes of the next level; leaf entries
+ * point to struct pages.  A node is freed as soon as its last entry
+ * is cleared, so an empty table has no nodes at all. */
+
+#define SPT_LEVELS 4
+#define SPT_FANOUT (PGSIZE / sizeof (void *))
+
+/* Returns the index into a node at LEVEL for virtual address VA. */
+static inline size_t
+spt_index (uint64_t va, int level) {
+	return (va >> (PML4SHIFT - 9 * level)) & (SPT_FANOUT - 1);
+}
+
+/* Returns the number of bytes of address space covered by one entry
+ * of a node at LEVEL. */
+static inline uint64_t
+spt_span (int level) {
+	return 1ULL << (PML4SHIFT - 9 * level);
+}
+
+/* Returns true if NODE has no entries. */
+static bool
+spt_node_empty (void **node) {
+	for (size_t i = 0; i < SPT_FANOUT; i++)
+		if (node[i] != NULL)
+			return false;
+	return true;
+}
+
+static void
+spt_free_node (struct supplemental_page_table *spt, void **node) {
+	palloc_free_page (node);
+	spt->node_cnt--;
+}
+
 /* Find VA from spt and return page. On error, return NULL. */
 struct page *
-spt_find_page (struct supplemental_page_table *spt UNUSED, void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function. */
+spt_find_page (struct supplemental_page_table *spt, void *va) {
+	void **node = spt->root;
+	int level;
 
-	return page;
+	if (!is_user_vaddr (va))
+		return NULL;
+	for (level = 0; node != NULL && level < SPT_LEVELS - 1; level++)
+		node = node[spt_index ((uint64_t) va, level)];
+	return node != NULL ? node[spt_index ((uint64_t) va, level)] : NULL;
 }
 
-/* Insert PAGE into spt with validation. */
+/* Insert PAGE into spt with validation.  Fails if PAGE->va is already
+ * in the table or if a node cannot be allocated. */
 bool
-spt_insert_page (struct supplemental_page_table *spt UNUSED,
-		struct page *page UNUSED) {
-	int succ = false;
-	/* TODO: Fill this function. */
+spt_insert_page (struct supplemental_page_table *spt,
+		struct page *page) {
+	uint64_t va = (uint64_t) page->va;
+	void ***slot = &spt->root;
+	int level;
+
+	ASSERT (pg_ofs (page->va) == 0);
+	if (!is_user_vaddr (page->va))
+		return false;
 
-	return succ;
+	for (level = 0; level < SPT_LEVELS; level++) {
+		if (*slot == NULL) {
+			*slot = palloc_get_page (PAL_ZERO);
+			if (*slot == NULL)
+				return false;
+			spt->node_cnt++;
+		}
+		slot = (void ***) &(*slot)[spt_index (va, level)];
+	}
+	if (*slot != NULL)
+		return false;
+	*slot = (void **) page;
+	spt->page_cnt++;
+	return true;
 }
 
+/* Removes PAGE from SPT and deallocates it. */
 void
 spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
+	uint64_t va = (uint64_t) page->va;
+	void **path[SPT_LEVELS];
+	void **node = spt->root;
+	int level;
+
+	for (level = 0; level < SPT_LEVELS; level++) {
+		ASSERT (node != NULL);
+		path[level] = node;
+		node = node[spt_index (va, level)];
+	}
+	ASSERT ((struct page *) node == page);
+
+	/* Clear the leaf entry, then free the nodes it leaves empty. */
+	for (level = SPT_LEVELS - 1; level >= 0; level--) {
+		path[level][spt_index (va, level)] = NULL;
+		if (!spt_node_empty (path[level]))
+			break;
+		spt_free_node (spt, path[level]);
+	}
+	if (level < 0)
+		spt->root = NULL;
+	spt->page_cnt--;
+
+	if (page->locked)
+		page_unlock (page);
 	vm_dealloc_page (page);
+}
+
+/* Returns the range of entries [*FIRST, *LAST) of the node at LEVEL
+ * covering BASE onward that overlap [START, END). */
+static void
+spt_node_range (int level, uint64_t base, uint64_t start, uint64_t end,
+		size_t *first, size_t *last) {
+	uint64_t span = spt_span (level);
+
+	*first = start > base ? (start - base) / span : 0;
+	*last = end - base < span * SPT_FANOUT
+		? (end - base + span - 1) / span : SPT_FANOUT;
+}
+
+/* Calls ACTION for each page of NODE, a node at LEVEL whose first
+ * entry covers BASE, that lies in [START, END). */
+static void
+spt_for_each_node (void **node, int level, uint64_t base, uint64_t start,
+		uint64_t end, spt_action_func *action, void *aux) {
+	size_t i, first, last;
+
+	spt_node_range (level, base, start, end, &first, &last);
+	for (i = first; i < last; i++) {
+		if (node[i] == NULL)
+			continue;
+		if (level == SPT_LEVELS - 1)
+			action (node[i], aux);
+		else
+			spt_for_each_node (node[i], level + 1, base + i * spt_span (level),
+					start, end, action, aux);
+	}
+}
+
+/* Calls ACTION for each page of SPT in [START, END), in increasing
+ * address order.  ACTION must not insert or remove pages. */
+void
+spt_for_each (struct supplemental_page_table *spt, void *start, void *end,
+		spt_action_func *action, void *aux) {
+	if (spt->root != NULL && start < end)
+		spt_for_each_node (spt->root, 0, 0, (uint64_t) start, (uint64_t) end,
+				action, aux);
+}
+
+/* Removes and deallocates each page of NODE, a node at LEVEL whose
+ * first entry covers BASE, that lies in [START, END), and frees the
+ * child nodes this empties.  Returns true if NODE is left empty. */
+static bool
+spt_remove_node (struct supplemental_page_table *spt, void **node,
+		int level, uint64_t base, uint64_t start, uint64_t end) {
+	size_t i, first, last;
+
+	spt_node_range (level, base, start, end, &first, &last);
+	for (i = first; i < last; i++) {
+		if (node[i] == NULL)
+			continue;
+		if (level == SPT_LEVELS - 1) {
+			struct page *page = node[i];
+
+			if (page->locked)
+				page_unlock (page);
+			vm_dealloc_page (page);
+			spt->page_cnt--;
+		} else if (spt_remove_node (spt, node[i], level + 1,
+					base + i * spt_span (level), start, end))
+			spt_free_node (spt, node[i]);
+		else
+			continue;
+		node[i] = NULL;
+	}
+	return spt_node_empty (node);
+}
+
+/* Removes and deallocates every page of SPT in [START, END). */
+void
+spt_remove_range (struct supplemental_page_table *spt, void *start,
+		void *end) {
+	if (spt->root != NULL && start < end
+			&& spt_remove_node (spt, spt->root, 0, 0, (uint64_t) start,
+				(uint64_t) end)) {
+		spt_free_node (spt, spt->root);
+		spt->root = NULL;
+	}
+}
+
+/* Clock hand: the next frame on the frame table that the eviction
+ * policy will examine. */
+static struct frame *clock_hand;
+
+/* Eviction statistics, besides those in vm_stats. */
+static long long evict_clean_cnt;   /* Needed no write-back. */
+
+/* Fault-around statistics. */
+static long long around_fault_cnt;  /* Faults that mapped pages ahead. */
+static long long around_map_cnt;    /* Pages mapped ahead. */
+static long long around_used_cnt;   /* ...and used before the next fault. */
+
+/* Copy-on-write statistics. */
+static long long cow_share_cnt;     /* Pages shared by fork. */
+static long long cow_copy_cnt;      /* Copied on a write fault. */
+static long long cow_reuse_cnt;     /* Taken over by the last sharer. */
+
+/* Returns true if FRAME can be evicted without writing it anywhere:
+ * no page mapping it is dirty, and every anonymous one still has its
+ * copy in swap.  The caller must hold FRAME_LOCK. */
+static bool
+frame_is_clean (const struct frame *frame) {
+	struct page *page;
+
+	if (frame_is_dirty (frame))
+		return false;
+	for (page = frame->page; page != NULL; page = page->frame_next)
+		if (page_get_type (page) == VM_ANON && !anon_has_swap_copy (page))
+			return false;
 	return true;
 }
 
-/* Get the struct frame, that will be evicted. */
+/* Returns the frame under the clock hand and advances the hand.  The
+ * caller must hold FRAME_LOCK and the frame table must not be empty. */
 static struct frame *
+clock_advance (void) {
+	struct frame *frame = clock_hand;
+
+	/* The hand's frame may have left the table since the last call. */
+	if (frame == NULL || !(frame->flags & FRAME_LRU))
+		frame = frame_table_next (NULL);
+	clock_hand = frame_table_next (frame);
+	return frame;
+}
+
+/* Get the struct frame, that will be evicted.
+ *
+ * Second-chance clock over the frame table that also prefers frames
+ * that can be dropped without write-back.  Odd sweeps clear the
+ * accessed bits they pass; even sweeps leave them alone:
+ *
+ *   1. Look for a frame that is neither accessed nor needs writing.
+ *   2. Look for a frame that is not accessed, clearing accessed bits.
+ *   3. and 4. Repeat, now that every accessed bit has been cleared.
+ *
+ * Returns a null pointer if every frame on the table is pinned.  The
+ * caller must hold FRAME_LOCK. */
+struct frame *
 vm_get_victim (void) {
-	struct frame *victim = NULL;
-	 /* TODO: The policy for eviction is up to you. */
+	size_t frame_cnt = frame_table_size ();
+	int sweep;
 
-	return victim;
+	for (sweep = 0; sweep < 4 && frame_cnt > 0; sweep++) {
+		bool want_clean = sweep % 2 == 0;
+		size_t i;
+
+		for (i = 0; i < frame_cnt; i++) {
+			struct frame *frame = clock_advance ();
+
+			if (frame->flags & FRAME_PINNED)
+				continue;
+			if (frame_is_accessed (frame)) {
+				if (!want_clean)
+					frame_clear_accessed (frame);
+				continue;
+			}
+			if (want_clean && !frame_is_clean (frame))
+				continue;
+			return frame;
+		}
+	}
+	return NULL;
+}
+
+/* Maps VICTIM again for the pages on it from FIRST up to but not
+ * including STOP, with the dirty bit DIRTY, after a failed eviction.
+ * A frame that is still shared stays read-only. */
+static void
+evict_undo (struct frame *victim, struct page *first, struct page *stop,
+		bool dirty) {
+	struct page *page;
+
+	for (page = first; page != stop; page = page->frame_next) {
+		pml4_set_page (page->pml4, page->va, frame_kva (victim),
+				page->writable && victim->refcnt == 1);
+		pml4_set_dirty (page->pml4, page->va, dirty);
+	}
 }
 
 /* Evict one page and return the corresponding frame.
- * Return NULL on error.*/
+ * Return NULL on error.
+ *
+ * Every page mapping the victim is unmapped before any of them is
+ * swapped out, so that no process can modify the frame while it is
+ * being written.  The victim is then marked FRAME_EVICTING and
+ * FRAME_LOCK is released for the writes, so that only faults on the
+ * victim's own pages wait for them, in frame_wait_evict().  swap_out()
+ * only saves the contents; unlinking the pages from the frame is done
+ * here, once they are all out. */
 static struct frame *
 vm_evict_frame (void) {
-	struct frame *victim UNUSED = vm_get_victim ();
-	/* TODO: swap out the victim and return the evicted frame. */
+	struct frame *victim;
+	struct page *page;
+	bool dirty, clean;
 
-	return NULL;
+	lock_acquire (&frame_lock);
+	victim = vm_get_victim ();
+	if (victim == NULL) {
+		lock_release (&frame_lock);
+		return NULL;
+	}
+	frame_table_remove (victim);
+
+	dirty = frame_is_dirty (victim);
+	clean = frame_is_clean (victim);
+	for (page = victim->page; page != NULL; page = page->frame_next)
+		if (!pml4_clear_page (page->pml4, page->va))
+			break;
+	if (page != NULL) {
+		/* No memory to split the 2 MB page PAGE lies in. */
+		evict_undo (victim, victim->page, page, dirty);
+		frame_table_insert (victim);
+		lock_release (&frame_lock);
+		return NULL;
+	}
+	victim->flags |= FRAME_EVICTING;
+	lock_release (&frame_lock);
+
+	/* The sharer chain cannot change while the victim is marked. */
+	for (page = victim->page; page != NULL; page = page->frame_next)
+		if (!swap_out (page))
+			break;
+
+	lock_acquire (&frame_lock);
+	while (victim->page != page) {
+		struct page *out = victim->page;
+
+		vm_stat_inc (out->spt, evict_cnt[page_get_type (out)]);
+		frame_remove_page (victim, out);
+	}
+	if (page != NULL) {
+		/* Give the frame back to the pages still using it. */
+		evict_undo (victim, page, NULL, dirty);
+		frame_table_insert (victim);
+		frame_evict_done (victim);
+		lock_release (&frame_lock);
+		return NULL;
+	}
+	frame_evict_done (victim);
+	if (clean)
+		evict_clean_cnt++;
+	lock_release (&frame_lock);
+
+	return victim;
+}
+
+/* Background reclaim.
+ *
+ * Evicting in the faulting thread puts the victim's write-back on the
+ * fault's latency.  Instead, the reclaim daemon keeps a reserve of free
+ * user frames: vm_get_frame() wakes it when the free count drops below
+ * reclaim_low, and it evicts until the count is back at reclaim_high.
+ * A fault that finds the pool empty anyway evicts for itself.  Both
+ * watermarks are in pages and may be set on the kernel command line;
+ * by default they are 1/32 and 1/16 of the user pool.  A low watermark
+ * of 0 disables the daemon.  Address spaces waiting for the reaper are
+ * torn down before any live page is evicted. */
+
+#define RECLAIM_DEFAULT SIZE_MAX
+
+size_t reclaim_low = RECLAIM_DEFAULT;
+size_t reclaim_high = RECLAIM_DEFAULT;
+
+static struct semaphore reclaim_sema;   /* Upped to wake the daemon. */
+static bool reclaim_pending;            /* Daemon woken, not yet done. */
+
+/* Reclaim statistics. */
+static long long reclaim_wake_cnt;      /* Daemon wake-ups. */
+static long long reclaim_frame_cnt;     /* Frames freed by the daemon. */
+static long long reclaim_direct_cnt;    /* Evictions in faulting threads. */
+
+static void reclaim_daemon (void *aux);
+
+/* Sets the watermarks and starts the reclaim daemon. */
+static void
+reclaim_init (void) {
+	if (reclaim_low == RECLAIM_DEFAULT)
+		reclaim_low = memmap_cnt / 32;
+	if (reclaim_high == RECLAIM_DEFAULT)
+		reclaim_high = memmap_cnt / 16;
+	if (reclaim_high < reclaim_low)
+		reclaim_high = reclaim_low;
+
+	sema_init (&reclaim_sema, 0);
+	if (reclaim_low > 0
+			&& thread_create ("reclaimd", PRI_DEFAULT, reclaim_daemon, NULL)
+				== TID_ERROR)
+		PANIC ("cannot start reclaim daemon");
+}
+
+/* Returns true if free user frames are below the low watermark, so
+ * that memory should not be spent on guesses such as read-ahead. */
+bool
+vm_frames_low (void) {
+	return palloc_free_cnt (PAL_USER) < reclaim_low;
+}
+
+/* Wakes the reclaim daemon if free frames are short. */
+static void
+reclaim_check (void) {
+	if (!reclaim_pending && vm_frames_low ()) {
+		reclaim_pending = true;
+		sema_up (&reclaim_sema);
+	}
+}
+
+/* The reclaim daemon's thread function. */
+static void
+reclaim_daemon (void *aux UNUSED) {
+	for (;;) {
+		sema_down (&reclaim_sema);
+		reclaim_wake_cnt++;
+		while (palloc_free_cnt (PAL_USER) < reclaim_high) {
+			struct frame *frame;
+
+			if (reap_one ())
+				continue;
+			frame = vm_evict_frame ();
+			if (frame == NULL)
+				break;
+			frame_free (frame);
+			reclaim_frame_cnt++;
+		}
+		reclaim_pending = false;
+	}
 }
 
 /* palloc() and get frame. If there is no available page, evict the page
- * and return it. This always return valid address. That is, if the user pool
- * memory is full, this function evicts the frame to get the available memory
- * space.*/
+ * and return it.  That is, if the user pool memory is full, this function
+ * evicts a frame to get the available memory space.  Returns NULL if
+ * nothing can be evicted, because every frame is pinned or swap is full;
+ * the fault that wanted the frame then fails. */
 static struct frame *
 vm_get_frame (void) {
-	struct frame *frame = NULL;
-	/* TODO: Fill this function. */
+	struct frame *frame;
+	void *kva = palloc_get_page (PAL_USER);
 
-	ASSERT (frame != NULL);
-	ASSERT (frame->page == NULL);
+	/* The memory of dead processes goes before that of live ones. */
+	while (kva == NULL && reap_one ())
+		kva = palloc_get_page (PAL_USER);
+	if (kva != NULL)
+		frame = kva_to_frame (kva);
+	else {
+		frame = vm_evict_frame ();
+		reclaim_direct_cnt++;
+	}
+	reclaim_check ();
+
+	ASSERT (frame == NULL || frame->page == NULL);
 	return frame;
 }
 
-/* Growing the stack. */
+/* Growing the stack.
+ *
+ * The stack starts as one page below USER_STACK and grows on demand,
+ * up to STACK_MAX bytes, when the process touches the page below it.
+ * An access counts as a stack access if it is no more than 8 bytes
+ * below the stack pointer, since PUSH faults before it moves %rsp. */
+
+#define STACK_MAX (1 << 20)
+
+/* Returns true if a user-mode fault at ADDR with register state F
+ * looks like an access to the stack. */
+static bool
+is_stack_access (const struct intr_frame *f, const void *addr) {
+	return (uint8_t *) addr < (uint8_t *) USER_STACK
+		&& (uint8_t *) addr >= (uint8_t *) USER_STACK - STACK_MAX
+		&& (uint64_t) addr + 8 >= f->rsp;
+}
+
+/* Adds a stack page at ADDR, to be claimed by the fault on it. */
 static void
-vm_stack_growth (void *addr UNUSED) {
+vm_stack_growth (void *addr) {
+	vm_alloc_page (VM_ANON | VM_STACK, pg_round_down (addr), true);
 }
 
-/* Handle the fault on write_protected page */
+/* Handle the fault on write_protected page.
+ *
+ * A writable page is mapped read-only only while its frame is shared
+ * copy-on-write, after a fork or by same-page merging.  If PAGE is the
+ * last page left on the frame, it takes the frame over in place;
+ * otherwise it gets a private copy and leaves the frame to the
+ * others. */
 static bool
-vm_handle_wp (struct page *page UNUSED) {
+vm_handle_wp (struct page *page) {
+	struct frame *old, *new;
+
+	if (page->frame == zero_frame) {
+		vm_unmap_page (page);
+		zero_upgrade_cnt++;
+		return vm_do_claim_page (page);
+	}
+
+	lock_acquire (&frame_lock);
+	frame_wait_evict (page);
+	old = page->frame;
+	if (old == NULL) {
+		/* Evicted since the fault.  Bring it back in, unshared. */
+		lock_release (&frame_lock);
+		return vm_do_claim_page (page);
+	}
+	if (old->refcnt == 1) {
+		bool success = pml4_set_writable (page->pml4, page->va, true);
+
+		if (success)
+			cow_reuse_cnt++;
+		lock_release (&frame_lock);
+		return success;
+	}
+	lock_release (&frame_lock);
+
+	new = vm_get_frame ();
+	if (new == NULL)
+		return false;
+
+	lock_acquire (&frame_lock);
+	frame_wait_evict (page);
+	if (page->frame != old || old->refcnt == 1) {
+		/* Getting a frame evicted OLD or let the other sharers go. */
+		lock_release (&frame_lock);
+		frame_free (new);
+		return vm_handle_wp (page);
+	}
+
+	/* The other sharers map OLD read-only, so it cannot change under
+	 * us.  Once PAGE is unmapped, which may split a 2 MB page, its
+	 * page table exists, so mapping it again cannot fail. */
+	if (!pml4_clear_page (page->pml4, page->va)) {
+		lock_release (&frame_lock);
+		frame_free (new);
+		return false;
+	}
+	memcpy (frame_kva (new), frame_kva (old), PGSIZE);
+	frame_remove_page (old, page);
+	frame_add_page (new, page);
+	pml4_set_page (page->pml4, page->va, frame_kva (new), true);
+	frame_table_insert (new);
+	cow_copy_cnt++;
+	lock_release (&frame_lock);
+	return true;
+}
+
+/* Fault-around.
+ *
+ * A fault on a page of a file region also loads up to REGION->window
+ * of the pages after it that are not in memory yet, so that a program
+ * running through its text or a process reading a mapped file
+ * sequentially takes one fault per window instead of one per page.
+ * The window doubles, up to FAULT_AROUND_MAX, every time a fault lands
+ * just past the pages mapped ahead of the last one, and halves, down
+ * to nothing, when one lands anywhere else.  Pages mapped ahead never
+ * take frames from the reclaim reserve.  The state lives in the
+ * region, so forked processes sharing it steer it together, which only
+ * blurs the heuristic.
+ *
+ * madvise() overrides the heuristic for a region: after MADV_RANDOM
+ * nothing is mapped ahead, and after MADV_SEQUENTIAL the window stays
+ * at its widest and the pages well behind each fault are marked for
+ * early eviction. */
+
+#define FAULT_AROUND_MAX 16
+
+/* madvise() statistics. */
+static long long madv_call_cnt;         /* Calls. */
+static long long madv_fault_cnt[VM_ADV_SEQUENTIAL + 1];
+                                        /* Region faults, by advice. */
+static long long madv_willneed_cnt;     /* Pages read by WILLNEED. */
+static long long madv_dontneed_cnt;     /* Pages dropped by DONTNEED. */
+static long long madv_behind_cnt;       /* Pages deactivated behind
+                                           sequential faults. */
+
+/* Counts the pages mapped ahead of the last fault in REGION that have
+ * been accessed since, in the address space of SPT. */
+static void
+fault_around_account (struct supplemental_page_table *spt,
+		struct file_region *region) {
+	size_t i;
+
+	for (i = 0; i < region->ahead_cnt; i++) {
+		struct page *page = spt_find_page (spt,
+				region->ahead_start + i * PGSIZE);
+
+		if (page != NULL && page->frame != NULL
+				&& pml4_is_accessed (page->pml4, page->va))
+			around_used_cnt++;
+	}
 }
 
-/* Return true on success */
+/* Clears the accessed bits of the pages of REGION from
+ * 2 * FAULT_AROUND_MAX to FAULT_AROUND_MAX pages behind PAGE, so that
+ * the eviction policy takes them first.  A process reading REGION
+ * sequentially is not coming back for them. */
+static void
+vm_deactivate_behind (struct page *page, struct file_region *region) {
+	size_t idx = ((uint8_t *) page->va - region->start) / PGSIZE;
+	size_t i;
+
+	if (idx <= FAULT_AROUND_MAX)
+		return;
+
+	lock_acquire (&frame_lock);
+	for (i = idx > 2 * FAULT_AROUND_MAX ? idx - 2 * FAULT_AROUND_MAX : 0;
+			i < idx - FAULT_AROUND_MAX; i++) {
+		struct page *behind = spt_find_page (page->spt,
+				region->start + i * PGSIZE);
+
+		if (behind != NULL && behind->frame != NULL
+				&& behind->frame != zero_frame
+				&& frame_is_accessed (behind->frame)) {
+			frame_clear_accessed (behind->frame);
+			madv_behind_cnt++;
+		}
+	}
+	lock_release (&frame_lock);
+}
+
+/* Maps pages of REGION ahead of PAGE, which has just been claimed on a
+ * fault. */
+static void
+vm_fault_around (struct page *page, struct file_region *region) {
+	uint8_t *end = region->start + region->page_cnt * PGSIZE;
+	uint8_t *va = page->va;
+	size_t i;
+
+	fault_around_account (page->spt, region);
+
+	if (region->advice == VM_ADV_RANDOM)
+		region->window = 0;
+	else if (region->advice == VM_ADV_SEQUENTIAL) {
+		region->window = FAULT_AROUND_MAX;
+		vm_deactivate_behind (page, region);
+	} else if (va == region->next_fault)
+		region->window = region->window == 0 ? 1
+			: region->window * 2 < FAULT_AROUND_MAX ? region->window * 2
+			: FAULT_AROUND_MAX;
+	else
+		region->window /= 2;
+
+	region->ahead_start = va + PGSIZE;
+	region->ahead_cnt = 0;
+	for (i = 1; i <= region->window && va + i * PGSIZE < end; i++) {
+		struct page *next = spt_find_page (page->spt, va + i * PGSIZE);
+		void *kva;
+
+		if (next == NULL || next->frame != NULL
+				|| page_file_region (next) != region)
+			break;
+		if (file_share_frame (next)) {
+			region->ahead_cnt++;
+			continue;
+		}
+		if (vm_frames_low ())
+			break;
+		kva = palloc_get_page (PAL_USER);
+		if (kva == NULL || !vm_do_claim_frame (next, kva_to_frame (kva)))
+			break;
+		region->ahead_cnt++;
+	}
+	region->next_fault = va + (region->ahead_cnt + 1) * PGSIZE;
+
+	if (region->ahead_cnt > 0) {
+		around_fault_cnt++;
+		around_map_cnt += region->ahead_cnt;
+	}
+}
+
+/* Returns true if PAGE is anonymous memory that has never been loaded
+ * and would read as all zeros: fresh anonymous memory, or a page of an
+ * executable segment past the end of the file data.  A pending
+ * anonymous page with an initializer loads from its region. */
+static bool
+page_is_zero (struct page *page) {
+	struct file_region *region;
+
+	if (VM_TYPE (page->operations->type) != VM_UNINIT
+			|| VM_TYPE (page->uninit.type) != VM_ANON)
+		return false;
+	region = page->uninit.aux;
+	if (page->uninit.init == NULL)
+		return region == NULL;
+	return region != NULL && file_region_is_zero (region, page->va);
+}
+
+/* Resolves a fault for vm_try_handle_fault().  Return true on
+ * success. */
+static bool
+vm_handle_fault (struct intr_frame *f, void *addr, bool user, bool write,
+		bool not_present) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct file_region *region;
+	struct page *page;
+	bool success;
+
+	if (addr == NULL || !is_user_vaddr (addr))
+		return false;
+
+	page = spt_find_page (spt, pg_round_down (addr));
+	if (page == NULL && user && is_stack_access (f, addr)) {
+		vm_stack_growth (addr);
+		page = spt_find_page (spt, pg_round_down (addr));
+		if (page != NULL)
+			vm_stat_inc (spt, stack_fault_cnt);
+	}
+	if (page == NULL || (write && !page->writable))
+		return false;
+
+	if (!not_present)
+		return write && vm_handle_wp (page);
+
+	if (!write && page_is_zero (page)) {
+		if (!pml4_set_page (page->pml4, page->va, frame_kva (zero_frame),
+					false))
+			return false;
+		page->frame = zero_frame;
+		zero_map_cnt++;
+		return true;
+	}
+
+	/* Claiming the page may drop its reference to its region. */
+	region = page_file_region (page);
+	if (region != NULL) {
+		file_region_get (region);
+		madv_fault_cnt[region->advice]++;
+	}
+	success = vm_do_claim_page (page);
+	if (region != NULL) {
+		if (success)
+			vm_fault_around (page, region);
+		file_region_put (region);
+	}
+	return success;
+}
+
+/* Adds a fault that took CYCLES to handle to the latency histogram
+ * in ST. */
+static void
+fault_cycles_add (struct vmstat *st, uint64_t cycles) {
+	int bucket = cycles > 0 ? 63 - __builtin_clzll (cycles) : 0;
+
+	if (bucket >= VMSTAT_BUCKETS)
+		bucket = VMSTAT_BUCKETS - 1;
+	st->fault_cycles[bucket]++;
+}
+
+/* Return true on success.  Faults that are resolved are counted as
+ * write-protect faults, if NOT_PRESENT is false, or otherwise as major
+ * faults if they read pages from disk, whether swap or a file, and
+ * minor ones if not, and their latency goes into the histogram. */
 bool
-vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
-		bool user UNUSED, bool write UNUSED, bool not_present UNUSED) {
-	struct supplemental_page_table *spt UNUSED = &thread_current ()->spt;
-	struct page *page = NULL;
-	/* TODO: Validate the fault */
-	/* TODO: Your code goes here */
+vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
+		bool write, bool not_present) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	long long read_cnt = spt->stats.swap_read_cnt + spt->stats.file_read_cnt;
+	uint64_t start = rdtsc ();
+	uint64_t cycles;
 
-	return vm_do_claim_page (page);
+	if (!vm_handle_fault (f, addr, user, write, not_present))
+		return false;
+
+	cycles = rdtsc () - start;
+	if (!not_present)
+		vm_stat_inc (spt, wp_fault_cnt);
+	else if (spt->stats.swap_read_cnt + spt->stats.file_read_cnt != read_cnt)
+		vm_stat_inc (spt, major_fault_cnt);
+	else
+		vm_stat_inc (spt, minor_fault_cnt);
+	fault_cycles_add (&spt->stats, cycles);
+	fault_cycles_add (&vm_stats, cycles);
+	return true;
+}
+
+/* Copies the statistics that WHICH selects, VMSTAT_SELF or VMSTAT_ALL,
+ * to the user buffer STATS.  Returns 0 if successful, -1 if an
+ * argument is bad. */
+int
+vm_get_stats (int which, struct vmstat *stats) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *start = pg_round_down (stats);
+	uint8_t *end = (uint8_t *) stats + sizeof *stats;
+	uint8_t *va;
+
+	if (which != VMSTAT_SELF && which != VMSTAT_ALL)
+		return -1;
+
+	/* Every page of the buffer must be mapped and writable; the copy
+	 * then faults them in as needed. */
+	if (stats == NULL || !is_user_vaddr (end - 1) || end < start)
+		return -1;
+	for (va = start; va < end; va += PGSIZE) {
+		struct page *page = spt_find_page (spt, va);
+		if (page == NULL || !page->writable)
+			return -1;
+	}
+
+	memcpy (stats, which == VMSTAT_SELF ? &spt->stats : &vm_stats,
+			sizeof *stats);
+	return 0;
+}
+
+/* Drops the contents of PAGE for MADV_DONTNEED, unless it is locked.
+ * A page of a file is written back if modified and read in again on
+ * the next fault; anonymous memory reads as zeros afterwards, as in a
+ * fresh page.  Read-only anonymous pages would read as zeros for good,
+ * so they are left alone.  Returns false, keeping PAGE, if it lies in
+ * a 2 MB page that there is no memory to split. */
+static bool
+madvise_dontneed (struct page *page) {
+	struct supplemental_page_table *spt = page->spt;
+	uint64_t *pml4 = page->pml4;
+	bool writable = page->writable;
+
+	/* Locked pages stay in memory until unlocked. */
+	if (page->locked)
+		return true;
+
+	switch (VM_TYPE (page->operations->type)) {
+		case VM_UNINIT:
+			/* Nothing loaded, but perhaps mapped to the zero page. */
+			vm_unmap_page (page);
+			return true;
+		case VM_FILE:
+			if (page->frame == NULL)
+				return true;
+			file_write_back (spt, page->va, (uint8_t *) page->va + PGSIZE);
+			vm_unmap_page (page);
+			break;
+		case VM_ANON:
+			if (!writable)
+				return true;
+			/* Only anonymous memory comes in 2 MB pages. */
+			if (!pml4_clear_page (pml4, page->va))
+				return false;
+			destroy (page);
+			uninit_new (page, page->va, NULL, VM_ANON, NULL, anon_initializer);
+			page->spt = spt;
+			page->pml4 = pml4;
+			page->writable = writable;
+			break;
+		default:
+			return true;
+	}
+	madv_dontneed_cnt++;
+	return true;
+}
+
+/* State of vm_madvise(). */
+struct madvise_aux {
+	enum vm_advice advice;      /* Advice to apply. */
+	bool success;               /* False after a failure. */
+};
+
+/* Applies the advice in AUX, a madvise_aux, to PAGE.  Advice about the
+ * access pattern is kept in the file region, if any, so it applies to
+ * the whole region.  MADV_WILLNEED reads in pages that come from a
+ * file, as far as free frames last. */
+static void
+madvise_page (struct page *page, void *aux_) {
+	struct madvise_aux *aux = aux_;
+	enum vm_advice advice = aux->advice;
+	struct file_region *region = page_file_region (page);
+	void *kva;
+
+	switch (advice) {
+		case VM_ADV_NORMAL:
+		case VM_ADV_RANDOM:
+		case VM_ADV_SEQUENTIAL:
+			if (region != NULL)
+				region->advice = advice;
+			break;
+		case VM_ADV_WILLNEED:
+			if (region == NULL || page->frame != NULL)
+				break;
+			if (file_share_frame (page)) {
+				madv_willneed_cnt++;
+				break;
+			}
+			if (vm_frames_low ())
+				break;
+			kva = palloc_get_page (PAL_USER);
+			if (kva != NULL && vm_do_claim_frame (page, kva_to_frame (kva)))
+				madv_willneed_cnt++;
+			break;
+		case VM_ADV_DONTNEED:
+			if (!madvise_dontneed (page))
+				aux->success = false;
+			break;
+	}
+}
+
+/* Applies ADVICE, one of the VM_ADV_* values, to the pages of the
+ * current process in the LENGTH bytes starting at ADDR, which must be
+ * page-aligned.  Unmapped pages in the range are skipped.  Returns 0
+ * if successful, -1 if an argument is bad or if MADV_DONTNEED ran out
+ * of memory splitting a huge page, in which case the pages it could
+ * not drop are left alone. */
+int
+vm_madvise (void *addr, size_t length, int advice) {
+	uint8_t *end = (uint8_t *) addr + length;
+	struct madvise_aux aux;
+
+	if (pg_ofs (addr) != 0 || advice < VM_ADV_NORMAL
+			|| advice > VM_ADV_DONTNEED || end < (uint8_t *) addr
+			|| !is_user_vaddr (addr)
+			|| (length > 0 && !is_user_vaddr (end - 1)))
+		return -1;
+
+	madv_call_cnt++;
+	aux.advice = advice;
+	aux.success = true;
+	spt_for_each (&thread_current ()->spt, addr, pg_round_up (end),
+			madvise_page, &aux);
+	return aux.success ? 0 : -1;
+}
+
+/* Locking pages in memory.
+ *
+ * mlock() marks each page of a range locked and brings it into a frame
+ * of its own.  A frame that a locked page maps is pinned: it carries
+ * FRAME_PINNED, which frame_add_page() and frame_remove_page() keep up
+ * to date as pages come and go, so the evictor, the merge scan and
+ * compaction all pass it over.  A page stays locked until munlock()
+ * or until it is unmapped; MADV_DONTNEED leaves it alone, and a forked
+ * child does not inherit the lock.  After mlockall (MCL_FUTURE), pages
+ * added to the address space are locked too, from their first fault.
+ *
+ * One process may lock up to mlock_limit pages, by default 1/8 of the
+ * user pool, and all of them together at most half of it, so that
+ * eviction always has frames to work with. */
+
+#define MLOCK_DEFAULT SIZE_MAX
+
+size_t mlock_limit = MLOCK_DEFAULT;
+
+/* mlock() statistics.  Locked page counts are in vm_stats. */
+static long long mlock_call_cnt;        /* Calls to lock pages. */
+static long long mlock_refuse_cnt;      /* ...refused at a limit. */
+
+/* Page counts for an mlock() range. */
+struct mlock_count {
+	size_t page_cnt;                    /* Pages in the range. */
+	size_t locked_cnt;                  /* ...of which locked already. */
+};
+
+/* Sets the default limit. */
+static void
+mlock_init (void) {
+	if (mlock_limit == MLOCK_DEFAULT)
+		mlock_limit = memmap_cnt / 8;
+}
+
+/* Returns true if SPT's process may lock CNT more pages. */
+static bool
+mlock_allowed (struct supplemental_page_table *spt, size_t cnt) {
+	if ((size_t) spt->stats.locked_cnt + cnt > mlock_limit
+			|| (size_t) vm_stats.locked_cnt + cnt > memmap_cnt / 2) {
+		mlock_refuse_cnt++;
+		return false;
+	}
+	return true;
+}
+
+/* Locks PAGE in memory, pinning its frame if it has one. */
+static void
+page_lock (struct page *page) {
+	lock_acquire (&frame_lock);
+	if (!page->locked) {
+		page->locked = true;
+		if (page->frame != NULL && page->frame != zero_frame)
+			page->frame->flags |= FRAME_PINNED;
+		vm_stat_inc (page->spt, locked_cnt);
+	}
+	lock_release (&frame_lock);
+}
+
+/* Unlocks PAGE, unpinning its frame unless another page keeps it
+ * pinned. */
+static void
+page_unlock (struct page *page) {
+	lock_acquire (&frame_lock);
+	if (page->locked) {
+		page->locked = false;
+		if (page->frame != NULL && page->frame != zero_frame)
+			frame_update_pinned (page->frame);
+		vm_stat_dec (page->spt, locked_cnt);
+	}
+	lock_release (&frame_lock);
+}
+
+/* Brings PAGE, which is locked, into a frame of its own: one that is
+ * neither the zero page nor, if PAGE is writable, shared copy-on-write,
+ * so that no later access to it can fault.  Returns false if memory
+ * runs out. */
+static bool
+mlock_fault_in (struct page *page) {
+	bool shared;
+
+	lock_acquire (&frame_lock);
+	frame_wait_evict (page);
+	if (page->frame == NULL) {
+		lock_release (&frame_lock);
+		return vm_do_claim_page (page);
+	}
+	shared = page->frame == zero_frame || page->frame->refcnt > 1;
+	lock_release (&frame_lock);
+	return !shared || !page->writable || vm_handle_wp (page);
+}
+
+/* Counts PAGE into AUX, an mlock_count. */
+static void
+mlock_count_page (struct page *page, void *aux) {
+	struct mlock_count *cnt = aux;
+
+	cnt->page_cnt++;
+	if (page->locked)
+		cnt->locked_cnt++;
+}
+
+/* Locks PAGE and brings it in.  Sets the bool that AUX points to to
+ * false if that fails. */
+static void
+mlock_page (struct page *page, void *aux) {
+	bool *success = aux;
+
+	page_lock (page);
+	if (!mlock_fault_in (page))
+		*success = false;
+}
+
+/* Unlocks PAGE. */
+static void
+munlock_page (struct page *page, void *aux UNUSED) {
+	page_unlock (page);
+}
+
+/* Checks the range of LENGTH bytes at ADDR, which must be
+ * page-aligned, for mlock() or munlock() and counts its pages into
+ * CNT.  Returns false if an argument is bad or the range has a hole. */
+static bool
+mlock_range_count (struct supplemental_page_table *spt, void *addr,
+		size_t length, struct mlock_count *cnt) {
+	uint8_t *end = (uint8_t *) addr + length;
+
+	if (pg_ofs (addr) != 0 || end < (uint8_t *) addr
+			|| !is_user_vaddr (addr)
+			|| (length > 0 && !is_user_vaddr (end - 1)))
+		return false;
+
+	cnt->page_cnt = cnt->locked_cnt = 0;
+	spt_for_each (spt, addr, pg_round_up (end), mlock_count_page, cnt);
+	return cnt->page_cnt
+		== (size_t) ((uint8_t *) pg_round_up (end) - (uint8_t *) addr) / PGSIZE;
+}
+
+/* Locks the pages of the current process in the LENGTH bytes starting
+ * at ADDR, which must be page-aligned, in memory.  Every page in the
+ * range must be mapped.  Returns 0 if successful, -1 if an argument
+ * is bad, the limit would be exceeded or memory runs out; pages that
+ * could not be brought in then stay locked and are pinned once they
+ * fault in. */
+int
+vm_mlock (void *addr, size_t length) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct mlock_count cnt;
+	bool success = true;
+
+	if (!mlock_range_count (spt, addr, length, &cnt))
+		return -1;
+	mlock_call_cnt++;
+	if (!mlock_allowed (spt, cnt.page_cnt - cnt.locked_cnt))
+		return -1;
+	spt_for_each (spt, addr, pg_round_up ((uint8_t *) addr + length),
+			mlock_page, &success);
+	return success ? 0 : -1;
+}
+
+/* Unlocks the pages of the current process in the LENGTH bytes
+ * starting at ADDR, which must be page-aligned.  Every page in the
+ * range must be mapped.  Returns 0 if successful, -1 if an argument
+ * is bad. */
+int
+vm_munlock (void *addr, size_t length) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct mlock_count cnt;
+
+	if (!mlock_range_count (spt, addr, length, &cnt))
+		return -1;
+	spt_for_each (spt, addr, pg_round_up ((uint8_t *) addr + length),
+			munlock_page, NULL);
+	return 0;
+}
+
+/* Locks every page of the current process in memory if FLAGS has
+ * VM_MCL_CURRENT, and the pages it adds later if FLAGS has
+ * VM_MCL_FUTURE.  Returns 0 if successful, -1 if FLAGS is bad, the
+ * limit would be exceeded or memory runs out. */
+int
+vm_mlockall (int flags) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	bool success = true;
+
+	if (flags == 0 || (flags & ~(VM_MCL_CURRENT | VM_MCL_FUTURE)) != 0)
+		return -1;
+	mlock_call_cnt++;
+
+	if (flags & VM_MCL_CURRENT) {
+		struct mlock_count cnt = { 0, 0 };
+
+		spt_for_each (spt, NULL, (void *) KERN_BASE, mlock_count_page, &cnt);
+		if (!mlock_allowed (spt, cnt.page_cnt - cnt.locked_cnt))
+			return -1;
+		spt_for_each (spt, NULL, (void *) KERN_BASE, mlock_page, &success);
+	}
+	if (flags & VM_MCL_FUTURE)
+		spt->lock_future = true;
+	return success ? 0 : -1;
+}
+
+/* Unlocks every page of the current process and stops locking new
+ * ones.  Returns 0. */
+int
+vm_munlockall (void) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+
+	spt->lock_future = false;
+	spt_for_each (spt, NULL, (void *) KERN_BASE, munlock_page, NULL);
+	return 0;
 }
 
 /* Free the page.
@@ -148,43 +1308,551 @@ vm_dealloc_page (struct page *page) {
 	free (page);
 }
 
+/* Unmaps PAGE from its page table and drops its reference to its
+ * frame, freeing the frame if no other page maps it.  Does nothing
+ * if PAGE has no frame, once any eviction of PAGE is over.  Called by
+ * the page types' destroy operations, after any write-back that needs
+ * the frame contents. */
+void
+vm_unmap_page (struct page *page) {
+	struct frame *frame;
+	bool last;
+
+	lock_acquire (&frame_lock);
+	frame_wait_evict (page);
+	frame = page->frame;
+	if (frame == NULL) {
+		lock_release (&frame_lock);
+		return;
+	}
+
+	/* Callers unmap a page of a 2 MB page themselves first, when they
+	 * can still fail, so there is nothing left to split here. */
+	pml4_clear_page (page->pml4, page->va);
+	if (frame == zero_frame) {
+		page->frame = NULL;
+		lock_release (&frame_lock);
+		return;
+	}
+	frame_remove_page (frame, page);
+	last = frame->refcnt == 0;
+	lock_release (&frame_lock);
+	if (last)
+		frame_free (frame);
+}
+
+/* Maps PAGE, which has no frame, to FRAME, which already holds
+ * PAGE's contents, and puts FRAME on the frame table.  Used for pages
+ * brought in ahead of a fault.  Returns false if memory for the page
+ * table runs out. */
+bool
+vm_install_page (struct page *page, struct frame *frame) {
+	if (!pml4_set_page (page->pml4, page->va, frame_kva (frame),
+				page->writable))
+		return false;
+
+	lock_acquire (&frame_lock);
+	frame_add_page (frame, page);
+	frame_table_insert (frame);
+	lock_release (&frame_lock);
+	return true;
+}
+
 /* Claim the page that allocate on VA. */
 bool
-vm_claim_page (void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function */
+vm_claim_page (void *va) {
+	struct page *page = spt_find_page (&thread_current ()->spt, va);
 
+	if (page == NULL)
+		return false;
+	if (page->frame == zero_frame)
+		vm_unmap_page (page);
 	return vm_do_claim_page (page);
 }
 
-/* Claim the PAGE and set up the mmu. */
+/* Transparent huge pages.
+ *
+ * Claiming a page of anonymous memory that has never been written,
+ * in a 2 MB aligned block of which every page is such memory,
+ * writable and unmapped but for the zero page, backs the whole block
+ * with 512 physically contiguous frames at once and maps them with a
+ * single page directory entry.  The block then costs one fault and
+ * one TLB entry instead of 512 of each.  Each page keeps its own
+ * struct page and frame, on the frame table like any other, so the
+ * rest of the VM sees nothing unusual: the page table code splits the
+ * 2 MB mapping back into 4 kB pages as soon as one of its pages is
+ * unmapped, moved, write-protected or evicted on its own.  The split
+ * needs a page table, so each of those can fail when memory is short;
+ * the fault, madvise() or eviction then fails rather than the kernel.
+ *
+ * Read faults still map the zero page, so only memory that is
+ * written goes huge.  A block is backed only if a free aligned run is
+ * at hand, without compacting the pool, and the frames do not come
+ * out of the reclaim reserve. */
+
+bool thp_enabled = true;
+
+/* Huge page statistics. */
+static long long thp_fault_cnt;     /* Claims that mapped 2 MB. */
+static long long thp_fallback_cnt;  /* ...that found no 2 MB run free. */
+
+/* Returns true if PAGE may be part of a huge page mapped in PML4. */
+static bool
+thp_page_ok (struct page *page, uint64_t *pml4) {
+	return page != NULL && page->writable && page->pml4 == pml4
+		&& page_is_zero (page)
+		&& (page->frame == NULL || page->frame == zero_frame);
+}
+
+/* Claims PAGE, together with the rest of its 2 MB block, into a huge
+ * page if the block qualifies.  Returns false, having changed
+ * nothing, if it does not or if no huge page can be had. */
+static bool
+thp_claim (struct page *page) {
+	struct supplemental_page_table *spt = page->spt;
+	uint8_t *base = (uint8_t *) ((uint64_t) page->va & ~HPGMASK);
+	uint8_t *kva;
+	size_t i;
+
+	if (!thp_enabled || !thp_page_ok (page, page->pml4))
+		return false;
+	for (i = 0; i < HPG_PAGES; i++)
+		if (!thp_page_ok (spt_find_page (spt, base + i * PGSIZE), page->pml4))
+			return false;
+
+	if (palloc_free_cnt (PAL_USER) < HPG_PAGES + reclaim_low
+			|| (kva = palloc_get_huge (PAL_USER)) == NULL) {
+		thp_fallback_cnt++;
+		return false;
+	}
+
+	/* With the page directory in place, mapping cannot fail below. */
+	if (pml4e_walk_pde (page->pml4, (uint64_t) base, true) == NULL) {
+		palloc_free_multiple (kva, HPG_PAGES);
+		return false;
+	}
+
+	/* Load every page as vm_do_claim_frame() would.  Pages that read
+	 * as zeros load without I/O, so this cannot fail. */
+	for (i = 0; i < HPG_PAGES; i++) {
+		struct page *p = spt_find_page (spt, base + i * PGSIZE);
+		struct frame *frame = kva_to_frame (kva + i * PGSIZE);
+
+		if (p->frame == zero_frame)
+			vm_unmap_page (p);
+		lock_acquire (&frame_lock);
+		frame_add_page (frame, p);
+		lock_release (&frame_lock);
+		if (!swap_in (p, frame_kva (frame)))
+			PANIC ("loading a zero-filled page failed");
+	}
+	if (!pml4_set_huge_page (page->pml4, base, kva, true))
+		PANIC ("mapping a huge page failed");
+
+	lock_acquire (&frame_lock);
+	for (i = 0; i < HPG_PAGES; i++)
+		frame_table_insert (kva_to_frame (kva + i * PGSIZE));
+	lock_release (&frame_lock);
+	thp_fault_cnt++;
+	return true;
+}
+
+/* Claim the PAGE and set up the mmu.  A read-only page of a file
+ * shares a frame that holds it already, if any; fresh anonymous
+ * memory may come in a huge page.  If PAGE is being evicted, waits for
+ * that to finish first; a failed eviction leaves PAGE mapped. */
 static bool
 vm_do_claim_page (struct page *page) {
-	struct frame *frame = vm_get_frame ();
+	struct frame *frame;
+	bool resident;
 
-	/* Set links */
-	frame->page = page;
-	page->frame = frame;
+	lock_acquire (&frame_lock);
+	frame_wait_evict (page);
+	resident = page->frame != NULL;
+	lock_release (&frame_lock);
+	if (resident)
+		return true;
 
-	/* TODO: Insert page table entry to map page's VA to frame's PA. */
+	if (file_share_frame (page) || thp_claim (page))
+		return true;
+	frame = vm_get_frame ();
+	if (frame == NULL)
+		return false;
+	return vm_do_claim_frame (page, frame);
+}
+
+/* Claims PAGE into FRAME, an unused frame, and sets up the mmu.  Frees
+ * FRAME on failure. */
+static bool
+vm_do_claim_frame (struct page *page, struct frame *frame) {
+	/* Set links. */
+	lock_acquire (&frame_lock);
+	frame_add_page (frame, page);
+	lock_release (&frame_lock);
 
-	return swap_in (page, frame->kva);
+	/* Fill the frame before mapping it, and only then put it on the
+	 * frame table, so that nothing sees it half loaded. */
+	if (!swap_in (page, frame_kva (frame))
+			|| !pml4_set_page (page->pml4, page->va, frame_kva (frame),
+				page->writable)) {
+		lock_acquire (&frame_lock);
+		frame_remove_page (frame, page);
+		lock_release (&frame_lock);
+		frame_free (frame);
+		return false;
+	}
+
+	lock_acquire (&frame_lock);
+	frame_table_insert (frame);
+	file_cache_frame (page, frame);
+	lock_release (&frame_lock);
+	return true;
 }
 
 /* Initialize new supplemental page table */
 void
-supplemental_page_table_init (struct supplemental_page_table *spt UNUSED) {
+supplemental_page_table_init (struct supplemental_page_table *spt) {
+	spt->root = NULL;
+	spt->page_cnt = 0;
+	spt->node_cnt = 0;
+	spt->lock_future = false;
+	memset (&spt->stats, 0, sizeof spt->stats);
 }
 
-/* Copy supplemental page table from src to dst */
+/* State of supplemental_page_table_copy(). */
+struct spt_copy {
+	struct supplemental_page_table *dst;   /* Table being filled. */
+	uint64_t *src_pml4;                    /* Page table of the source. */
+	bool success;                          /* False after a failure. */
+};
+
+/* Adds a copy of SRC, a page of the parent, to the table in AUX, an
+ * spt_copy.  A page that was never loaded gets its own pending page;
+ * any other shares SRC's frame copy-on-write, with both mapped
+ * read-only until one of them writes.  SRC's mapping is made read-only
+ * by supplemental_page_table_copy() afterward, all at once. */
+static void
+spt_copy_page (struct page *src, void *aux_) {
+	struct spt_copy *aux = aux_;
+	struct page *dst;
+	struct frame *frame;
+
+	if (!aux->success)
+		return;
+
+	if (VM_TYPE (src->operations->type) == VM_UNINIT) {
+		aux->success = vm_alloc_page_with_initializer (src->uninit.type,
+				src->va, src->writable, src->uninit.init, src->uninit.aux);
+		if (aux->success && src->uninit.aux != NULL)
+			file_region_get (src->uninit.aux);
+		return;
+	}
+
+	dst = malloc (sizeof *dst);
+	if (dst == NULL) {
+		aux->success = false;
+		return;
+	}
+	*dst = *src;
+	dst->frame = NULL;
+	dst->frame_next = NULL;
+	dst->locked = false;
+	dst->spt = aux->dst;
+	dst->pml4 = thread_current ()->pml4;
+	if (page_get_type (dst) == VM_ANON) {
+		/* The copy in swap, if any, stays with SRC. */
+		dst->anon.slot = SLOT_NONE;
+		dst->anon.zchunk = ZCHUNK_NONE;
+	}
+	if (!spt_insert_page (aux->dst, dst)) {
+		free (dst);
+		aux->success = false;
+		return;
+	}
+	if (page_get_type (dst) == VM_FILE)
+		file_region_get (dst->file.region);
+
+	/* A page that is swapped out is brought back in to be shared. */
+	for (;;) {
+		lock_acquire (&frame_lock);
+		frame_wait_evict (src);
+		frame = src->frame;
+		if (frame != NULL)
+			break;
+		lock_release (&frame_lock);
+		if (!vm_do_claim_page (src)) {
+			aux->success = false;
+			return;
+		}
+	}
+
+	if (!pml4_set_page (dst->pml4, dst->va, frame_kva (frame), false)) {
+		lock_release (&frame_lock);
+		aux->success = false;
+		return;
+	}
+	frame_add_page (frame, dst);
+	aux->src_pml4 = src->pml4;
+	cow_share_cnt++;
+	lock_release (&frame_lock);
+}
+
+/* Copy supplemental page table from src to dst.  DST must be the
+ * current thread's table, and its page table must be active.  SRC's
+ * process must not run meanwhile, since its pages stay writable until
+ * the end.  Returns false if memory runs out; the pages copied so far
+ * are left in DST for supplemental_page_table_kill(). */
 bool
-supplemental_page_table_copy (struct supplemental_page_table *dst UNUSED,
-		struct supplemental_page_table *src UNUSED) {
+supplemental_page_table_copy (struct supplemental_page_table *dst,
+		struct supplemental_page_table *src) {
+	struct spt_copy aux;
+
+	ASSERT (dst == &thread_current ()->spt);
+
+	aux.dst = dst;
+	aux.src_pml4 = NULL;
+	aux.success = true;
+	spt_for_each (src, NULL, (void *) KERN_BASE, spt_copy_page, &aux);
+
+	/* Every page of SRC that is mapped now shares its frame. */
+	if (aux.src_pml4 != NULL
+			&& !pml4_protect_range (aux.src_pml4, NULL, (void *) KERN_BASE,
+				false))
+		aux.success = false;
+	return aux.success;
+}
+
+/* Frees every page of SPT, which PML4 maps if it is not null, and
+ * logs its paging under NAME.  Modified pages of mapped files are
+ * written back first, in as few writes as possible.  The table is left
+ * empty and ready for reuse. */
+static void
+spt_destroy (struct supplemental_page_table *spt, uint64_t *pml4,
+		const char *name) {
+	/* Unmap everything in one pass over the page table, so that the
+	 * pages' destructors find nothing left to flush from the TLB.  The
+	 * range leaves no 2 MB page to split, so this cannot fail. */
+	file_write_back (spt, NULL, (void *) KERN_BASE);
+	if (pml4 != NULL)
+		pml4_clear_range (pml4, NULL, (void *) KERN_BASE);
+	spt_remove_range (spt, NULL, (void *) KERN_BASE);
+	ASSERT (spt->root == NULL && spt->page_cnt == 0 && spt->node_cnt == 0);
+	spt->lock_future = false;
+
+	paging_log_record (name, &spt->stats);
+	memset (&spt->stats, 0, sizeof spt->stats);
 }
 
-/* Free the resource hold by the supplemental page table */
+/* Free the resource hold by the supplemental page table.  SPT must be
+ * the current thread's table. */
 void
-supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
-	/* TODO: Destroy all the supplemental_page_table hold by thread and
-	 * TODO: writeback all the modified contents to the storage. */
+supplemental_page_table_kill (struct supplemental_page_table *spt) {
+	ASSERT (spt == &thread_current ()->spt);
+
+	spt_destroy (spt, thread_current ()->pml4, thread_name ());
+}
+
+/* Asynchronous teardown.
+ *
+ * Freeing a large address space takes a while: every frame, swap slot
+ * and page table goes back one at a time, and modified file pages are
+ * written out.  Rather than make an exiting process, and whoever waits
+ * for it, sit through all that, process_cleanup() hands the address
+ * space to the reaper, a kernel thread that tears it down in the
+ * background.  The pages move to a table of the reaper's own, since
+ * the dead thread's struct goes away as soon as it is off the CPU.
+ *
+ * The reaper runs at the lowest priority, so that it works when
+ * nothing else wants to.  Memory that is waiting for it is still the
+ * cheapest there is, though: a thread that finds no free frame, and
+ * the reclaim daemon, tear down a queued address space themselves
+ * before they evict a single live page. */
+
+/* An address space waiting for the reaper. */
+struct reap_job {
+	struct list_elem elem;              /* Element in reap_list. */
+	struct supplemental_page_table spt; /* The dead process's pages. */
+	uint64_t *pml4;                     /* Its page table, or NULL. */
+	char name[16];                      /* Its name, for the paging log. */
+};
+
+static struct list reap_list;           /* Queued reap_jobs. */
+static struct lock reap_lock;           /* Protects reap_list. */
+static struct semaphore reap_sema;      /* Upped for each queued job. */
+
+/* Reaper statistics. */
+static long long reap_queue_cnt;        /* Address spaces queued. */
+static long long reap_done_cnt;         /* ...torn down so far. */
+static long long reap_daemon_cnt;       /* ...of those, by the reaper. */
+static long long reap_sync_cnt;         /* Torn down on exit for lack of
+                                           memory to queue them. */
+static long long reap_page_cnt;         /* Pages handed to the reaper. */
+
+/* Set when the last user process exits, until the reaper has reported
+ * the allocations still live. */
+static bool leak_check_due;
+
+static void reaper (void *aux);
+
+/* Starts the reaper. */
+static void
+reaper_init (void) {
+	list_init (&reap_list);
+	lock_init (&reap_lock);
+	sema_init (&reap_sema, 0);
+	if (thread_create ("reaperd", PRI_MIN, reaper, NULL) == TID_ERROR)
+		PANIC ("cannot start reaper");
+}
+
+/* Points PAGE at the spt that AUX points to, once any eviction of PAGE
+ * that still counts into the old one is over. */
+static void
+spt_repoint_page (struct page *page, void *aux) {
+	frame_wait_evict (page);
+	page->spt = aux;
+}
+
+/* Hands SPT, the current thread's table, and PML4, the page table
+ * that maps it, to the reaper to free.  PML4 must not be active.  SPT
+ * is left empty and ready for reuse.  Returns false, leaving both
+ * alone, if there is nothing to free or no memory to queue them; the
+ * caller must then free them itself. */
+bool
+vm_reap_later (struct supplemental_page_table *spt, uint64_t *pml4) {
+	struct reap_job *job;
+
+	ASSERT (spt == &thread_current ()->spt);
+
+	if (spt->page_cnt == 0 && pml4 == NULL)
+		return false;
+	job = malloc (sizeof *job);
+	if (job == NULL) {
+		reap_sync_cnt++;
+		return false;
+	}
+	job->pml4 = pml4;
+	strlcpy (job->name, thread_name (), sizeof job->name);
+
+	/* The evictor follows page->spt, so move the pages over under
+	 * FRAME_LOCK, after any evictions in progress. */
+	lock_acquire (&frame_lock);
+	job->spt = *spt;
+	spt_for_each (&job->spt, NULL, (void *) KERN_BASE, spt_repoint_page,
+			&job->spt);
+	lock_release (&frame_lock);
+	reap_page_cnt += spt->page_cnt;
+	supplemental_page_table_init (spt);
+
+	lock_acquire (&reap_lock);
+	list_push_back (&reap_list, &job->elem);
+	reap_queue_cnt++;
+	lock_release (&reap_lock);
+	sema_up (&reap_sema);
+	return true;
+}
+
+/* Tears down the address space at the head of the queue, if any.
+ * Returns true if there was one. */
+static bool
+reap_one (void) {
+	struct reap_job *job = NULL;
+
+	lock_acquire (&reap_lock);
+	if (!list_empty (&reap_list))
+		job = list_entry (list_pop_front (&reap_list), struct reap_job, elem);
+	lock_release (&reap_lock);
+	if (job == NULL)
+		return false;
+
+	spt_destroy (&job->spt, job->pml4, job->name);
+	if (job->pml4 != NULL)
+		pml4_destroy (job->pml4);
+	free (job);
+	reap_done_cnt++;
+	if (leak_check_due && reap_done_cnt == reap_queue_cnt)
+		sema_up (&reap_sema);
+	return true;
+}
+
+/* The reaper's thread function.  Other threads may have taken the
+ * job that woke it, which is fine. */
+static void
+reaper (void *aux UNUSED) {
+	for (;;) {
+		sema_down (&reap_sema);
+		if (reap_one ())
+			reap_daemon_cnt++;
+		if (leak_check_due && reap_done_cnt == reap_queue_cnt) {
+			leak_check_due = false;
+			/* Have the exited threads' pages freed first. */
+			thread_yield ();
+			memtrack_report_leaks ();
+		}
+	}
+}
+
+/* Has the reaper report the allocations still live once it has torn
+ * down every address space queued so far.  Called by the last user
+ * process to exit, with interrupts off. */
+void
+vm_reap_leak_check (void) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	leak_check_due = true;
+	sema_up (&reap_sema);
+}
+
+/* Prints virtual memory statistics. */
+void
+vm_print_stats (void) {
+	const long long *evict_cnt = vm_stats.evict_cnt;
+	const struct paging_log_entry *e;
+	int i;
+
+	printf ("VM: %lld evictions (%lld anon, %lld file), %lld clean\n",
+			evict_cnt[VM_ANON] + evict_cnt[VM_FILE] + evict_cnt[VM_PAGE_CACHE],
+			evict_cnt[VM_ANON], evict_cnt[VM_FILE], evict_clean_cnt);
+	printf ("Faults: %lld minor (%lld stack growth), %lld major, "
+			"%lld write-protect; pages read: %lld from swap, %lld from files\n",
+			vm_stats.minor_fault_cnt, vm_stats.stack_fault_cnt,
+			vm_stats.major_fault_cnt, vm_stats.wp_fault_cnt,
+			vm_stats.swap_read_cnt, vm_stats.file_read_cnt);
+	for (i = 0; i < VMSTAT_BUCKETS; i++)
+		if (vm_stats.fault_cycles[i] > 0)
+			printf ("  faults in 2^%-2d cycles: %8lld\n",
+					i, vm_stats.fault_cycles[i]);
+	printf ("Reclaim: watermarks %zu/%zu pages, daemon woken %lld times, "
+			"freed %lld frames; %lld evictions in faulting threads\n",
+			reclaim_low, reclaim_high, reclaim_wake_cnt, reclaim_frame_cnt,
+			reclaim_direct_cnt);
+	printf ("Fault-around: %lld faults mapped %lld pages ahead, "
+			"%lld used\n", around_fault_cnt, around_map_cnt, around_used_cnt);
+	printf ("Zero page: %lld read faults mapped it, %lld upgraded on write\n",
+			zero_map_cnt, zero_upgrade_cnt);
+	printf ("THP: %lld huge pages mapped, %lld times no 2 MB run was free\n",
+			thp_fault_cnt, thp_fallback_cnt);
+	printf ("COW: %lld pages shared by fork, %lld copied on write, "
+			"%lld reused in place\n",
+			cow_share_cnt, cow_copy_cnt, cow_reuse_cnt);
+	printf ("Madvise: %lld calls, %lld pages read by WILLNEED, "
+			"%lld dropped by DONTNEED, %lld deactivated behind; "
+			"region faults %lld normal, %lld random, %lld sequential\n",
+			madv_call_cnt, madv_willneed_cnt, madv_dontneed_cnt,
+			madv_behind_cnt, madv_fault_cnt[VM_ADV_NORMAL],
+			madv_fault_cnt[VM_ADV_RANDOM], madv_fault_cnt[VM_ADV_SEQUENTIAL]);
+	printf ("Reaper: %lld address spaces (%lld pages) queued, "
+			"%lld torn down by the reaper, %lld by threads short of memory; "
+			"%lld torn down on exit\n",
+			reap_queue_cnt, reap_page_cnt, reap_daemon_cnt,
+			reap_done_cnt - reap_daemon_cnt, reap_sync_cnt);
+	printf ("Mlock: %lld pages locked, limit %zu per process; "
+			"%lld calls, %lld refused at a limit\n",
+			vm_stats.locked_cnt, mlock_limit, mlock_call_cnt, mlock_refuse_cnt);
+	merge_print_stats ();
+	file_print_stats ();
+	anon_print_stats ();
+	for (e = paging_log; e < paging_log + PAGING_LOG_CNT && e->name[0]; e++)
+		printf ("  %-16s %8lld minor faults, %8lld major, "
+				"%8lld pages swapped in, %8lld swapped out\n",
+				e->name, e->minor_cnt, e->major_cnt, e->read_cnt, e->write_cnt);
 }